@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Animation.h"
+#include "Debug.h"
+#include "Font.h"
+#include "Scroller.h"
+
+namespace Chemion {
+	namespace {
+		// Frames start on their own cache line.
+		constexpr size_t FRAMES_OFFSET = 64;
+
+		// Whether count items of the given size fit in the file from offset on.
+		bool fits(uint64_t offset, uint64_t count, uint64_t item_size, uint64_t file_size) {
+			return offset <= file_size && count <= (file_size - offset) / item_size;
+		}
+	}
+
+	Animation::Animation(const std::string &path) {
+		const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			DBG("Couldn't open %s: %s", path.c_str(), strerror(errno));
+			return;
+		}
+
+		struct stat status;
+		if (fstat(fd, &status) < 0 || status.st_size < static_cast<off_t>(sizeof(Header))) {
+			DBG("%s is too small to be an animation.", path.c_str());
+			close(fd);
+			return;
+		}
+
+		void *address = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED) {
+			DBG("Couldn't map %s: %s", path.c_str(), strerror(errno));
+			return;
+		}
+
+		const auto *header = static_cast<const Header *>(address);
+		const uint64_t frames_offset = le64toh(header->framesOffset);
+		const uint64_t timeline_offset = le64toh(header->timelineOffset);
+		frameCount = le32toh(header->frameCount);
+		entryCount = le32toh(header->entryCount);
+
+		const char *problem = nullptr;
+		if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0)
+			problem = "not an animation";
+		else if (le32toh(header->version) != FORMAT_VERSION)
+			problem = "an unsupported version";
+		else if (le32toh(header->frameSize) != FRAME_SIZE)
+			problem = "the wrong frame size";
+		else if (!fits(frames_offset, frameCount, FRAME_SIZE, status.st_size)
+			|| !fits(timeline_offset, entryCount, sizeof(Entry), status.st_size))
+			problem = "truncated";
+
+		// A timeline that takes no time would have a looping player spin through it without ever sleeping.
+		if (!problem) {
+			const auto *entries = reinterpret_cast<const Entry *>(static_cast<const uint8_t *>(address) + timeline_offset);
+			for (size_t i = 0; i < entryCount; ++i)
+				duration += std::chrono::milliseconds(le32toh(entries[i].duration));
+			if (duration.count() == 0)
+				problem = "empty or takes no time";
+		}
+
+		if (problem) {
+			DBG("%s is %s.", path.c_str(), problem);
+			duration = std::chrono::milliseconds(0);
+			munmap(address, status.st_size);
+			frameCount = entryCount = 0;
+			return;
+		}
+
+		// The timeline is read front to back.
+		madvise(address, status.st_size, MADV_SEQUENTIAL);
+
+		data = static_cast<const uint8_t *>(address);
+		size = status.st_size;
+		frames = data + frames_offset;
+		timeline = reinterpret_cast<const Entry *>(data + timeline_offset);
+	}
+
+	Animation::~Animation() {
+		if (data)
+			munmap(const_cast<uint8_t *>(data), size);
+	}
+
+	Animation::Entry Animation::getEntry(size_t i) const {
+		return {le32toh(timeline[i].frame), le32toh(timeline[i].duration)};
+	}
+
+	std::span<const uint8_t> Animation::getFrame(size_t i) const {
+		if (frameCount <= i)
+			return {};
+		return {frames + i * FRAME_SIZE, FRAME_SIZE};
+	}
+
+	bool Animation::Builder::addFrame(std::span<const uint8_t> encoded, std::chrono::milliseconds length) {
+		if (encoded.size() != FRAME_SIZE)
+			return false;
+
+		std::array<uint8_t, FRAME_SIZE> frame;
+		std::copy(encoded.begin(), encoded.end(), frame.begin());
+		const auto [iter, inserted] = frameIndex.try_emplace(frame, frames.size());
+		if (inserted)
+			frames.push_back(frame);
+
+		duration += length;
+		const uint64_t milliseconds = length.count();
+
+		// The glasses would sit on the same frame anyway, so one entry will do.
+		if (!timeline.empty() && timeline.back().frame == iter->second
+			&& timeline.back().duration + milliseconds <= UINT32_MAX) {
+			timeline.back().duration += milliseconds;
+			return true;
+		}
+
+		timeline.push_back({iter->second, static_cast<uint32_t>(std::min<uint64_t>(milliseconds, UINT32_MAX))});
+		return true;
+	}
+
+	void Animation::Builder::addImage(std::span<const std::array<bool, 7>> columns, std::chrono::milliseconds length) {
+		addFrame(fromColumns(columns), length);
+	}
+
+	bool Animation::Builder::addText(std::string_view text, std::chrono::milliseconds length) {
+		if (!std::ranges::all_of(text, [](char character) { return font.contains(character); }))
+			return false;
+		return addFrame(encodeString(text), length);
+	}
+
+	bool Animation::Builder::addScroll(std::string_view text, std::chrono::milliseconds edge_delay,
+		std::chrono::milliseconds delay, size_t cycles) {
+		if (!std::ranges::all_of(text, [](char character) { return font.contains(character); }))
+			return false;
+
+		Scroller scroller(text, edge_delay.count(), delay.count());
+		if (scroller.columns.size() <= 24)
+			return addFrame(encodeString(text), 2 * edge_delay * cycles);
+
+		std::vector<uint8_t> frame;
+		auto keep = [&frame](const std::vector<uint8_t> &encoded, size_t) {
+			frame = encoded;
+			return true;
+		};
+
+		// Each cycle turns around twice: at the end of the text and back at the start.
+		for (size_t turns = 0; turns < 2 * cycles;) {
+			const bool increasing = scroller.increasing;
+			scroller.render(keep);
+			addFrame(frame, scroller.hold);
+			if (scroller.increasing != increasing)
+				++turns;
+		}
+		return true;
+	}
+
+	bool Animation::Builder::save(const std::string &path) const {
+		Header header {};
+		std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = htole32(FORMAT_VERSION);
+		header.frameSize = htole32(FRAME_SIZE);
+		header.frameCount = htole32(frames.size());
+		header.entryCount = htole32(timeline.size());
+		header.framesOffset = htole64(FRAMES_OFFSET);
+		header.timelineOffset = htole64(FRAMES_OFFSET + frames.size() * FRAME_SIZE);
+
+		// Players map the file, so replace it whole rather than rewriting it under them.
+		const std::string temporary = path + ".tmp";
+		FILE *file = fopen(temporary.c_str(), "wb");
+		if (!file) {
+			DBG("Couldn't create %s: %s", temporary.c_str(), strerror(errno));
+			return false;
+		}
+
+		const std::array<uint8_t, FRAMES_OFFSET - sizeof(Header)> padding {};
+		bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(padding.data(), padding.size(), 1, file) == 1;
+		for (const auto &frame: frames)
+			written = written && fwrite(frame.data(), frame.size(), 1, file) == 1;
+		for (const Entry &entry: timeline) {
+			const Entry little {htole32(entry.frame), htole32(entry.duration)};
+			written = written && fwrite(&little, sizeof(little), 1, file) == 1;
+		}
+
+		if (fclose(file) != 0 || !written || rename(temporary.c_str(), path.c_str()) < 0) {
+			DBG("Couldn't write %s: %s", path.c_str(), strerror(errno));
+			unlink(temporary.c_str());
+			return false;
+		}
+
+		return true;
+	}
+}
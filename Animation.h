@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Encoder.h"
+
+namespace Chemion {
+	// A show stored as frames that are ready to send. The file holds a Header, a table of distinct FRAME_SIZE-byte
+	// encoded frames and a timeline of (frame, duration) entries, all little-endian. It is mapped rather than read, so
+	// opening only touches the header and timeline whatever the length, and playing a frame is a lookup into the
+	// mapping. A file whose timeline adds up to no time doesn't open.
+	class Animation {
+		public:
+			static constexpr char MAGIC[8] = {'C', 'H', 'E', 'M', 'A', 'N', 'I', 'M'};
+			static constexpr uint32_t FORMAT_VERSION = 1;
+
+			struct [[gnu::packed]] Header {
+				char magic[8];
+				uint32_t version;
+				uint32_t frameSize;
+				uint32_t frameCount;
+				uint32_t entryCount;
+				// From the start of the file.
+				uint64_t framesOffset;
+				uint64_t timelineOffset;
+			};
+
+			struct [[gnu::packed]] Entry {
+				uint32_t frame;
+				// Milliseconds.
+				uint32_t duration;
+			};
+
+			static_assert(sizeof(Header) == 40 && sizeof(Entry) == 8);
+
+			explicit Animation(const std::string &path);
+			~Animation();
+
+			Animation(const Animation &) = delete;
+			Animation & operator=(const Animation &) = delete;
+
+			bool isOpen() const { return data != nullptr; }
+			size_t getFrameCount() const { return frameCount; }
+			size_t getEntryCount() const { return entryCount; }
+			// Of one pass through the timeline; never zero for an open animation.
+			std::chrono::milliseconds getDuration() const { return duration; }
+			// In host byte order.
+			Entry getEntry(size_t i) const;
+			// Empty if the index is out of range, which only a corrupt file has.
+			std::span<const uint8_t> getFrame(size_t i) const;
+
+			// Collects frames and timeline entries and writes them out in the format above.
+			class Builder {
+				private:
+					std::vector<std::array<uint8_t, FRAME_SIZE>> frames;
+					std::map<std::array<uint8_t, FRAME_SIZE>, uint32_t> frameIndex;
+					std::vector<Entry> timeline;
+					std::chrono::milliseconds duration {0};
+
+				public:
+					// A frame shown for as long as the previous entry is merged into it. Returns false if the frame isn't
+					// FRAME_SIZE bytes.
+					bool addFrame(std::span<const uint8_t> encoded, std::chrono::milliseconds);
+					void addImage(std::span<const std::array<bool, 7>> columns, std::chrono::milliseconds);
+					// Returns false if the font lacks any of the characters.
+					bool addText(std::string_view, std::chrono::milliseconds);
+					// Scrolls out to the end of the text and back, cycles times, as Scroller does live. Text that fits is
+					// shown still for as long as the edge pauses would have taken.
+					bool addScroll(std::string_view, std::chrono::milliseconds edge_delay, std::chrono::milliseconds delay,
+						size_t cycles = 1);
+
+					size_t getFrameCount() const { return frames.size(); }
+					size_t getEntryCount() const { return timeline.size(); }
+					std::chrono::milliseconds getDuration() const { return duration; }
+
+					bool save(const std::string &path) const;
+			};
+
+		private:
+			const uint8_t *data = nullptr;
+			size_t size = 0;
+			const uint8_t *frames = nullptr;
+			const Entry *timeline = nullptr;
+			size_t frameCount = 0;
+			size_t entryCount = 0;
+			std::chrono::milliseconds duration {0};
+	};
+}
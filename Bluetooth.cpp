@@ -259,6 +259,7 @@ static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 	// set new value for MTU
 	if (g_attrib_set_mtu(bluetooth.attrib, mtu)) {
 		bluetooth.opt_mtu = mtu;
+		bluetooth.metrics.mtu->set(bt_att_get_mtu(g_attrib_get_att(bluetooth.attrib)));
 		olen = enc_mtu_resp(mtu, opdu, plen);
 	} else {
 		// send NOT SUPPORTED
@@ -269,6 +270,11 @@ static void gatts_mtu_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 		g_attrib_send(bluetooth.attrib, 0, opdu, olen, nullptr, nullptr, nullptr);
 }
 
+static void capture_cb(bool sent, const void *pdu, uint16_t length, void *user_data) {
+	Bluetooth &bluetooth = *reinterpret_cast<Bluetooth *>(user_data);
+	bluetooth.capture->pdu(bluetooth.captureLink, sent, pdu, length);
+}
+
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data) {
 	Bluetooth &bluetooth = *reinterpret_cast<Bluetooth *>(user_data);
 	uint16_t mtu;
@@ -277,10 +283,14 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data) {
 
 	if (err) {
 		bluetooth.setDisconnected();
-		DBG("# Connection error: %s", err->message);
+		LOG_WARN("# Connection error: %s", err->message);
+		bluetooth.cvConnect.notify();
 		return;
 	}
 
+	// With the epoll backend this runs on the GLib helper thread, not the one dispatching ATT.
+	EventLoop::Guard guard;
+
 	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &mtu, BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
 
 	if (gerr) {
@@ -292,6 +302,10 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data) {
 
 	bluetooth.attrib = g_attrib_new(bluetooth.iochannel, mtu, false);
 	auto *attrib = bluetooth.attrib;
+	bluetooth.metrics.mtu->set(bt_att_get_mtu(g_attrib_get_att(attrib)));
+
+	if (bluetooth.capture)
+		bt_att_set_capture(g_attrib_get_att(attrib), capture_cb, user_data, nullptr);
 
 	g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES, events_handler, user_data, nullptr);
 	g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES, events_handler, user_data, nullptr);
@@ -326,16 +340,19 @@ static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond, gpointer us
 }
 
 static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data) {
-	if (status) {
-		DBG("status returned error: %s (0x%02x)", att_ecode2str(status), status);
-		return;
-	}
-
 	Bluetooth &bluetooth = *reinterpret_cast<Bluetooth *>(user_data);
 
-	for (GSList *l = ranges; l; l = l->next) {
-		auto *range = reinterpret_cast<att_range *>(l->data);
-		bluetooth.services.emplace_back(range->start, range->end);
+	// A failed discovery still ends the wait, just with no services.
+	if (status)
+		DBG("status returned error: %s (0x%02x)", att_ecode2str(status), status);
+
+	{
+		std::unique_lock lock(bluetooth.cvServices.mutex);
+		for (GSList *l = ranges; !status && l; l = l->next) {
+			auto *range = reinterpret_cast<att_range *>(l->data);
+			bluetooth.services.emplace_back(range->start, range->end);
+		}
+		bluetooth.services_ready = true;
 	}
 
 	bluetooth.cvServices.notify();
@@ -363,19 +380,96 @@ static void char_cb(uint8_t status, GSList *characteristics, void *user_data) {
 	entry.pair.notify();
 }
 
+struct WriteRequest {
+	Bluetooth *bluetooth;
+	std::shared_ptr<PendingFrame> frame;
+	std::chrono::steady_clock::time_point sent;
+	size_t length;
+	bool answered = false;
+
+	WriteRequest(Bluetooth *bluetooth_, std::shared_ptr<PendingFrame> frame_, size_t length_):
+		bluetooth(bluetooth_), frame(std::move(frame_)), sent(std::chrono::steady_clock::now()), length(length_) {}
+};
+
+static void finishFrameWrite(PendingFrame &frame) {
+	if (--frame.remaining == 0) {
+		std::unique_lock lock(frame.pair.mutex);
+		frame.pair.notify();
+	}
+}
+
+static void write_req_cb(guint8 status, const guint8 *pdu, guint16 len, gpointer user_data) {
+	auto &request = *reinterpret_cast<WriteRequest *>(user_data);
+	const bool success = status == 0 && dec_write_resp(pdu, len) != 0;
+
+	if (!success)
+		LOG_WARN("Write request failed: %s (0x%02x)", att_ecode2str(status), status);
+
+	request.answered = true;
+	request.bluetooth->recordAck(std::chrono::steady_clock::now() - request.sent, success);
+
+	if (success) {
+		request.bluetooth->bytesSent += request.length;
+		request.bluetooth->metrics.pdusWritten->add();
+		request.bluetooth->metrics.bytesWritten->add(request.length);
+	}
+
+	if (!success)
+		request.frame->failed = true;
+
+	finishFrameWrite(*request.frame);
+}
+
+static void write_req_destroy(gpointer user_data) {
+	auto *request = reinterpret_cast<WriteRequest *>(user_data);
+	Bluetooth &bluetooth = *request->bluetooth;
+
+	// The request was cancelled (e.g. by g_attrib_unref) before a response arrived.
+	if (!request->answered) {
+		request->frame->failed = true;
+		finishFrameWrite(*request->frame);
+	}
+
+	delete request;
+
+	--bluetooth.outstanding;
+	bluetooth.metrics.writeQueueDepth->set(bluetooth.writeQueueDepth());
+	{
+		std::unique_lock lock(bluetooth.cvOutstanding.mutex);
+		bluetooth.cvOutstanding.notify();
+	}
+
+	std::unique_lock lock(bluetooth.cvDrained.mutex);
+	bluetooth.cvDrained.notify();
+}
+
+// bt_att reports a command with its own opcode once it's on the socket, and with an error if a disconnect drops it.
+static void write_cmd_result(guint8 status, const guint8 *, guint16, gpointer user_data) {
+	if (status == 0)
+		reinterpret_cast<Bluetooth *>(user_data)->commandWritten = true;
+}
+
+// Runs right after write_cmd_result for a command that was sent, and on its own for one cancelled unsent.
+static void write_cmd_done(gpointer user_data) {
+	auto &bluetooth = *reinterpret_cast<Bluetooth *>(user_data);
+	bluetooth.commandSent(bluetooth.commandWritten.exchange(false));
+}
+
 void Bluetooth::setup(uint16_t index) {
 	mgmt.setup(index);
 }
 
 bool Bluetooth::connectDevice(const char *addr, const char *type) {
 	mgmt.state = Mgmt::State::Connecting;
+	connected = false;
 
 	GError *gerr = nullptr;
-	iochannel = gatt_connect(nullptr, addr, type, "low", 0, opt_mtu, connect_cb, this, &gerr);
-	DBG("gatt_connect returned %p", iochannel);
+	iochannel = transport->connect(addr, type, opt_mtu, connect_cb, this, &gerr);
+	DBG("transport connect returned %p", iochannel);
 	if (iochannel == nullptr) {
 		mgmt.state = Mgmt::State::Disconnected;
-		g_error_free(gerr);
+		if (gerr != nullptr)
+			g_error_free(gerr);
 		return false;
 	}
 
@@ -395,15 +489,22 @@ void Bluetooth::disconnectIO() {
 	if (mgmt.state == Mgmt::State::Disconnected)
 		return;
 
+	EventLoop::Guard guard;
+
 	g_attrib_unref(attrib);
 	attrib = nullptr;
 	opt_mtu = 0;
+	metrics.mtu->set(0);
 
 	g_io_channel_shutdown(iochannel, false, nullptr);
 	g_io_channel_unref(iochannel);
 	iochannel = nullptr;
 
+	connected = false;
 	setDisconnected();
+
+	if (onDisconnect)
+		onDisconnect();
 }
 
 bool Bluetooth::primary(const char *uuid) {
@@ -419,6 +520,14 @@ bool Bluetooth::primary(const char *uuid) {
 		return false;
 	}
 
+	EventLoop::Guard guard;
+	// Each connect() discovers afresh; an earlier connection's services would otherwise pile up here.
+	{
+		std::unique_lock lock(cvServices.mutex);
+		services.clear();
+		services_ready = false;
+	}
+	characteristics.reset();
 	gatt_discover_primary(attrib, &bt_uuid, primary_by_uuid_cb, this);
 	return true;
 }
@@ -435,13 +544,16 @@ Characteristic * Bluetooth::findCharacteristic(std::string_view uuid) {
 }
 
 bool Bluetooth::waitForConnection(size_t milliseconds) {
-	return cvConnect.wait_for(std::chrono::milliseconds(milliseconds), [&] {
-		return connected.load() && mgmt.state == Mgmt::State::Connected;
+	// A failed attempt sets the state back to Disconnected, so there's no need to sit out the whole timeout.
+	cvConnect.wait_for(std::chrono::milliseconds(milliseconds), [&] {
+		return connected.load() || mgmt.state == Mgmt::State::Disconnected;
 	});
+	return connected.load() && mgmt.state == Mgmt::State::Connected;
 }
 
 bool Bluetooth::waitForServices(size_t milliseconds) {
-	return cvServices.wait_for(std::chrono::milliseconds(milliseconds));
+	return cvServices.wait_for(std::chrono::milliseconds(milliseconds), [this] { return services_ready.load(); })
+		&& !services.empty();
 }
 
 bool Bluetooth::findCharacteristics(uint16_t start, uint16_t end, const char *uuid) {
@@ -459,7 +571,10 @@ bool Bluetooth::findCharacteristics(uint16_t start, uint16_t end, const char *uu
 		size_t char_id = nextCharacteristic++;
 		auto &entry = characteristicMap.try_emplace(char_id).first->second;
 		nextEntry = &entry;
-		gatt_discover_char(attrib, start, end, &bt_uuid, char_cb, this);
+		{
+			EventLoop::Guard guard;
+			gatt_discover_char(attrib, start, end, &bt_uuid, char_cb, this);
+		}
 		if (!entry.pair.wait_for(std::chrono::milliseconds(5'000)))
 			return false;
 		characteristics = std::move(entry.characteristics);
@@ -469,7 +584,10 @@ bool Bluetooth::findCharacteristics(uint16_t start, uint16_t end, const char *uu
 	size_t char_id = nextCharacteristic++;
 	auto &entry = characteristicMap.try_emplace(char_id).first->second;
 	nextEntry = &entry;
-	gatt_discover_char(attrib, start, end, nullptr, char_cb, this);
+	{
+		EventLoop::Guard guard;
+		gatt_discover_char(attrib, start, end, nullptr, char_cb, this);
+	}
 	if (!entry.pair.wait_for(std::chrono::milliseconds(5'000)))
 		return false;
 	characteristics = std::move(entry.characteristics);
@@ -482,12 +600,12 @@ bool Bluetooth::writeByte(const Characteristic &characteristic, uint8_t byte) {
 	int handle = characteristic.valueHandle;
 
 	if (mgmt.state != Mgmt::State::Connected) {
-		DBG("writeBytes: bad state");
+		LOG_WARN("writeBytes: bad state");
 		return false;
 	}
 
 	if (handle <= 0) {
-		DBG("writeBytes: invalid handle");
+		LOG_WARN("writeBytes: invalid handle");
 		return false;
 	}
 
@@ -496,11 +614,254 @@ bool Bluetooth::writeByte(const Characteristic &characteristic, uint8_t byte) {
 
 	plen = gatt_attr_data_from_string(buf, &value);
 	if (plen == 0) {
-		DBG("writeBytes: plen == 0");
+		LOG_WARN("writeBytes: plen == 0");
 		return false;
 	}
 
-	gatt_write_cmd(attrib, handle, value, plen, nullptr, nullptr);
+	const bool sent = sendCommand(handle, value, plen);
 	g_free(value);
+	return sent;
+}
+
+bool Bluetooth::writeRequest(const Characteristic &characteristic, std::span<const uint8_t> bytes, std::shared_ptr<PendingFrame> frame) {
+	int handle = characteristic.valueHandle;
+
+	if (mgmt.state != Mgmt::State::Connected) {
+		DBG("writeRequest: bad state");
+		return false;
+	}
+
+	if (handle <= 0) {
+		DBG("writeRequest: invalid handle");
+		return false;
+	}
+
+	if (!cvOutstanding.wait_for(std::chrono::milliseconds(5'000), [this] { return outstanding.load() < maxOutstanding; })) {
+		DBG("writeRequest: timed out waiting for outstanding writes");
+		return false;
+	}
+
+	// The buffer belongs to GAttrib, so hold the loop off from building it until it's queued.
+	EventLoop::Guard guard;
+	size_t buflen;
+	uint8_t *buf = g_attrib_get_buffer(attrib, &buflen);
+	const uint16_t plen = enc_write_req(handle, bytes.data(), bytes.size(), buf, buflen);
+	if (plen == 0) {
+		DBG("writeRequest: plen == 0");
+		return false;
+	}
+
+	// Ownership of the request passes to GAttrib, which releases it through write_req_destroy. If GAttrib refuses it,
+	// the destroy notify never runs, so it's undone here.
+	auto *request = new WriteRequest(this, frame, bytes.size());
+	++outstanding;
+	metrics.writeQueueDepth->set(writeQueueDepth());
+	const guint id = g_attrib_send(attrib, 0, buf, plen, write_req_cb, request, write_req_destroy);
+	if (id == 0) {
+		DBG("writeRequest: g_attrib_send failed");
+		delete request;
+		--outstanding;
+		metrics.writeQueueDepth->set(writeQueueDepth());
+		std::unique_lock lock(cvOutstanding.mutex);
+		cvOutstanding.notify();
+		return false;
+	}
+
+	frame->requests.push_back(id);
+	return true;
+}
+
+bool Bluetooth::batchReliable(std::span<const uint8_t> enc, const Characteristic &rx, size_t count) {
+	for (size_t attempt = 0; attempt <= maxRetries; ++attempt) {
+		if (0 < attempt) {
+			DBG("Retrying frame (attempt %lu of %lu)", attempt, maxRetries);
+			std::unique_lock lock(ackMutex);
+			++ackStats.retries;
+		}
+
+		auto frame = std::make_shared<PendingFrame>();
+		frame->remaining = (enc.size() + count - 1) / count;
+
+		// Queue every chunk before waiting so GAttrib can keep the link busy.
+		for (size_t i = 0; i < enc.size(); i += count) {
+			if (!writeRequest(rx, enc.subspan(i, std::min(count, enc.size() - i)), frame)) {
+				LOG_WARN("Writing failed.");
+				cancelRequests(*frame);
+				return false;
+			}
+		}
+
+		if (!frame->pair.wait_for(std::chrono::milliseconds(5'000), [&] { return frame->remaining.load() == 0; })) {
+			// Resending while the originals are still queued would only put the copies behind them.
+			DBG("Timed out waiting for write responses; cancelling them.");
+			cancelRequests(*frame);
+			continue;
+		}
+
+		if (!frame->failed)
+			return true;
+	}
+
+	LOG_WARN("Frame failed after %lu retries.", maxRetries);
+	return false;
+}
+
+bool Bluetooth::batchCommands(std::span<const uint8_t> enc, const Characteristic &rx, size_t count) {
+	if (mgmt.state != Mgmt::State::Connected) {
+		LOG_WARN("batchCommands: bad state");
+		return false;
+	}
+
+	if (rx.valueHandle == 0) {
+		LOG_WARN("batchCommands: invalid handle");
+		return false;
+	}
+
+	for (size_t i = 0; i < enc.size(); i += count) {
+		if (!sendCommand(rx.valueHandle, enc.data() + i, std::min(count, enc.size() - i))) {
+			LOG_WARN("Writing failed.");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Bluetooth::cancelRequests(PendingFrame &frame) {
+	// Cancelling releases each request through write_req_destroy, which counts it as failed. Ones already answered
+	// are no longer tracked and are skipped.
+	EventLoop::Guard guard;
+	for (const guint id: frame.requests)
+		g_attrib_cancel(attrib, id);
+	frame.requests.clear();
+}
+
+void Bluetooth::recordAck(std::chrono::nanoseconds elapsed, bool success) {
+	std::unique_lock lock(ackMutex);
+	if (success) {
+		++ackStats.acked;
+		ackStats.total += elapsed;
+		ackStats.last = elapsed;
+		ackStats.max = std::max(ackStats.max, elapsed);
+	} else
+		++ackStats.failed;
+}
+
+AckStats Bluetooth::getAckStats() {
+	std::unique_lock lock(ackMutex);
+	return ackStats;
+}
+
+bool Bluetooth::sendCommand(uint16_t handle, const uint8_t *value, size_t length) {
+	if (getMTU() < length + 3) {
+		LOG_WARN("sendCommand: %lu bytes don't fit in the MTU", length);
+		return false;
+	}
+
+	EventLoop::Guard guard;
+	size_t buflen;
+	uint8_t *buf = g_attrib_get_buffer(attrib, &buflen);
+	const uint16_t plen = enc_write_cmd(handle, value, length, buf, buflen);
+	if (plen == 0) {
+		LOG_WARN("sendCommand: plen == 0");
+		return false;
+	}
+
+	// Held until the command is queued, so the entry taken back on failure is this one.
+	std::unique_lock lock(commandMutex);
+	commandQueue.emplace_back(std::chrono::steady_clock::now(), length);
+	++queuedCommands;
+	metrics.writeQueueDepth->set(writeQueueDepth());
+
+	// The destroy notification tells us when the command left bt_att's queue, and write_cmd_result whether it was sent.
+	if (g_attrib_send(attrib, 0, buf, plen, write_cmd_result, this, write_cmd_done) == 0) {
+		LOG_WARN("sendCommand: g_attrib_send failed");
+		commandQueue.pop_back();
+		--queuedCommands;
+		metrics.writeQueueDepth->set(writeQueueDepth());
+		return false;
+	}
+
 	return true;
 }
+
+void Bluetooth::commandSent(bool written) {
+	std::unique_lock lock(commandMutex);
+
+	if (commandQueue.empty())
+		return;
+
+	if (!written) {
+		metrics.commandsDropped->add();
+		commandQueue.pop_front();
+		commandDone();
+		return;
+	}
+
+	const auto latency = std::chrono::steady_clock::now() - commandQueue.front().first;
+	++sendLatency.count;
+	sendLatency.total += latency;
+	sendLatency.last = latency;
+	sendLatency.max = std::max<std::chrono::nanoseconds>(sendLatency.max, latency);
+	metrics.sendLatency->observe(latency);
+
+	bytesSent += commandQueue.front().second;
+	metrics.pdusWritten->add();
+	metrics.bytesWritten->add(commandQueue.front().second);
+	commandQueue.pop_front();
+	commandDone();
+}
+
+void Bluetooth::commandDone() {
+	const size_t remaining = --queuedCommands;
+	metrics.writeQueueDepth->set(writeQueueDepth());
+	if (remaining == 0) {
+		std::unique_lock drained_lock(cvDrained.mutex);
+		cvDrained.notify();
+	}
+}
+
+SendLatency Bluetooth::getSendLatency() {
+	std::unique_lock lock(commandMutex);
+	return sendLatency;
+}
+
+bool Bluetooth::waitForDrain(std::chrono::milliseconds timeout) {
+	return cvDrained.wait_for(timeout, [this] { return writeQueueDepth() == 0; });
+}
+
+void Bluetooth::setCapture(std::shared_ptr<Capture> capture_) {
+	capture = std::move(capture_);
+	if (capture)
+		captureLink = capture->addLink();
+}
+
+void Bluetooth::annotate(std::string_view text) {
+	if (capture)
+		capture->annotate(captureLink, text);
+}
+
+bt_att_alloc_stats Bluetooth::getAttAllocStats() const {
+	bt_att_alloc_stats stats {};
+	if (attrib != nullptr)
+		bt_att_get_alloc_stats(g_attrib_get_att(attrib), &stats);
+	return stats;
+}
+
+uint16_t Bluetooth::getMTU() const {
+	if (attrib == nullptr)
+		return ATT_DEFAULT_LE_MTU;
+	return bt_att_get_mtu(g_attrib_get_att(attrib));
+}
+
+void LinkMetrics::list(const Metrics::Labels &labels) const {
+	Metrics::add("chemion_att_pdus_written_total", "ATT PDUs written to the link.", pdusWritten, labels);
+	Metrics::add("chemion_att_bytes_written_total", "Attribute value bytes written to the link.", bytesWritten, labels);
+	Metrics::add("chemion_att_commands_dropped_total", "Write commands discarded before reaching the link, e.g. on disconnect.",
+		commandsDropped, labels);
+	Metrics::add("chemion_att_write_queue_depth", "Writes queued in bt_att or awaiting acknowledgement.", writeQueueDepth,
+		labels);
+	Metrics::add("chemion_att_mtu", "Negotiated ATT MTU, or 0 while disconnected.", mtu, labels);
+	Metrics::add("chemion_att_send_latency_seconds", "Time from queueing a write command to it reaching the socket.",
+		sendLatency, labels);
+}
@@ -1,12 +1,19 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <glib.h>
 #include <iomanip>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <sstream>
+#include <type_traits>
 #include <vector>
 
 extern "C" {
@@ -18,11 +25,18 @@ extern "C" {
 #include "attrib/gattrib.h"
 #include "attrib/gatt.h"
 #include "attrib/gatttool.h"
+#include "src/shared/att.h"
 }
 
+#include "Capture.h"
 #include "Debug.h"
 #include "CVPair.h"
+#include "EventLoop.h"
+#include "Metrics.h"
 #include "Mgmt.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Transport.h"
 #include "attrib/gattrib.h"
 
 struct Service {
@@ -47,6 +61,43 @@ struct CharacteristicEntry {
 	CharacteristicEntry() = default;
 };
 
+struct AckStats {
+	size_t acked = 0;
+	size_t failed = 0;
+	size_t retries = 0;
+	std::chrono::nanoseconds total {0};
+	std::chrono::nanoseconds last {0};
+	std::chrono::nanoseconds max {0};
+};
+
+struct SendLatency {
+	size_t count = 0;
+	std::chrono::nanoseconds total {0};
+	std::chrono::nanoseconds last {0};
+	std::chrono::nanoseconds max {0};
+};
+
+// Per-link series. They exist from construction so the loop thread never sees them replaced; Glasses lists them in
+// the registry under the device's address once it knows it.
+struct LinkMetrics {
+	std::shared_ptr<Metrics::Counter> pdusWritten = std::make_shared<Metrics::Counter>();
+	std::shared_ptr<Metrics::Counter> bytesWritten = std::make_shared<Metrics::Counter>();
+	std::shared_ptr<Metrics::Counter> commandsDropped = std::make_shared<Metrics::Counter>();
+	std::shared_ptr<Metrics::Gauge> writeQueueDepth = std::make_shared<Metrics::Gauge>();
+	std::shared_ptr<Metrics::Gauge> mtu = std::make_shared<Metrics::Gauge>();
+	std::shared_ptr<Metrics::Histogram> sendLatency = std::make_shared<Metrics::Histogram>();
+
+	void list(const Metrics::Labels &) const;
+};
+
+struct PendingFrame {
+	CVPair pair;
+	std::atomic_size_t remaining {0};
+	std::atomic_bool failed {false};
+	// GAttrib ids of the frame's write requests, for cancelling them. Only touched by the sending thread.
+	std::vector<unsigned int> requests;
+};
+
 template <typename C>
 static std::string toHex(const C &bytes) {
 	std::ostringstream ss;
@@ -57,8 +108,11 @@ static std::string toHex(const C &bytes) {
 
 class Bluetooth {
 	public:
+		enum class WriteMode {Command, Request};
+
 		// I can either make all these public or add a bunch of friend method declarations. Neither option is great.
 		Mgmt mgmt;
+		std::shared_ptr<Transport> transport = std::make_shared<BluezTransport>();
 		GIOChannel *iochannel = nullptr;
 		GAttrib *attrib = nullptr;
 		int opt_mtu = 0;
@@ -71,6 +125,27 @@ class Bluetooth {
 		std::map<size_t, CharacteristicEntry> characteristicMap;
 		std::optional<std::vector<Characteristic>> characteristics;
 		CharacteristicEntry *nextEntry = nullptr;
+		WriteMode writeMode = WriteMode::Command;
+		size_t maxOutstanding = 4;
+		size_t maxRetries = 3;
+		std::atomic_size_t outstanding {0};
+		CVPair cvOutstanding;
+		std::mutex ackMutex;
+		AckStats ackStats;
+		std::atomic_uint64_t bytesSent {0};
+		std::atomic_size_t queuedCommands {0};
+		std::mutex commandMutex;
+		std::deque<std::pair<std::chrono::steady_clock::time_point, size_t>> commandQueue;
+		// Set between a command reaching the socket and its destroy notification, which tells sent and dropped apart.
+		std::atomic_bool commandWritten {false};
+		// Time from a command being queued to bt_att handing it to the socket.
+		SendLatency sendLatency;
+		LinkMetrics metrics;
+		CVPair cvDrained;
+		std::shared_ptr<Capture> capture;
+		uint16_t captureLink = 0;
+		// Called on the loop thread after the link has been torn down.
+		std::function<void()> onDisconnect;
 
 		Bluetooth() = default;
 
@@ -85,6 +160,24 @@ class Bluetooth {
 		bool waitForServices(size_t milliseconds = 5'000);
 		bool findCharacteristics(uint16_t start = 1, uint16_t end = 0xffff, const char *uuid = nullptr);
 		bool writeByte(const Characteristic &, uint8_t);
+		bool writeRequest(const Characteristic &, std::span<const uint8_t>, std::shared_ptr<PendingFrame>);
+		bool batchReliable(std::span<const uint8_t>, const Characteristic &, size_t count);
+		void cancelRequests(PendingFrame &);
+		// Sends the bytes as write commands of up to count bytes each, straight from the caller's buffer.
+		bool batchCommands(std::span<const uint8_t>, const Characteristic &, size_t count);
+		void recordAck(std::chrono::nanoseconds, bool success);
+		AckStats getAckStats();
+		bool sendCommand(uint16_t handle, const uint8_t *value, size_t length);
+		void commandSent(bool written);
+		void commandDone();
+		SendLatency getSendLatency();
+		uint16_t getMTU() const;
+		bt_att_alloc_stats getAttAllocStats() const;
+		size_t writeQueueDepth() const { return queuedCommands + outstanding; }
+		bool waitForDrain(std::chrono::milliseconds timeout);
+		// Must be called before connectDevice(); the capture is attached to each new bearer as it's created.
+		void setCapture(std::shared_ptr<Capture>);
+		void annotate(std::string_view text);
 
 		template <typename C>
 		bool writeBytes(const Characteristic &characteristic, const C &bytes) {
@@ -93,29 +186,44 @@ class Bluetooth {
 			int handle = characteristic.valueHandle;
 
 			if (mgmt.state != Mgmt::State::Connected) {
-				DBG("writeBytes: bad state");
+				LOG_WARN("writeBytes: bad state");
 				return false;
 			}
 
 			if (handle <= 0) {
-				DBG("writeBytes: invalid handle");
+				LOG_WARN("writeBytes: invalid handle");
 				return false;
 			}
 
 			const std::string hex = toHex(bytes);
 			plen = gatt_attr_data_from_string(hex.c_str(), &value);
 			if (plen == 0) {
-				DBG("writeBytes: plen == 0");
+				LOG_WARN("writeBytes: plen == 0");
 				return false;
 			}
 
-			gatt_write_cmd(attrib, handle, value, plen, nullptr, nullptr);
+			const bool sent = sendCommand(handle, value, plen);
 			g_free(value);
-			return true;
+			return sent;
 		}
 
 		template <typename E>
 		bool batch(const E &enc, const Characteristic &rx, size_t count) {
+			PROFILE_SCOPE("batch");
+			const Trace::Span span(Trace::Stage::Batch);
+			if (writeMode == WriteMode::Request) {
+				if constexpr (std::is_convertible_v<const E &, std::span<const uint8_t>>) {
+					return batchReliable(enc, rx, count);
+				} else {
+					const std::vector<uint8_t> copy(std::begin(enc), std::end(enc));
+					return batchReliable(copy, rx, count);
+				}
+			}
+
+			// Contiguous bytes, e.g. a frame mapped from an animation file, go out as they are.
+			if constexpr (std::is_convertible_v<const E &, std::span<const uint8_t>>)
+				return batchCommands(enc, rx, count);
+
 			size_t i = 0;
 			std::vector<uint8_t> bytes;
 			bytes.reserve(count);
@@ -124,7 +232,7 @@ class Bluetooth {
 				for (size_t j = 0; j < count; ++j)
 					bytes.push_back(enc[i++]);
 				if (!writeBytes(rx, bytes)) {
-					DBG("Writing failed.");
+					LOG_WARN("Writing failed.");
 					return false;
 				}
 				bytes.clear();
@@ -134,7 +242,7 @@ class Bluetooth {
 				bytes.push_back(enc[i++]);
 
 			if (!bytes.empty() && !writeBytes(rx, bytes)) {
-				DBG("Final write failed.");
+				LOG_WARN("Final write failed.");
 				return false;
 			}
 
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include "src/shared/btsnoop.h"
+}
+
+#include "Capture.h"
+#include "Debug.h"
+
+namespace {
+	// Microseconds from 0 AD to 2000-01-01, and from the Unix epoch to 2000-01-01 in seconds. Same constants as BlueZ.
+	constexpr int64_t BTSNOOP_EPOCH = 0x00E03AB44A676000ll;
+	constexpr int64_t Y2K = 946684800ll;
+	constexpr uint16_t ATT_CID = 4;
+	constexpr char IDENT[] = "chemion";
+
+	void put32be(std::vector<uint8_t> &out, uint32_t value) {
+		for (int shift = 24; 0 <= shift; shift -= 8)
+			out.push_back((value >> shift) & 0xff);
+	}
+
+	void put64be(std::vector<uint8_t> &out, uint64_t value) {
+		for (int shift = 56; 0 <= shift; shift -= 8)
+			out.push_back((value >> shift) & 0xff);
+	}
+
+	bool writeAll(int fd, const uint8_t *data, size_t length) {
+		while (0 < length) {
+			const ssize_t written = ::write(fd, data, length);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			data += written;
+			length -= written;
+		}
+		return true;
+	}
+}
+
+Capture::Capture(const std::string &path, size_t buffer_size) {
+	pdus.resize(buffer_size);
+	// A few annotations per frame, against a frame's worth of PDUs.
+	notes.resize(buffer_size / 8);
+
+	timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	const int64_t real_us = (real.tv_sec - Y2K) * 1'000'000ll + real.tv_nsec / 1'000;
+	const int64_t mono_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+	epoch = real_us - mono_us + BTSNOOP_EPOCH;
+
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DBG("Capture: couldn't open %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+
+	writeHeader();
+	writer = std::thread(&Capture::run, this);
+}
+
+Capture::~Capture() {
+	if (writer.joinable()) {
+		stopping = true;
+		cvWake.notify();
+		writer.join();
+	}
+
+	if (0 <= fd)
+		close(fd);
+}
+
+uint16_t Capture::addLink() {
+	return nextLink++ & 0x0eff;
+}
+
+void Capture::pdu(uint16_t link, bool sent, const void *data, size_t length) {
+	if (!isOpen())
+		return;
+
+	// Wrap the PDU in the ACL and L2CAP headers a real controller would have put around it.
+	uint8_t headers[8];
+	const uint16_t acl_handle = link | 0x2000;
+	const uint16_t acl_length = length + 4;
+	headers[0] = acl_handle & 0xff;
+	headers[1] = acl_handle >> 8;
+	headers[2] = acl_length & 0xff;
+	headers[3] = acl_length >> 8;
+	headers[4] = length & 0xff;
+	headers[5] = length >> 8;
+	headers[6] = ATT_CID & 0xff;
+	headers[7] = ATT_CID >> 8;
+
+	push(pdus, sent? BTSNOOP_OPCODE_ACL_TX_PKT : BTSNOOP_OPCODE_ACL_RX_PKT, link, headers, sizeof(headers), data, length);
+}
+
+void Capture::annotate(uint16_t link, std::string_view text) {
+	if (!isOpen())
+		return;
+
+	char message[256];
+	const int length = snprintf(message, sizeof(message), "link %u: %.*s", link, static_cast<int>(text.size()), text.data());
+	if (length < 0)
+		return;
+
+	uint8_t prefix[sizeof(btsnoop_opcode_user_logging) + sizeof(IDENT)];
+	auto *logging = reinterpret_cast<btsnoop_opcode_user_logging *>(prefix);
+	logging->priority = BTSNOOP_PRIORITY_INFO;
+	logging->ident_len = sizeof(IDENT);
+	std::memcpy(prefix + sizeof(btsnoop_opcode_user_logging), IDENT, sizeof(IDENT));
+
+	// Keep the terminating null; btmon expects one. The lock is only ever contended by other annotating threads.
+	std::unique_lock lock(notesMutex);
+	push(notes, BTSNOOP_OPCODE_USER_LOGGING, link, prefix, sizeof(prefix), message,
+		std::min<size_t>(length, sizeof(message) - 1) + 1);
+}
+
+Capture::Stats Capture::getStats() const {
+	return {records.load(), bytes.load(), dropped.load()};
+}
+
+void Capture::Ring::resize(size_t minimum) {
+	size_t size = 4096;
+	while (size < minimum)
+		size <<= 1;
+	data.resize(size);
+	mask = size - 1;
+}
+
+void Capture::Ring::copyIn(size_t position, const void *in, size_t length) {
+	const size_t offset = position & mask;
+	const size_t first = std::min(length, data.size() - offset);
+	std::memcpy(&data[offset], in, first);
+	std::memcpy(&data[0], static_cast<const uint8_t *>(in) + first, length - first);
+}
+
+void Capture::Ring::copyOut(size_t position, void *out, size_t length) const {
+	const size_t offset = position & mask;
+	const size_t first = std::min(length, data.size() - offset);
+	std::memcpy(out, &data[offset], first);
+	std::memcpy(static_cast<uint8_t *>(out) + first, &data[0], length - first);
+}
+
+// Each ring has a single producer at a time, so this needs no locking of its own.
+void Capture::push(Ring &ring, uint16_t opcode, uint16_t link, const void *prefix, size_t prefix_length, const void *data,
+	size_t length) {
+	const size_t payload = prefix_length + length;
+	const size_t needed = sizeof(Entry) + payload;
+
+	Entry entry;
+	entry.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	entry.opcode = opcode;
+	entry.link = link;
+	entry.length = payload;
+
+	const size_t position = ring.head.load(std::memory_order_relaxed);
+	if (BTSNOOP_MAX_PACKET_SIZE < payload || ring.data.size() - (position - ring.tail.load(std::memory_order_acquire)) < needed) {
+		++dropped;
+		return;
+	}
+
+	entry.drops = dropped.load(std::memory_order_relaxed);
+	ring.copyIn(position, &entry, sizeof(entry));
+	ring.copyIn(position + sizeof(entry), prefix, prefix_length);
+	ring.copyIn(position + sizeof(entry) + prefix_length, data, length);
+	ring.head.store(position + needed, std::memory_order_release);
+}
+
+void Capture::writeHeader() {
+	std::vector<uint8_t> out {'b', 't', 's', 'n', 'o', 'o', 'p', '\0'};
+	put32be(out, 1);
+	put32be(out, BTSNOOP_FORMAT_MONITOR);
+
+	// Announce a single virtual LE controller at index 0 so the ACL records have something to belong to.
+	btsnoop_opcode_new_index index {};
+	index.type = BTSNOOP_TYPE_PRIMARY;
+	index.bus = BTSNOOP_BUS_VIRTUAL;
+	std::memcpy(index.name, IDENT, sizeof(IDENT));
+
+	auto record = [&](uint16_t opcode, const void *data, uint32_t length) {
+		put32be(out, length);
+		put32be(out, length);
+		put32be(out, opcode);
+		put32be(out, 0);
+		put64be(out, epoch + std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count());
+		out.insert(out.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + length);
+	};
+
+	record(BTSNOOP_OPCODE_NEW_INDEX, &index, sizeof(index));
+	record(BTSNOOP_OPCODE_OPEN_INDEX, nullptr, 0);
+
+	if (!writeAll(fd, out.data(), out.size()))
+		DBG("Capture: couldn't write header: %s", strerror(errno));
+}
+
+void Capture::drain(std::vector<uint8_t> &out) {
+	size_t pdu_position = pdus.tail.load(std::memory_order_relaxed);
+	const size_t pdu_end = pdus.head.load(std::memory_order_acquire);
+	size_t note_position = notes.tail.load(std::memory_order_relaxed);
+	const size_t note_end = notes.head.load(std::memory_order_acquire);
+
+	// Each ring is in time order, so taking the earlier head of the two keeps the file in order too.
+	while (pdu_position != pdu_end || note_position != note_end) {
+		Entry pdu_entry, note_entry;
+		if (pdu_position != pdu_end)
+			pdus.copyOut(pdu_position, &pdu_entry, sizeof(pdu_entry));
+		if (note_position != note_end)
+			notes.copyOut(note_position, &note_entry, sizeof(note_entry));
+
+		const bool from_notes = pdu_position == pdu_end
+			|| (note_position != note_end && note_entry.nanoseconds < pdu_entry.nanoseconds);
+		const Ring &ring = from_notes? notes : pdus;
+		size_t &position = from_notes? note_position : pdu_position;
+		const Entry &entry = from_notes? note_entry : pdu_entry;
+
+		put32be(out, entry.length);
+		put32be(out, entry.length);
+		put32be(out, entry.opcode);
+		put32be(out, entry.drops);
+		put64be(out, epoch + entry.nanoseconds / 1'000);
+
+		const size_t start = out.size();
+		out.resize(start + entry.length);
+		ring.copyOut(position + sizeof(entry), &out[start], entry.length);
+
+		position += sizeof(entry) + entry.length;
+		++records;
+	}
+
+	pdus.tail.store(pdu_position, std::memory_order_release);
+	notes.tail.store(note_position, std::memory_order_release);
+}
+
+void Capture::run() {
+	std::vector<uint8_t> out;
+	out.reserve(pdus.data.size() + notes.data.size());
+
+	for (;;) {
+		// Nobody signals on every record; polling keeps the producers free of syscalls.
+		cvWake.wait_for(std::chrono::milliseconds(50), [this] { return stopping.load(); });
+		const bool last = stopping;
+
+		drain(out);
+		if (!out.empty()) {
+			if (writeAll(fd, out.data(), out.size()))
+				bytes += out.size();
+			else
+				DBG("Capture: write failed: %s", strerror(errno));
+			out.clear();
+		}
+
+		if (last)
+			break;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "CVPair.h"
+
+// Records ATT traffic to a btsnoop file in the monitor format, so it opens in btmon -r and Wireshark. Records are
+// copied into ring buffers and written out by a background thread; if a ring fills up, records are dropped (and
+// counted in the file) rather than stalling the caller. PDUs only come from the loop thread and have a ring of their
+// own, so the loop never waits on another thread; annotations from the sending threads share a second ring under a
+// mutex, and the writer merges the two by time. Each connection gets its own ACL handle so several glasses can share
+// one capture.
+class Capture {
+	public:
+		struct Stats {
+			size_t records = 0;
+			size_t bytes = 0;
+			size_t dropped = 0;
+		};
+
+		Capture(const std::string &path, size_t buffer_size = 1 << 20);
+		~Capture();
+
+		Capture(const Capture &) = delete;
+		Capture & operator=(const Capture &) = delete;
+
+		bool isOpen() const { return 0 <= fd; }
+		uint16_t addLink();
+		// Only from the loop thread.
+		void pdu(uint16_t link, bool sent, const void *data, size_t length);
+		// Shows up as a log line in btmon, interleaved with the PDUs around it.
+		void annotate(uint16_t link, std::string_view text);
+		Stats getStats() const;
+
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		struct Entry {
+			int64_t nanoseconds;
+			uint32_t drops;
+			uint16_t opcode;
+			uint16_t link;
+			uint16_t length;
+		};
+
+		struct Ring {
+			std::vector<uint8_t> data;
+			size_t mask = 0;
+			// head is only advanced by the producer, tail only by the writer thread.
+			std::atomic_size_t head {0};
+			std::atomic_size_t tail {0};
+
+			void resize(size_t minimum);
+			void copyIn(size_t position, const void *data, size_t length);
+			void copyOut(size_t position, void *data, size_t length) const;
+		};
+
+		int fd = -1;
+		Ring pdus;
+		Ring notes;
+		// Makes the annotating threads one producer for notes.
+		std::mutex notesMutex;
+		std::atomic_uint16_t nextLink {1};
+		std::atomic_size_t records {0};
+		std::atomic_size_t bytes {0};
+		std::atomic_uint32_t dropped {0};
+		// Real time at which Clock read zero, in btsnoop's microsecond epoch.
+		int64_t epoch;
+		std::atomic_bool stopping {false};
+		CVPair cvWake;
+		std::thread writer;
+
+		void push(Ring &, uint16_t opcode, uint16_t link, const void *prefix, size_t prefix_length, const void *data,
+			size_t length);
+		void writeHeader();
+		void drain(std::vector<uint8_t> &out);
+		void run();
+};
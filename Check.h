@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+// The pass/fail bookkeeping shared by the test harnesses: each check prints a line, and main returns nonzero if any
+// failed.
+namespace Check {
+	inline size_t failures = 0;
+
+	inline void check(bool ok, const char *what) {
+		printf("%s: %s\n", ok? "ok" : "FAIL", what);
+		if (!ok)
+			++failures;
+	}
+
+	// Prints the summary line and gives main's exit status.
+	inline int finish() {
+		printf("%s\n", failures == 0? "All checks passed." : "Some checks failed.");
+		return failures == 0? 0 : 1;
+	}
+}
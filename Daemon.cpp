@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Daemon.h"
+#include "Debug.h"
+#include "Encoder.h"
+#include "Font.h"
+#include "Scroller.h"
+#include "Transport.h"
+
+namespace {
+	// Sends the reply, with a descriptor in SCM_RIGHTS if attach is one.
+	bool sendReply(int fd, const Chemion::Protocol::Reply &reply, int attach) {
+		iovec iov {const_cast<Chemion::Protocol::Reply *>(&reply), sizeof(reply)};
+		msghdr message {};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		if (0 <= attach) {
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			cmsghdr *header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(header), &attach, sizeof(int));
+		}
+
+		return sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(reply);
+	}
+}
+
+namespace Chemion {
+	Daemon::Daemon(std::string path_, uint16_t index_, TransportFactory factory_):
+	path(std::move(path_)), index(index_), factory(std::move(factory_)) {
+		if (!factory)
+			factory = [](uint16_t index) { return std::make_shared<BluezTransport>("hci" + std::to_string(index)); };
+		clients = Metrics::make<Metrics::Gauge>("chemion_daemon_clients", "Clients connected to the command socket.");
+	}
+
+	Daemon::~Daemon() {
+		stop();
+	}
+
+	void Daemon::add(const std::string &address, const std::string &type) {
+		// ALL_DEVICES is the one index a request can't name a device by.
+		if (devices.size() == Protocol::ALL_DEVICES) {
+			DBG("Too many devices; not adding %s.", address.c_str());
+			return;
+		}
+
+		auto &device = *devices.emplace_back(std::make_unique<Device>());
+		device.address = address;
+		device.type = type;
+		const Metrics::Labels labels {{"device", address}};
+		device.commands = Metrics::make<Metrics::Counter>("chemion_daemon_commands_total", "Commands queued for a device.",
+			labels);
+		device.coalesced = Metrics::make<Metrics::Counter>("chemion_daemon_commands_coalesced_total",
+			"Commands replaced by a newer one before the device got to them.", labels);
+	}
+
+	bool Daemon::start() {
+		sockaddr_un address {};
+		address.sun_family = AF_UNIX;
+		if (sizeof(address.sun_path) <= path.size()) {
+			DBG("Command socket path too long: %s", path.c_str());
+			return false;
+		}
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+
+		listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenFD < 0) {
+			DBG("Couldn't create command socket: %s", strerror(errno));
+			return false;
+		}
+
+		unlink(path.c_str());
+		if (bind(listenFD, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFD, 16) < 0) {
+			DBG("Couldn't listen on %s: %s", path.c_str(), strerror(errno));
+			close(listenFD);
+			listenFD = -1;
+			return false;
+		}
+
+		stopFD = eventfd(0, EFD_CLOEXEC);
+		if (stopFD < 0) {
+			DBG("Couldn't create daemon eventfd: %s", strerror(errno));
+			close(listenFD);
+			listenFD = -1;
+			unlink(path.c_str());
+			return false;
+		}
+
+		for (auto &device: devices)
+			device->worker = std::thread(&Daemon::work, this, std::ref(*device));
+		server = std::thread(&Daemon::serve, this);
+		return true;
+	}
+
+	void Daemon::stop() {
+		if (server.joinable()) {
+			const uint64_t one = 1;
+			if (write(stopFD, &one, sizeof(one)) != sizeof(one))
+				DBG("Couldn't signal the command server to stop: %s", strerror(errno));
+			server.join();
+
+			close(listenFD);
+			close(stopFD);
+			listenFD = stopFD = -1;
+			unlink(path.c_str());
+		}
+
+		for (auto &device: devices) {
+			{
+				std::unique_lock lock(device->cv.mutex);
+				device->stopping = true;
+			}
+			device->cv.notify();
+			device->backoff.cancel();
+		}
+
+		for (auto &device: devices)
+			if (device->worker.joinable())
+				device->worker.join();
+	}
+
+	size_t Daemon::getConnected() const {
+		return std::ranges::count_if(devices, [](const auto &device) {
+			return device->linked.load() && device->glasses.isConnected();
+		});
+	}
+
+	bool Daemon::connect(Device &device) {
+		auto delay = std::chrono::milliseconds(1'000);
+
+		for (bool first = true;; first = false) {
+			bool connected;
+			if (first) {
+				device.glasses.setup(index);
+				device.glasses.setTransport(factory(index));
+				connected = device.glasses.connect(device.address.c_str(), device.type.c_str());
+			} else
+				connected = device.glasses.migrate(index, factory(index));
+
+			if (connected)
+				return true;
+
+			DBG("Couldn't connect to %s; trying again in %ld ms.", device.address.c_str(), delay.count());
+			if (!device.backoff.sleepFor(delay))
+				return false;
+			delay = std::min(delay * 2, std::chrono::milliseconds(30'000));
+		}
+	}
+
+	void Daemon::work(Device &device) {
+		if (!connect(device))
+			return;
+		device.glasses.enableReconnect(policy);
+		device.linked = true;
+		DBG("Connected to %s.", device.address.c_str());
+
+		std::optional<Scroller> scroller;
+		size_t remaining = 0;
+		std::shared_ptr<Framebuffer> mirroring;
+		uint64_t seen = 0;
+		std::shared_ptr<const Animation> playing;
+		size_t position = 0;
+		auto next = Clock::now();
+
+		auto send = [&device](const std::vector<uint8_t> &frame, size_t) {
+			return device.glasses.sendFrame(frame);
+		};
+
+		while (true) {
+			std::optional<Job> job;
+			{
+				std::unique_lock lock(device.cv.mutex);
+				const auto ready = [&device] { return device.stopping || device.pending.has_value(); };
+				if (scroller || mirroring || playing)
+					device.cv.var.wait_until(lock, next, ready);
+				else
+					device.cv.var.wait(lock, ready);
+				if (device.stopping)
+					return;
+				job.swap(device.pending);
+			}
+
+			if (job) {
+				// Whatever comes in replaces a scroll, framebuffer or animation in progress.
+				scroller.reset();
+				mirroring.reset();
+				playing.reset();
+				if (job->command == Protocol::Command::Scroll) {
+					scroller.emplace(job->text, job->edgeDelay.count(), job->delay.count());
+					remaining = job->count;
+					next = Clock::now();
+				} else if (job->command == Protocol::Command::Framebuffer) {
+					// Show the current contents straight away, even if they were shown before.
+					mirroring = std::move(job->framebuffer);
+					seen = 0;
+					next = Clock::now();
+				} else if (job->command == Protocol::Command::Play) {
+					playing = std::move(job->animation);
+					position = 0;
+					remaining = job->count;
+					next = Clock::now();
+				} else if (!device.glasses.sendFrame(job->frame))
+					DBG("Couldn't send a frame to %s; it'll be shown once the link is back.", device.address.c_str());
+				continue;
+			}
+
+			if (mirroring) {
+				// A failed send is restored by the supervisor along with the link, so there's nothing to retry.
+				device.glasses.showLatest(*mirroring, seen);
+				next = std::max(next + MIRROR_INTERVAL, Clock::now());
+				continue;
+			}
+
+			if (playing) {
+				// As in Glasses::play(), an entry whose time has passed is skipped to keep the show on its clock.
+				const Animation::Entry entry = playing->getEntry(position);
+				const auto frame = playing->getFrame(entry.frame);
+				const auto until = next + std::chrono::milliseconds(entry.duration);
+				if (Clock::now() < until && !frame.empty())
+					device.glasses.sendFrame(frame);
+				next = until;
+
+				if (++position == playing->getEntryCount()) {
+					position = 0;
+					if (remaining != 0 && --remaining == 0)
+						playing.reset();
+				}
+				continue;
+			}
+
+			if (!scroller->render(send)) {
+				// The supervisor is bringing the link back. Try again a column later rather than piling up attempts.
+				next = Clock::now() + scroller->delay;
+				continue;
+			}
+
+			next += scroller->hold;
+			if (remaining != 0 && --remaining == 0)
+				scroller.reset();
+		}
+	}
+
+	void Daemon::submit(Device &device, Job job) {
+		device.commands->add();
+		{
+			std::unique_lock lock(device.cv.mutex);
+			if (device.pending)
+				device.coalesced->add();
+			device.pending = std::move(job);
+		}
+		device.cv.notify();
+	}
+
+	void Daemon::serve() {
+		// Client sockets and whatever part of a request they've sent so far.
+		std::map<int, std::vector<uint8_t>> connections;
+		std::vector<pollfd> fds;
+
+		while (true) {
+			fds.clear();
+			fds.push_back({stopFD, POLLIN, 0});
+			fds.push_back({listenFD, static_cast<short>(connections.size() < MAX_CLIENTS? POLLIN : 0), 0});
+			for (const auto &[fd, buffer]: connections)
+				fds.push_back({fd, POLLIN, 0});
+
+			if (poll(fds.data(), fds.size(), -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				DBG("Command server poll failed: %s", strerror(errno));
+				break;
+			}
+
+			if (fds[0].revents != 0)
+				break;
+
+			if (fds[1].revents & POLLIN) {
+				const int fd = accept4(listenFD, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (0 <= fd)
+					connections[fd];
+			}
+
+			for (size_t i = 2; i < fds.size(); ++i) {
+				if (fds[i].revents == 0)
+					continue;
+
+				const int fd = fds[i].fd;
+				auto &buffer = connections[fd];
+				uint8_t chunk[512];
+				const ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+
+				bool keep;
+				if (0 < count) {
+					buffer.insert(buffer.end(), chunk, chunk + count);
+					keep = handle(fd, buffer);
+				} else
+					keep = count < 0 && (errno == EAGAIN || errno == EINTR);
+
+				if (!keep) {
+					close(fd);
+					connections.erase(fd);
+				}
+			}
+
+			clients->set(connections.size());
+		}
+
+		for (const auto &[fd, buffer]: connections)
+			close(fd);
+		clients->set(0);
+	}
+
+	bool Daemon::handle(int fd, std::vector<uint8_t> &buffer) {
+		using namespace Protocol;
+
+		while (sizeof(Header) <= buffer.size()) {
+			Header header;
+			std::memcpy(&header, buffer.data(), sizeof(header));
+			header.length = le16toh(header.length);
+
+			// Past a bad header there's no telling where the next request starts, so the client goes.
+			const bool valid = header.magic == MAGIC && header.version == PROTOCOL_VERSION && header.length <= MAX_PAYLOAD;
+			if (valid && buffer.size() < sizeof(header) + header.length)
+				return true;
+
+			int attach = -1;
+			const Result result = valid? execute(header, std::span(buffer).subspan(sizeof(header), header.length), attach) :
+				Result::BadRequest;
+			buffer.erase(buffer.begin(), buffer.begin() + (valid? sizeof(header) + header.length : buffer.size()));
+
+			const Reply reply {result, header.command, static_cast<uint8_t>(devices.size()),
+				static_cast<uint8_t>(getConnected())};
+			// A client that doesn't read its replies isn't worth blocking every other client for.
+			if (!sendReply(fd, reply, attach) || !valid)
+				return false;
+		}
+
+		return true;
+	}
+
+	Protocol::Result Daemon::execute(const Protocol::Header &header, std::span<const uint8_t> payload, int &attach) {
+		using namespace Protocol;
+
+		if (header.device != ALL_DEVICES && devices.size() <= header.device)
+			return Result::NoDevice;
+
+		Job job {header.command};
+
+		switch (header.command) {
+			case Command::ShowText:
+			case Command::Scroll: {
+				if (header.command == Command::Scroll) {
+					ScrollHeader scroll;
+					if (payload.size() < sizeof(scroll))
+						return Result::BadRequest;
+					std::memcpy(&scroll, payload.data(), sizeof(scroll));
+					payload = payload.subspan(sizeof(scroll));
+
+					job.delay = std::chrono::milliseconds(le16toh(scroll.delay));
+					job.edgeDelay = std::chrono::milliseconds(le16toh(scroll.edgeDelay));
+					job.count = le32toh(scroll.count);
+					if (job.delay.count() == 0)
+						return Result::BadRequest;
+				}
+
+				job.text.assign(payload.begin(), payload.end());
+				if (!std::ranges::all_of(job.text, [](char character) { return font.contains(character); }))
+					return Result::BadRequest;
+
+				// Text that fits has nothing to scroll.
+				if (header.command == Command::ShowText || stringColumns(job.text).size() <= 24) {
+					job.command = Command::ShowText;
+					job.frame = encodeString(job.text);
+				}
+				break;
+			}
+
+			case Command::ShowImage: {
+				Framebuffer::Pixels pixels;
+				if (payload.size() != pixels.size())
+					return Result::BadRequest;
+				std::copy(payload.begin(), payload.end(), pixels.begin());
+				job.frame = fromColumns(Framebuffer::toColumns(pixels));
+				break;
+			}
+
+			case Command::Clear:
+				if (!payload.empty())
+					return Result::BadRequest;
+				job.frame = fromColumns(Glasses::Columns {});
+				break;
+
+			case Command::Status:
+				return Result::OK;
+
+			case Command::Play: {
+				PlayHeader play;
+				if (payload.size() <= sizeof(play))
+					return Result::BadRequest;
+				std::memcpy(&play, payload.data(), sizeof(play));
+				job.count = le32toh(play.loops);
+
+				const std::string file(payload.begin() + sizeof(play), payload.end());
+				// An animation that takes no time doesn't open, so a loop forever can't spin the worker.
+				auto animation = std::make_shared<const Animation>(file);
+				if (!animation->isOpen())
+					return Result::BadRequest;
+				job.animation = std::move(animation);
+				break;
+			}
+
+			case Command::Framebuffer: {
+				if (header.device == ALL_DEVICES || !payload.empty())
+					return Result::BadRequest;
+				Device &device = *devices[header.device];
+				if (!device.framebuffer) {
+					auto framebuffer = std::make_shared<Framebuffer>();
+					if (!framebuffer->isOpen())
+						return Result::Unsupported;
+					device.framebuffer = std::move(framebuffer);
+				}
+				job.framebuffer = device.framebuffer;
+				attach = device.framebuffer->getFD();
+				break;
+			}
+
+			default:
+				return Result::Unsupported;
+		}
+
+		if (header.device == ALL_DEVICES) {
+			for (auto &device: devices)
+				submit(*device, job);
+		} else
+			submit(*devices[header.device], std::move(job));
+
+		return Result::OK;
+	}
+}
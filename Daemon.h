@@ -0,0 +1,103 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Animation.h"
+#include "CVPair.h"
+#include "Framebuffer.h"
+#include "Glasses.h"
+#include "Metrics.h"
+#include "Protocol.h"
+#include "TimerWheel.h"
+
+class Transport;
+
+namespace Chemion {
+	// Keeps links to a fixed set of glasses open and shows whatever clients send over a Unix socket (see Protocol.h).
+	// Each device has a worker thread holding at most one pending command: a newer command replaces one the worker
+	// hasn't picked up yet, so a burst of updates costs one frame rather than a backlog.
+	class Daemon {
+		public:
+			using TransportFactory = std::function<std::shared_ptr<Transport>(uint16_t index)>;
+
+			static constexpr size_t MAX_CLIENTS = 64;
+			// How often a device showing a framebuffer checks it for a new frame.
+			static constexpr std::chrono::milliseconds MIRROR_INTERVAL {20};
+
+			// The default transport is BlueZ through hciN.
+			Daemon(std::string path_, uint16_t index_ = 0, TransportFactory = {});
+			~Daemon();
+
+			Daemon(const Daemon &) = delete;
+			Daemon & operator=(const Daemon &) = delete;
+
+			// Must be called before start(). Devices are numbered in the order they were added.
+			void add(const std::string &address, const std::string &type = "random");
+			// Used once each device's first connection is up.
+			void setReconnectPolicy(ReconnectPolicy new_policy) { policy = new_policy; }
+			// Starts connecting and listening. Replaces whatever is at the path; returns false if the socket couldn't be
+			// set up.
+			bool start();
+			void stop();
+
+			size_t getConnected() const;
+
+		private:
+			using Clock = std::chrono::steady_clock;
+
+			struct Job {
+				Protocol::Command command;
+				// Already encoded, for everything but Scroll.
+				std::vector<uint8_t> frame;
+				std::string text;
+				std::chrono::milliseconds delay {0};
+				std::chrono::milliseconds edgeDelay {0};
+				size_t count = 0;
+				std::shared_ptr<Framebuffer> framebuffer;
+				std::shared_ptr<const Animation> animation;
+			};
+
+			struct Device {
+				std::string address;
+				std::string type;
+				Glasses glasses;
+				std::thread worker;
+				CVPair cv;
+				std::optional<Job> pending;
+				bool stopping = false;
+				std::atomic_bool linked {false};
+				Alarm backoff;
+				// Created on the first Framebuffer command. Only the server thread touches this pointer.
+				std::shared_ptr<Framebuffer> framebuffer;
+				std::shared_ptr<Metrics::Counter> commands;
+				std::shared_ptr<Metrics::Counter> coalesced;
+			};
+
+			std::string path;
+			uint16_t index;
+			TransportFactory factory;
+			ReconnectPolicy policy;
+			std::vector<std::unique_ptr<Device>> devices;
+
+			int listenFD = -1;
+			int stopFD = -1;
+			std::thread server;
+			std::shared_ptr<Metrics::Gauge> clients;
+
+			bool connect(Device &);
+			void work(Device &);
+			void submit(Device &, Job);
+			void serve();
+			// Handles every complete request in the buffer. Returns false if the client should be dropped.
+			bool handle(int fd, std::vector<uint8_t> &buffer);
+			// Sets attach to a descriptor to send along with the reply, if any.
+			Protocol::Result execute(const Protocol::Header &, std::span<const uint8_t> payload, int &attach);
+	};
+}
@@ -1,5 +1,6 @@
 #pragma once
 
-#include <cstdio>
+#include "Log.h"
 
-#define DBG(...) do { fprintf(stdout, __VA_ARGS__); fprintf(stdout, "\n"); } while(0)
+// Kept for the many existing call sites; new code can pick a level.
+#define DBG(...) LOG_DEBUG(__VA_ARGS__)
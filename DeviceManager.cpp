@@ -0,0 +1,310 @@
+#include <algorithm>
+
+#include "Debug.h"
+#include "DeviceManager.h"
+
+namespace Chemion {
+	DeviceManager::DeviceManager(BalancePolicy policy_, TransportFactory factory_):
+	policy(policy_), factory(std::move(factory_)) {
+		if (!factory)
+			factory = [](uint16_t index) { return std::make_shared<BluezTransport>("hci" + std::to_string(index)); };
+	}
+
+	DeviceManager::~DeviceManager() {
+		stop();
+		mgmt.onIndexChanged = {};
+	}
+
+	size_t DeviceManager::discoverAdapters(std::chrono::milliseconds timeout) {
+		mgmt.onIndexChanged = [this](uint16_t index, bool added) {
+			DBG("hci%u %s.", index, added? "added" : "removed");
+			if (added)
+				addAdapter(index);
+			else
+				removeAdapter(index);
+		};
+
+		if (!mgmt.watchIndices())
+			DBG("Couldn't watch for adapters being added or removed.");
+
+		auto done = std::make_shared<CVPair>();
+		auto found = std::make_shared<std::optional<std::vector<uint16_t>>>();
+
+		if (!mgmt.readIndexList([done, found](std::span<const uint16_t> indices) {
+			{
+				std::unique_lock lock(done->mutex);
+				found->emplace(indices.begin(), indices.end());
+			}
+			done->notify();
+		}))
+			return 0;
+
+		if (!done->wait_for(timeout, [&] { return found->has_value(); })) {
+			DBG("Timed out reading the adapter list.");
+			return 0;
+		}
+
+		for (const uint16_t index: **found)
+			addAdapter(index);
+
+		return (*found)->size();
+	}
+
+	void DeviceManager::addAdapter(uint16_t index) {
+		std::unique_lock lock(mutex);
+		auto &adapter = adapters[index];
+		adapter.index = index;
+		adapter.present = true;
+		adapter.failed = false;
+		adapter.failures = 0;
+	}
+
+	void DeviceManager::removeAdapter(uint16_t index) {
+		std::unique_lock lock(mutex);
+		auto iter = adapters.find(index);
+		if (iter != adapters.end())
+			iter->second.present = false;
+	}
+
+	double DeviceManager::loadOf(size_t links, double throughput) const {
+		return std::max(static_cast<double>(links) / std::max<size_t>(policy.maxLinks, 1), throughput / policy.maxThroughput);
+	}
+
+	std::vector<uint16_t> DeviceManager::candidates(std::optional<uint16_t> exclude) {
+		std::unique_lock lock(mutex);
+		std::vector<const AdapterStats *> usable;
+
+		for (const auto &[index, adapter]: adapters)
+			if (adapter.present && !adapter.failed && adapter.links < policy.maxLinks && exclude != index)
+				usable.push_back(&adapter);
+
+		std::stable_sort(usable.begin(), usable.end(), [this](const AdapterStats *left, const AdapterStats *right) {
+			return loadOf(left->links, left->throughput) < loadOf(right->links, right->throughput);
+		});
+
+		std::vector<uint16_t> out;
+		out.reserve(usable.size());
+		for (const auto *adapter: usable)
+			out.push_back(adapter->index);
+		return out;
+	}
+
+	void DeviceManager::noteFailure(uint16_t index) {
+		std::unique_lock lock(mutex);
+		auto &adapter = adapters[index];
+		if (++adapter.failures >= policy.maxFailures && !adapter.failed) {
+			DBG("Treating hci%u as failed.", index);
+			adapter.failed = true;
+			adapter.failedAt = Clock::now();
+		}
+	}
+
+	Glasses * DeviceManager::add(const std::string &address, const std::string &type) {
+		std::unique_lock operation(operationMutex);
+		auto glasses = std::make_unique<Glasses>();
+		bool attempted = false;
+
+		for (const uint16_t index: candidates(std::nullopt)) {
+			bool connected;
+			if (!attempted) {
+				glasses->setup(index);
+				glasses->setTransport(factory(index));
+				connected = glasses->connect(address.c_str(), type.c_str());
+				attempted = true;
+			} else
+				connected = glasses->migrate(index, factory(index));
+
+			if (!connected) {
+				DBG("Couldn't connect to %s through hci%u.", address.c_str(), index);
+				noteFailure(index);
+				continue;
+			}
+
+			std::unique_lock lock(mutex);
+			auto &adapter = adapters[index];
+			adapter.failures = 0;
+			++adapter.links;
+
+			auto *out = glasses.get();
+			devices.push_back({std::move(glasses), index, true, out->getBytesSent(), 0});
+			DBG("%s is on hci%u.", address.c_str(), index);
+			return out;
+		}
+
+		return nullptr;
+	}
+
+	void DeviceManager::sample() {
+		const auto now = Clock::now();
+		const double seconds = std::chrono::duration<double>(now - lastSample).count();
+		lastSample = now;
+
+		std::map<uint16_t, std::pair<size_t, double>> totals;
+		std::map<uint16_t, size_t> hosted;
+
+		for (auto &device: devices) {
+			const uint64_t bytes = device.glasses->getBytesSent();
+			if (0 < seconds)
+				device.throughput += policy.smoothing * ((bytes - device.lastBytes) / seconds - device.throughput);
+			device.lastBytes = bytes;
+
+			++hosted[device.adapter];
+			auto &[links, throughput] = totals[device.adapter];
+			device.counted = device.glasses->isConnected();
+			if (device.counted)
+				++links;
+			throughput += device.throughput;
+		}
+
+		std::vector<uint16_t> dark;
+
+		{
+			std::unique_lock lock(mutex);
+			for (auto &[index, adapter]: adapters) {
+				const auto [links, throughput] = totals[index];
+				adapter.links = links;
+				adapter.throughput = throughput;
+				adapter.load = loadOf(links, throughput);
+				if (adapter.failed && adapter.present && policy.failureCooldown <= now - adapter.failedAt) {
+					DBG("Trying hci%u again.", index);
+					adapter.failed = false;
+					adapter.failures = 0;
+				}
+				if (links != 0)
+					adapter.failures = 0;
+				else if (hosted[index] != 0)
+					dark.push_back(index);
+			}
+		}
+
+		// An adapter whose links have all dropped at once has most likely been reset or wedged.
+		for (const uint16_t index: dark)
+			noteFailure(index);
+	}
+
+	bool DeviceManager::move(Device &device, bool evacuating) {
+		const uint16_t source = device.adapter;
+		const auto &address = device.glasses->getAddress();
+
+		for (const uint16_t index: candidates(source)) {
+			DBG("Moving %s from hci%u to hci%u.", address.c_str(), source, index);
+			if (device.glasses->migrate(index, factory(index))) {
+				std::unique_lock lock(mutex);
+				if (device.counted && adapters[source].links != 0)
+					--adapters[source].links;
+				++adapters[index].links;
+				device.counted = true;
+				adapters[index].failures = 0;
+				device.adapter = index;
+				++migrations;
+				return true;
+			}
+			noteFailure(index);
+		}
+
+		// Nowhere else would take it; a saturated adapter is still better than no link at all.
+		if (!evacuating && !device.glasses->migrate(source, factory(source))) {
+			DBG("Couldn't reconnect %s to hci%u either.", address.c_str(), source);
+			std::unique_lock lock(mutex);
+			if (device.counted && adapters[source].links != 0)
+				--adapters[source].links;
+			device.counted = false;
+		}
+		return false;
+	}
+
+	size_t DeviceManager::rebalance() {
+		std::unique_lock operation(operationMutex);
+		size_t moved = 0;
+
+		sample();
+
+		for (auto &device: devices) {
+			bool evacuate;
+			{
+				std::unique_lock lock(mutex);
+				const auto &adapter = adapters[device.adapter];
+				evacuate = !adapter.present || adapter.failed;
+			}
+			if (evacuate && move(device, true))
+				++moved;
+		}
+
+		std::optional<uint16_t> busiest;
+		double busiest_load = policy.saturation;
+
+		{
+			std::unique_lock lock(mutex);
+			for (const auto &[index, adapter]: adapters) {
+				if (adapter.present && !adapter.failed && busiest_load <= adapter.load) {
+					busiest = index;
+					busiest_load = adapter.load;
+				}
+			}
+		}
+
+		if (!busiest)
+			return moved;
+
+		const auto targets = candidates(busiest);
+		if (targets.empty())
+			return moved;
+
+		AdapterStats target;
+		{
+			std::unique_lock lock(mutex);
+			target = adapters[targets.front()];
+		}
+
+		// Move the busiest device that the target can take without saturating itself or ending up busier than the source.
+		Device *chosen = nullptr;
+		for (auto &device: devices) {
+			if (device.adapter != *busiest)
+				continue;
+			const double after = loadOf(target.links + 1, target.throughput + device.throughput);
+			if (after < policy.saturation && after < busiest_load && (chosen == nullptr || chosen->throughput < device.throughput))
+				chosen = &device;
+		}
+
+		if (chosen != nullptr && move(*chosen, false))
+			++moved;
+
+		return moved;
+	}
+
+	void DeviceManager::start() {
+		if (balancer.joinable())
+			return;
+
+		alarm.reset();
+		balancer = std::thread([this] {
+			while (alarm.sleepFor(policy.interval))
+				rebalance();
+		});
+	}
+
+	void DeviceManager::stop() {
+		if (!balancer.joinable())
+			return;
+
+		alarm.cancel();
+		balancer.join();
+	}
+
+	std::vector<AdapterStats> DeviceManager::getAdapters() {
+		std::unique_lock lock(mutex);
+		std::vector<AdapterStats> out;
+		out.reserve(adapters.size());
+		for (const auto &[index, adapter]: adapters)
+			out.push_back(adapter);
+		return out;
+	}
+
+	std::optional<uint16_t> DeviceManager::adapterOf(const Glasses &glasses) {
+		std::unique_lock lock(mutex);
+		for (const auto &device: devices)
+			if (device.glasses.get() == &glasses)
+				return device.adapter;
+		return std::nullopt;
+	}
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Glasses.h"
+#include "Mgmt.h"
+#include "TimerWheel.h"
+
+namespace Chemion {
+	struct BalancePolicy {
+		// Links a controller can hold before it counts as full. Many allow more, but airtime runs out first.
+		size_t maxLinks = 5;
+		// Bytes per second a controller is assumed to sustain across all of its links.
+		double maxThroughput = 40'000;
+		// Load (the larger of the link and throughput fractions) at which glasses start moving elsewhere.
+		double saturation = .9;
+		// Consecutive failed connects, or rounds with every link down, before an adapter is treated as failed.
+		size_t maxFailures = 3;
+		// How long a failed adapter that is still present sits out before it's tried again.
+		std::chrono::milliseconds failureCooldown {30'000};
+		std::chrono::milliseconds interval {1'000};
+		// Weight given to each new throughput sample.
+		double smoothing = .3;
+	};
+
+	struct AdapterStats {
+		uint16_t index = 0;
+		size_t links = 0;
+		double throughput = 0;
+		double load = 0;
+		size_t failures = 0;
+		bool present = true;
+		bool failed = false;
+		std::chrono::steady_clock::time_point failedAt;
+	};
+
+	// Spreads glasses over all local controllers. New glasses go to the least loaded adapter, judged by link count and
+	// measured throughput, and the balancer moves them off adapters that saturate, fail or disappear.
+	class DeviceManager {
+		public:
+			// Makes the transport for a link through the given adapter. The default is BlueZ bound to hciN.
+			using TransportFactory = std::function<std::shared_ptr<Transport>(uint16_t index)>;
+
+			DeviceManager(BalancePolicy = {}, TransportFactory = {});
+			~DeviceManager();
+
+			DeviceManager(const DeviceManager &) = delete;
+			DeviceManager & operator=(const DeviceManager &) = delete;
+
+			// Reads the controller list through mgmt and follows controllers being added and removed afterwards.
+			size_t discoverAdapters(std::chrono::milliseconds timeout = std::chrono::milliseconds(1'000));
+			// For fake transports, or to restrict the manager to some controllers.
+			void addAdapter(uint16_t index);
+			// Treats the adapter as gone; its glasses move elsewhere on the next rebalance.
+			void removeAdapter(uint16_t index);
+
+			// Connects through the least loaded adapter, falling back to the others. Returns null if none worked.
+			Glasses * add(const std::string &address, const std::string &type = "random");
+			// Samples throughput, evacuates failed adapters and moves at most one device off a saturated one, so loads
+			// can settle between rounds. Returns how many glasses moved.
+			size_t rebalance();
+			// Runs rebalance() every policy.interval on a background thread.
+			void start();
+			void stop();
+
+			std::vector<AdapterStats> getAdapters();
+			std::optional<uint16_t> adapterOf(const Glasses &);
+			size_t getMigrations() const { return migrations; }
+
+		private:
+			using Clock = std::chrono::steady_clock;
+
+			struct Device {
+				std::unique_ptr<Glasses> glasses;
+				uint16_t adapter = 0;
+				// Whether the adapter's link count includes this device; sample() leaves out links that are down.
+				bool counted = true;
+				uint64_t lastBytes = 0;
+				double throughput = 0;
+			};
+
+			BalancePolicy policy;
+			TransportFactory factory;
+			Mgmt mgmt;
+			// Held across add() and rebalance(), which block on connections; the tables have their own lock.
+			std::mutex operationMutex;
+			std::mutex mutex;
+			std::map<uint16_t, AdapterStats> adapters;
+			std::vector<Device> devices;
+			Clock::time_point lastSample = Clock::now();
+			std::thread balancer;
+			Alarm alarm;
+			std::atomic_size_t migrations {0};
+
+			double loadOf(size_t links, double throughput) const;
+			// Healthy adapters with room for another link, least loaded first.
+			std::vector<uint16_t> candidates(std::optional<uint16_t> exclude);
+			void noteFailure(uint16_t index);
+			void sample();
+			bool move(Device &, bool evacuating);
+	};
+}
@@ -1,10 +1,16 @@
+#include <algorithm>
 #include <span>
 #include <stdexcept>
 
 #include "Encoder.h"
 #include "Font.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 namespace Chemion {
+	static constexpr std::array<uint8_t, 13> HEADER {FRAME_HEADER, 0x03, 0x00, 0x39, 0x01, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	static constexpr std::array<char, 4> PAIRS {' ', '-', 'x', 'X'};
+
 	static uint8_t getPair(char character) {
 		if (character == ' ')
 			return 0b00;
@@ -18,7 +24,9 @@ namespace Chemion {
 	}
 
 	std::vector<uint8_t> encode(const std::array<char, 168> &chars) {
-		std::vector<uint8_t> out {0xfa, 0x03, 0x00, 0x39, 0x01, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+		PROFILE_SCOPE("encode");
+		const Trace::Span span(Trace::Stage::Encode);
+		std::vector<uint8_t> out(HEADER.begin(), HEADER.end());
 		uint8_t crc = 7;
 		uint8_t byte = 0;
 		uint8_t pair_count = 0;
@@ -75,6 +83,7 @@ namespace Chemion {
 	}
 
 	std::vector<uint8_t> fromColumns(const std::span<const std::array<bool, 7>> &columns) {
+		const Trace::Span span(Trace::Stage::Render);
 		std::array<char, 168> flat {};
 		std::fill(flat.begin(), flat.end(), ' ');
 		for (size_t row = 0; row < 7; ++row)
@@ -84,6 +93,7 @@ namespace Chemion {
 	}
 
 	std::vector<std::array<bool, 7>> stringColumns(std::string_view str) {
+		const Trace::Span span(Trace::Stage::Render);
 		std::vector<std::array<bool, 7>> columns;
 		for (const char ch: str) {
 			const auto &pixels = font.at(ch);
@@ -103,4 +113,31 @@ namespace Chemion {
 		auto columns = stringColumns(str);
 		return fromColumns(columns);
 	}
+
+	std::optional<std::array<char, 168>> decode(std::span<const uint8_t> frame) {
+		constexpr size_t data_size = 168 / 4;
+
+		if (frame.size() != FRAME_SIZE || !std::equal(HEADER.begin(), HEADER.end(), frame.begin()))
+			return std::nullopt;
+
+		const auto data = frame.subspan(HEADER.size(), data_size);
+		const auto trailer = frame.subspan(HEADER.size() + data_size);
+		uint8_t crc = 7;
+
+		for (const uint8_t byte: data)
+			crc ^= byte;
+
+		for (size_t i = 0; i < 6; ++i)
+			if (trailer[i] != 0)
+				return std::nullopt;
+
+		if (trailer[6] != crc || trailer[7] != 0x55 || trailer[8] != 0xa9)
+			return std::nullopt;
+
+		std::array<char, 168> chars;
+		for (size_t i = 0; i < chars.size(); ++i)
+			chars[i] = PAIRS[(data[i / 4] >> (2 * (3 - i % 4))) & 0b11];
+
+		return chars;
+	}
 }
@@ -3,14 +3,20 @@
 #include <array>
 #include <cstdint>
 #include <map>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 
 namespace Chemion {
+	constexpr size_t FRAME_SIZE = 64;
+	constexpr uint8_t FRAME_HEADER = 0xfa;
+
 	std::vector<uint8_t> encode(const std::array<char, 168> &);
 	std::vector<uint8_t> encode(std::string_view);
 	std::vector<uint8_t> fromColumns(const std::span<const std::array<bool, 7>> &);
 	std::vector<std::array<bool, 7>> stringColumns(std::string_view);
 	std::vector<uint8_t> encodeString(std::string_view);
+	// Reverses encode(), returning nothing if the header, CRC or trailer is wrong.
+	std::optional<std::array<char, 168>> decode(std::span<const uint8_t>);
 }
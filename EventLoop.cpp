@@ -0,0 +1,89 @@
+#include "EventLoop.h"
+
+#ifdef USE_MAINLOOP
+extern "C" {
+#include "src/shared/mainloop.h"
+}
+#else
+#include <mutex>
+
+namespace {
+	// The GLib counterpart of mainloop.c's loop lock: the loop thread holds it except while it polls, so every
+	// callback it dispatches (I/O watches, timeouts, idles) is serialized with Guard holders.
+	std::recursive_mutex loopMutex;
+
+	gint pollUnlocked(GPollFD *fds, guint nfds, gint timeout) {
+		loopMutex.unlock();
+		const gint ready = g_poll(fds, nfds, timeout);
+		loopMutex.lock();
+		return ready;
+	}
+}
+#endif
+
+EventLoop::Guard::Guard() {
+#ifdef USE_MAINLOOP
+	mainloop_lock();
+#else
+	loopMutex.lock();
+#endif
+}
+
+EventLoop::Guard::~Guard() {
+#ifdef USE_MAINLOOP
+	mainloop_unlock();
+#else
+	loopMutex.unlock();
+#endif
+}
+
+EventLoop::EventLoop(): glibLoop(g_main_loop_new(nullptr, false)) {
+#ifdef USE_MAINLOOP
+	mainloop_init();
+#else
+	g_main_context_set_poll_func(nullptr, pollUnlocked);
+#endif
+}
+
+EventLoop::~EventLoop() {
+	quit();
+	if (thread.joinable())
+		thread.join();
+#ifndef USE_MAINLOOP
+	g_main_context_set_poll_func(nullptr, nullptr);
+#endif
+	g_main_loop_unref(glibLoop);
+}
+
+void EventLoop::run() {
+#ifdef USE_MAINLOOP
+	// Iterating by hand rather than g_main_loop_run, which would miss a quit that lands before it starts.
+	std::thread glib_thread([this] {
+		while (!stopping)
+			g_main_context_iteration(nullptr, true);
+	});
+
+	mainloop_run();
+
+	stopping = true;
+	g_main_context_wakeup(nullptr);
+	glib_thread.join();
+#else
+	std::unique_lock lock(loopMutex);
+	g_main_loop_run(glibLoop);
+#endif
+}
+
+void EventLoop::start() {
+	thread = std::thread(&EventLoop::run, this);
+}
+
+void EventLoop::quit() {
+#ifdef USE_MAINLOOP
+	stopping = true;
+	mainloop_quit();
+	g_main_context_wakeup(nullptr);
+#else
+	g_main_loop_quit(glibLoop);
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+#include <glib.h>
+#include <thread>
+
+// Owns the loop the Bluetooth stack runs on. By default that's a GLib main loop. Built with MAINLOOP=epoll, ATT and
+// mgmt I/O go through BlueZ's edge-triggered epoll mainloop instead, and GLib only runs on a helper thread for btio's
+// connect watches and the channel watchers.
+class EventLoop {
+	public:
+		// Taken by threads other than the loop thread while they call into GAttrib or bt_att, so they don't race
+		// with dispatch. Recursive. With either backend the loop thread holds the same lock while it dispatches.
+		class Guard {
+			public:
+				Guard();
+				~Guard();
+				Guard(const Guard &) = delete;
+				Guard & operator=(const Guard &) = delete;
+		};
+
+		// Must exist before anything creates a bt_att or mgmt socket.
+		EventLoop();
+		~EventLoop();
+
+		EventLoop(const EventLoop &) = delete;
+		EventLoop & operator=(const EventLoop &) = delete;
+
+		// Runs on the calling thread until quit().
+		void run();
+		// Runs on a background thread instead; ATT I/O is dispatched on getThread().
+		void start();
+		void quit();
+		std::thread & getThread() { return thread; }
+
+	private:
+		GMainLoop *glibLoop;
+		std::thread thread;
+		std::atomic_bool stopping {false};
+};
@@ -0,0 +1,282 @@
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+extern "C" {
+#include "lib/bluetooth.h"
+#include "lib/sdp.h"
+#include "lib/uuid.h"
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+#include "attrib/gatt.h"
+}
+
+#include "Debug.h"
+#include "Encoder.h"
+#include "FakePeripheral.h"
+
+namespace {
+	std::array<uint8_t, 16> uuidBytes(const char *string) {
+		bt_uuid_t uuid;
+		std::array<uint8_t, 16> out {};
+		bt_string_to_uuid(&uuid, string);
+		bt_uuid_to_le(&uuid, out.data());
+		return out;
+	}
+
+	const auto SERVICE_UUID = uuidBytes("6e400001-b5a3-f393-e0a9-e50e24dcca9e");
+	const auto RX_UUID = uuidBytes("6e400002-b5a3-f393-e0a9-e50e24dcca9e");
+	const auto TX_UUID = uuidBytes("6e400003-b5a3-f393-e0a9-e50e24dcca9e");
+
+	struct Declaration {
+		uint16_t handle;
+		uint8_t properties;
+		uint16_t valueHandle;
+		const std::array<uint8_t, 16> &uuid;
+	};
+
+	const Declaration DECLARATIONS[] {
+		{FakePeripheral::RX_DECLARATION, GATT_CHR_PROP_WRITE_WITHOUT_RESP | GATT_CHR_PROP_WRITE, FakePeripheral::RX_HANDLE, RX_UUID},
+		{FakePeripheral::TX_DECLARATION, GATT_CHR_PROP_NOTIFY, FakePeripheral::TX_HANDLE, TX_UUID},
+	};
+
+	void append16(std::vector<uint8_t> &out, uint16_t value) {
+		out.push_back(value & 0xff);
+		out.push_back(value >> 8);
+	}
+}
+
+FakePeripheral::FakePeripheral(int fd_, uint16_t mtu_): fd(fd_), mtu(mtu_) {}
+
+FakePeripheral::~FakePeripheral() {
+	stop();
+	close(fd);
+}
+
+void FakePeripheral::start() {
+	running = true;
+	thread = std::thread(&FakePeripheral::run, this);
+}
+
+void FakePeripheral::stop() {
+	if (!thread.joinable())
+		return;
+	running = false;
+	shutdown(fd, SHUT_RDWR);
+	thread.join();
+}
+
+void FakePeripheral::onFrame(FrameHandler handler) {
+	std::unique_lock lock(mutex);
+	frameHandler = std::move(handler);
+}
+
+FakePeripheral::Stats FakePeripheral::getStats() {
+	std::unique_lock lock(mutex);
+	return stats;
+}
+
+void FakePeripheral::run() {
+	std::vector<uint8_t> buffer(ATT_MAX_VALUE_LEN + 3);
+
+	while (running) {
+		const ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length <= 0)
+			break;
+		received(buffer.data(), length);
+		handle(buffer.data(), length);
+	}
+
+	running = false;
+}
+
+void FakePeripheral::send(const std::vector<uint8_t> &pdu) {
+	if (::send(fd, pdu.data(), pdu.size(), MSG_NOSIGNAL) < 0)
+		DBG("FakePeripheral: send failed: %s", strerror(errno));
+}
+
+void FakePeripheral::sendError(uint8_t opcode, uint16_t handle, uint8_t ecode) {
+	std::vector<uint8_t> pdu {ATT_OP_ERROR, opcode};
+	append16(pdu, handle);
+	pdu.push_back(ecode);
+	send(pdu);
+}
+
+void FakePeripheral::handle(const uint8_t *pdu, size_t length) {
+	const uint8_t opcode = pdu[0];
+
+	switch (opcode) {
+		case ATT_OP_MTU_REQ: {
+			if (length != 3)
+				return sendError(opcode, 0, ATT_ECODE_INVALID_PDU);
+			std::vector<uint8_t> response {ATT_OP_MTU_RESP};
+			append16(response, mtu);
+			return send(response);
+		}
+
+		case ATT_OP_READ_BY_GROUP_REQ:
+			return readByGroupType(pdu, length);
+
+		case ATT_OP_FIND_BY_TYPE_REQ:
+			return findByTypeValue(pdu, length);
+
+		case ATT_OP_READ_BY_TYPE_REQ:
+			return readByType(pdu, length);
+
+		case ATT_OP_FIND_INFO_REQ:
+			return findInformation(pdu, length);
+
+		case ATT_OP_WRITE_REQ:
+		case ATT_OP_WRITE_CMD: {
+			if (length < 3)
+				return opcode == ATT_OP_WRITE_REQ? sendError(opcode, 0, ATT_ECODE_INVALID_PDU) : void();
+			const uint16_t handle = bt_get_le16(&pdu[1]);
+			if (handle != RX_HANDLE && handle != TX_CCC_HANDLE)
+				return opcode == ATT_OP_WRITE_REQ? sendError(opcode, handle, ATT_ECODE_WRITE_NOT_PERM) : void();
+			if (handle == RX_HANDLE)
+				write(handle, pdu + 3, length - 3);
+			if (opcode == ATT_OP_WRITE_REQ)
+				send({ATT_OP_WRITE_RESP});
+			return;
+		}
+
+		case ATT_OP_READ_REQ:
+		case ATT_OP_READ_BLOB_REQ:
+			return sendError(opcode, length < 3? 0 : bt_get_le16(&pdu[1]), ATT_ECODE_READ_NOT_PERM);
+
+		case ATT_OP_HANDLE_CNF:
+			return;
+
+		default:
+			// Commands (bit 6 set) never get a response.
+			if (!(opcode & 0x40))
+				sendError(opcode, 0, ATT_ECODE_REQ_NOT_SUPP);
+	}
+}
+
+void FakePeripheral::write(uint16_t, const uint8_t *value, size_t length) {
+	FrameHandler handler;
+	std::vector<uint8_t> frame;
+	{
+		std::unique_lock lock(mutex);
+		++stats.writes;
+		stats.bytes += length;
+
+		// Frames are found by length alone: 0xfa is also a pixel byte, so a chunk inside a frame may start with it.
+		// Only between frames does a write have to start with the header; one that doesn't is skipped until a write
+		// that does.
+		if (partial.empty() && 0 < length && value[0] != Chemion::FRAME_HEADER) {
+			++stats.corrupt;
+			return;
+		}
+
+		partial.insert(partial.end(), value, value + length);
+
+		if (partial.size() < Chemion::FRAME_SIZE)
+			return;
+
+		// Chunks never span two frames, so overshooting means this one's boundaries are off.
+		if (partial.size() != Chemion::FRAME_SIZE) {
+			++stats.corrupt;
+			partial.clear();
+			return;
+		}
+
+		++stats.frames;
+		frame.swap(partial);
+		handler = frameHandler;
+	}
+
+	if (handler)
+		handler(frame, Clock::now());
+}
+
+void FakePeripheral::readByGroupType(const uint8_t *pdu, size_t length) {
+	if (length != 7 && length != 21)
+		return sendError(pdu[0], 0, ATT_ECODE_INVALID_PDU);
+
+	const uint16_t start = bt_get_le16(&pdu[1]);
+	const uint16_t end = bt_get_le16(&pdu[3]);
+
+	if (length != 7 || bt_get_le16(&pdu[5]) != GATT_PRIM_SVC_UUID)
+		return sendError(pdu[0], start, ATT_ECODE_UNSUPP_GRP_TYPE);
+
+	if (SERVICE_HANDLE < start || end < SERVICE_HANDLE)
+		return sendError(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+
+	std::vector<uint8_t> response {ATT_OP_READ_BY_GROUP_RESP, 4 + 16};
+	append16(response, SERVICE_HANDLE);
+	append16(response, LAST_HANDLE);
+	response.insert(response.end(), SERVICE_UUID.begin(), SERVICE_UUID.end());
+	send(response);
+}
+
+void FakePeripheral::findByTypeValue(const uint8_t *pdu, size_t length) {
+	if (length < 7)
+		return sendError(pdu[0], 0, ATT_ECODE_INVALID_PDU);
+
+	const uint16_t start = bt_get_le16(&pdu[1]);
+	const uint16_t end = bt_get_le16(&pdu[3]);
+	const bool matches = bt_get_le16(&pdu[5]) == GATT_PRIM_SVC_UUID && length - 7 == SERVICE_UUID.size() &&
+		std::memcmp(pdu + 7, SERVICE_UUID.data(), SERVICE_UUID.size()) == 0;
+
+	if (!matches || SERVICE_HANDLE < start || end < SERVICE_HANDLE)
+		return sendError(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+
+	std::vector<uint8_t> response {ATT_OP_FIND_BY_TYPE_RESP};
+	append16(response, SERVICE_HANDLE);
+	append16(response, LAST_HANDLE);
+	send(response);
+}
+
+void FakePeripheral::readByType(const uint8_t *pdu, size_t length) {
+	if (length != 7 && length != 21)
+		return sendError(pdu[0], 0, ATT_ECODE_INVALID_PDU);
+
+	const uint16_t start = bt_get_le16(&pdu[1]);
+	const uint16_t end = bt_get_le16(&pdu[3]);
+
+	if (length != 7 || bt_get_le16(&pdu[5]) != GATT_CHARAC_UUID)
+		return sendError(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+
+	constexpr uint8_t entry_length = 2 + 1 + 2 + 16;
+	std::vector<uint8_t> response {ATT_OP_READ_BY_TYPE_RESP, entry_length};
+
+	for (const auto &declaration: DECLARATIONS) {
+		if (declaration.handle < start || end < declaration.handle)
+			continue;
+		if (mtu < response.size() + entry_length)
+			break;
+		append16(response, declaration.handle);
+		response.push_back(declaration.properties);
+		append16(response, declaration.valueHandle);
+		response.insert(response.end(), declaration.uuid.begin(), declaration.uuid.end());
+	}
+
+	if (response.size() == 2)
+		return sendError(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+
+	send(response);
+}
+
+void FakePeripheral::findInformation(const uint8_t *pdu, size_t length) {
+	if (length != 5)
+		return sendError(pdu[0], 0, ATT_ECODE_INVALID_PDU);
+
+	const uint16_t start = bt_get_le16(&pdu[1]);
+	const uint16_t end = bt_get_le16(&pdu[3]);
+
+	if (TX_CCC_HANDLE < start || end < TX_CCC_HANDLE)
+		return sendError(pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+
+	std::vector<uint8_t> response {ATT_OP_FIND_INFO_RESP, ATT_FIND_INFO_RESP_FMT_16BIT};
+	append16(response, TX_CCC_HANDLE);
+	append16(response, GATT_CLIENT_CHARAC_CFG_UUID);
+	send(response);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A stand-in for the glasses that speaks ATT over a socket. It exposes the Chemion UART layout (the Nordic UART
+// service with its RX and TX characteristics), answers discovery and MTU exchange and collects written frames.
+class FakePeripheral {
+	public:
+		using Clock = std::chrono::steady_clock;
+		using FrameHandler = std::function<void(const std::vector<uint8_t> &, Clock::time_point)>;
+
+		constexpr static uint16_t SERVICE_HANDLE = 0x0001;
+		constexpr static uint16_t RX_DECLARATION = 0x0002;
+		constexpr static uint16_t RX_HANDLE = 0x0003;
+		constexpr static uint16_t TX_DECLARATION = 0x0004;
+		constexpr static uint16_t TX_HANDLE = 0x0005;
+		constexpr static uint16_t TX_CCC_HANDLE = 0x0006;
+		constexpr static uint16_t LAST_HANDLE = TX_CCC_HANDLE;
+
+		struct Stats {
+			size_t writes = 0;
+			size_t bytes = 0;
+			size_t frames = 0;
+			size_t corrupt = 0;
+		};
+
+		// Takes ownership of the socket. Nothing is read from it until start() is called.
+		FakePeripheral(int fd_, uint16_t mtu_ = 23);
+		virtual ~FakePeripheral();
+
+		FakePeripheral(const FakePeripheral &) = delete;
+		FakePeripheral & operator=(const FakePeripheral &) = delete;
+
+		void start();
+		void stop();
+		void onFrame(FrameHandler);
+		Stats getStats();
+		bool isRunning() const { return running; }
+
+	protected:
+		int fd;
+		uint16_t mtu;
+
+		// Called for every PDU before it's handled; lets subclasses model link timing.
+		virtual void received(const uint8_t *, size_t) {}
+
+	private:
+		std::thread thread;
+		std::atomic_bool running {false};
+		std::mutex mutex;
+		FrameHandler frameHandler;
+		Stats stats;
+		std::vector<uint8_t> partial;
+
+		void run();
+		void handle(const uint8_t *pdu, size_t length);
+		void send(const std::vector<uint8_t> &);
+		void sendError(uint8_t opcode, uint16_t handle, uint8_t ecode);
+		void write(uint16_t handle, const uint8_t *value, size_t length);
+		void readByGroupType(const uint8_t *pdu, size_t length);
+		void findByTypeValue(const uint8_t *pdu, size_t length);
+		void readByType(const uint8_t *pdu, size_t length);
+		void findInformation(const uint8_t *pdu, size_t length);
+};
@@ -0,0 +1,136 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Debug.h"
+#include "Framebuffer.h"
+
+namespace Chemion {
+	Framebuffer::Framebuffer() {
+		fd = memfd_create("chemion-framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (fd < 0) {
+			DBG("Couldn't create framebuffer memfd: %s", strerror(errno));
+			return;
+		}
+
+		// Sealing the size means a producer can't truncate the file under us and fault our reads with SIGBUS.
+		if (ftruncate(fd, sizeof(Shared)) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+			DBG("Couldn't size framebuffer memfd: %s", strerror(errno));
+			close(fd);
+			fd = -1;
+			return;
+		}
+
+		map(true);
+	}
+
+	Framebuffer::Framebuffer(int fd_): fd(fd_) {
+		struct stat status;
+		if (fstat(fd, &status) < 0 || status.st_size < static_cast<off_t>(sizeof(Shared))) {
+			DBG("Framebuffer descriptor %d is too small to be one.", fd);
+			return;
+		}
+
+		if (map(false) && (shared->magic != MAGIC || shared->version != FORMAT_VERSION)) {
+			DBG("Framebuffer descriptor %d has the wrong magic or version.", fd);
+			munmap(shared, sizeof(Shared));
+			shared = nullptr;
+		}
+	}
+
+	Framebuffer::~Framebuffer() {
+		if (shared)
+			munmap(shared, sizeof(Shared));
+		if (0 <= fd)
+			close(fd);
+	}
+
+	bool Framebuffer::map(bool initialize) {
+		void *address = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			DBG("Couldn't map framebuffer: %s", strerror(errno));
+			return false;
+		}
+
+		// A fresh memfd reads as zeroes, which is already a blank frame with nothing published.
+		shared = static_cast<Shared *>(address);
+		if (initialize) {
+			shared->magic = MAGIC;
+			shared->version = FORMAT_VERSION;
+		}
+		return true;
+	}
+
+	void Framebuffer::publish(const Pixels &pixels) {
+		if (!shared)
+			return;
+
+		// Only the producer moves the counter, so it can't have changed since this load.
+		const uint64_t frame = shared->frame.load(std::memory_order_relaxed) + 1;
+		Slot &slot = shared->slots[frame % 2];
+		uint64_t words[3];
+		std::memcpy(words, pixels.data(), sizeof(words));
+
+		slot.sequence.store(2 * frame - 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < 3; ++i)
+			slot.words[i].store(words[i], std::memory_order_relaxed);
+		slot.sequence.store(2 * frame, std::memory_order_release);
+		shared->frame.store(frame, std::memory_order_release);
+	}
+
+	uint64_t Framebuffer::getFrame() const {
+		return shared? shared->frame.load(std::memory_order_acquire) : 0;
+	}
+
+	std::optional<Framebuffer::Pixels> Framebuffer::read(uint64_t &seen) const {
+		if (!shared)
+			return std::nullopt;
+
+		for (int attempt = 0; attempt < 4; ++attempt) {
+			const uint64_t frame = shared->frame.load(std::memory_order_acquire);
+			if (frame == seen)
+				return std::nullopt;
+
+			const Slot &slot = shared->slots[frame % 2];
+			const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			// Anything else means the producer has since moved on to frame + 2 in this slot.
+			if (sequence != 2 * frame)
+				continue;
+
+			uint64_t words[3];
+			for (size_t i = 0; i < 3; ++i)
+				words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+				continue;
+
+			Pixels pixels;
+			std::memcpy(pixels.data(), words, sizeof(words));
+			seen = frame;
+			return pixels;
+		}
+
+		return std::nullopt;
+	}
+
+	Framebuffer::Pixels Framebuffer::toPixels(std::span<const std::array<bool, 7>> columns) {
+		Pixels pixels {};
+		for (size_t column = 0; column < pixels.size() && column < columns.size(); ++column)
+			for (size_t row = 0; row < 7; ++row)
+				pixels[column] |= columns[column][row] << row;
+		return pixels;
+	}
+
+	std::vector<std::array<bool, 7>> Framebuffer::toColumns(const Pixels &pixels) {
+		std::vector<std::array<bool, 7>> columns(pixels.size());
+		for (size_t column = 0; column < pixels.size(); ++column)
+			for (size_t row = 0; row < 7; ++row)
+				columns[column][row] = (pixels[column] >> row) & 1;
+		return columns;
+	}
+}
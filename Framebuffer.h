@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace Chemion {
+	// A 24x7 frame shared between processes through a memfd, for producers that live outside the process driving the
+	// glasses. Frames alternate between two slots, each guarded by a seqlock, and a counter names the newest complete
+	// one: publishing never waits for readers, and reading is a few atomic loads that retry if the producer overwrote
+	// the slot meanwhile. There must be one producer at a time.
+	class Framebuffer {
+		public:
+			// One byte per column from the left, with bit n set for a lit pixel in row n (as in Protocol::ShowImage).
+			using Pixels = std::array<uint8_t, 24>;
+
+			static constexpr uint32_t MAGIC = 0x43484642;
+			static constexpr uint32_t FORMAT_VERSION = 1;
+
+			// Creates a blank framebuffer in a new memfd.
+			Framebuffer();
+			// Maps one created elsewhere, e.g. received over chemiond's socket. Takes over the descriptor.
+			explicit Framebuffer(int fd_);
+			~Framebuffer();
+
+			Framebuffer(const Framebuffer &) = delete;
+			Framebuffer & operator=(const Framebuffer &) = delete;
+
+			bool isOpen() const { return shared != nullptr; }
+			// For handing to a producer. Still owned by this object.
+			int getFD() const { return fd; }
+
+			void publish(const Pixels &);
+			void publish(std::span<const std::array<bool, 7>> columns) { publish(toPixels(columns)); }
+			// Number of the newest complete frame; zero if nothing has been published yet.
+			uint64_t getFrame() const;
+			// Returns the newest frame if it's newer than seen, and updates seen. Gives up (returning nothing) if the
+			// producer keeps overwriting the slot being read, which the next call catches up on.
+			std::optional<Pixels> read(uint64_t &seen) const;
+
+			static Pixels toPixels(std::span<const std::array<bool, 7>> columns);
+			static std::vector<std::array<bool, 7>> toColumns(const Pixels &);
+
+		private:
+			struct Slot {
+				// 2 * frame once the slot holds that frame, 2 * frame - 1 while it's being written.
+				std::atomic<uint64_t> sequence;
+				std::atomic<uint64_t> words[3];
+			};
+
+			struct Shared {
+				uint32_t magic;
+				uint32_t version;
+				std::atomic<uint64_t> frame;
+				Slot slots[2];
+			};
+
+			static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomics in shared memory must be lock-free");
+
+			int fd = -1;
+			Shared *shared = nullptr;
+
+			bool map(bool initialize);
+	};
+}
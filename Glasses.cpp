@@ -1,17 +1,63 @@
+#include <algorithm>
 #include <cassert>
+#include <set>
 
+#include "Animation.h"
 #include "Debug.h"
+#include "Framebuffer.h"
 #include "Glasses.h"
 #include "Image.h"
+#include "Scanner.h"
 #include "Scroller.h"
+#include "Trace.h"
 
 namespace Chemion {
+	void FrameMetrics::list(const Metrics::Labels &labels) const {
+		Metrics::add("chemion_frames_rendered_total", "Frames handed to the glasses, including skipped duplicates.", rendered,
+			labels);
+		Metrics::add("chemion_frames_sent_total", "Frames written to the link in full.", sent, labels);
+		Metrics::add("chemion_frames_deduplicated_total", "Frames skipped because the display already showed them.",
+			deduplicated, labels);
+		Metrics::add("chemion_reconnects_total", "Links restored by the reconnect supervisor.", reconnects, labels);
+		Metrics::add("chemion_frame_send_seconds", "Time to write a frame's chunks (until acknowledged, in request mode).",
+			sendTime, labels);
+	}
+
+	Glasses::~Glasses() {
+		bluetooth.onDisconnect = {};
+		pacer.cancel();
+
+		// Removed even if the kernel hasn't answered yet, so a late acceptance doesn't leave the device behind.
+		if (autoConnectRequested) {
+			bluetooth.mgmt.onDeviceConnected = {};
+			bluetooth.mgmt.removeDevice(bdaddr, mgmtAddressType());
+		}
+
+		if (supervisor.joinable()) {
+			{
+				std::unique_lock lock(cvLink.mutex);
+				stopping = true;
+			}
+			cvLink.notify();
+			backoff.cancel();
+			supervisor.join();
+		}
+	}
+
 	void Glasses::setup(uint16_t index) {
 		bluetooth.setup(index);
 	}
 
-	bool Glasses::connect(const char *addr) {
-		if (!bluetooth.connectDevice(addr))
+	bool Glasses::connect(const char *addr, const char *type) {
+		const auto started = Clock::now();
+		address = addr;
+		addressType = type;
+
+		const Metrics::Labels labels {{"device", address}};
+		bluetooth.metrics.list(labels);
+		frameMetrics.list(labels);
+
+		if (!bluetooth.connectDevice(addr, type))
 			return false;
 		
 		if (!bluetooth.waitForConnection()) {
@@ -29,7 +75,10 @@ namespace Chemion {
 			return false;
 		}
 
-		assert(bluetooth.services.size() == 1);
+		if (bluetooth.services.size() != 1) {
+			DBG("Expected one UART service, found %lu.", bluetooth.services.size());
+			return false;
+		}
 
 		if (!bluetooth.findCharacteristics()) {
 			DBG("Couldn't get characteristics.");
@@ -45,35 +94,409 @@ namespace Chemion {
 			return false;
 		}
 
+		connectTime = Clock::now() - started;
 		return true;
 	}
 
+	bool Glasses::migrate(uint16_t index, std::shared_ptr<Transport> transport) {
+		// The supervisor would otherwise treat the deliberate disconnect as link loss.
+		auto on_disconnect = std::move(bluetooth.onDisconnect);
+		bluetooth.onDisconnect = {};
+		bluetooth.disconnectIO();
+		bluetooth.onDisconnect = std::move(on_disconnect);
+
+		// The auto-connect list is per controller, so the registration moves too.
+		if (autoConnectRequested)
+			bluetooth.mgmt.removeDevice(bdaddr, mgmtAddressType());
+
+		rx = nullptr;
+		setup(index);
+		setTransport(std::move(transport));
+
+		if (autoConnectRequested)
+			registerAutoConnect();
+
+		// connect() assigns both, so don't hand it pointers into them.
+		const std::string target = address;
+		const std::string target_type = addressType;
+		return connect(target.c_str(), target_type.c_str());
+	}
+
+	bool Glasses::connect(Scanner &scanner, int8_t min_rssi, std::chrono::milliseconds timeout) {
+		const auto deadline = Clock::now() + timeout;
+		std::set<std::string> tried;
+
+		auto eligible = [&](const ScanResult &result) {
+			return result.connectable && result.hasRSSI && min_rssi <= result.rssi && !tried.contains(result.addressString());
+		};
+
+		while (Clock::now() < deadline) {
+			if (!scanner.isScanning() && !scanner.start(min_rssi))
+				return false;
+
+			const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+			const auto candidates = scanner.waitFor(eligible, 1, remaining);
+			if (candidates.empty())
+				break;
+
+			// Most controllers can't initiate a connection while scanning.
+			scanner.stop();
+
+			const auto &candidate = candidates.front();
+			const auto candidate_address = candidate.addressString();
+			tried.insert(candidate_address);
+			DBG("Found %s (%s) at %d dBm; connecting.", candidate_address.c_str(), candidate.name.c_str(), candidate.rssi);
+
+			if (connect(candidate_address.c_str(), candidate.typeString()))
+				return true;
+		}
+
+		scanner.stop();
+		DBG("No glasses connected within %ld ms.", static_cast<long>(timeout.count()));
+		return false;
+	}
+
+	void Glasses::setWriteMode(Bluetooth::WriteMode mode, size_t max_outstanding, size_t max_retries) {
+		bluetooth.writeMode = mode;
+		bluetooth.maxOutstanding = std::max<size_t>(max_outstanding, 1);
+		bluetooth.maxRetries = max_retries;
+	}
+
+	void Glasses::setAdaptive(bool enabled, RateBounds bounds) {
+		if (enabled)
+			controller.emplace(bounds);
+		else
+			controller.reset();
+	}
+
+	void Glasses::setDeduplicate(bool enabled) {
+		std::unique_lock lock(frameMutex);
+		deduplicate = enabled;
+	}
+
+	size_t Glasses::nextChunkSize(size_t frame_bytes) {
+		if (!controller)
+			return 20;
+		controller->sample(bluetooth.bytesSent, bluetooth.writeQueueDepth(), frame_bytes, bluetooth.getMTU());
+		return controller->chunkSize();
+	}
+
+	void Glasses::enableReconnect(ReconnectPolicy new_policy) {
+		if (supervisor.joinable())
+			return;
+
+		policy = new_policy;
+		bluetooth.onDisconnect = [this] { linkDown(); };
+
+		if (policy.autoConnect && str2ba(address.c_str(), &bdaddr) == 0) {
+			bluetooth.mgmt.onDeviceConnected = [this](const mgmt_addr_info &info) {
+				if (bacmp(&info.bdaddr, &bdaddr) != 0)
+					return;
+				{
+					std::unique_lock lock(cvLink.mutex);
+					deviceConnected = true;
+				}
+				cvLink.notify();
+			};
+			autoConnectRequested = true;
+			registerAutoConnect();
+		}
+
+		supervisor = std::thread(&Glasses::supervise, this);
+	}
+
+	void Glasses::registerAutoConnect() {
+		// Queuing the request isn't enough; the kernel can still turn it down, e.g. for a controller without LE.
+		autoConnectRegistered = false;
+		bluetooth.mgmt.addDevice(bdaddr, mgmtAddressType(), Mgmt::Action::AutoConnect, [this](bool accepted) {
+			autoConnectRegistered = accepted;
+		});
+	}
+
+	OutageStats Glasses::getOutageStats() {
+		std::unique_lock lock(outageMutex);
+		return outageStats;
+	}
+
+	void Glasses::linkDown() {
+		DBG("Link to %s lost.", address.c_str());
+		{
+			std::unique_lock lock(cvLink.mutex);
+			lostAt = Clock::now();
+			linkLost = true;
+			deviceConnected = false;
+		}
+		cvLink.notify();
+
+		std::unique_lock lock(frameMutex);
+		frameShown = false;
+	}
+
+	bool Glasses::reconnect() {
+		// The characteristic handles don't change between connections, so discovery is skipped.
+		return bluetooth.connectDevice(address.c_str(), addressType.c_str()) && bluetooth.waitForConnection();
+	}
+
+	void Glasses::supervise() {
+		while (true) {
+			cvLink.wait([this] { return linkLost.load() || stopping.load(); });
+			if (stopping)
+				return;
+
+			auto delay = policy.initialDelay;
+			size_t attempt = 0;
+			bool restored = false;
+
+			// The controller brings the link back up by itself, so just wait for it and then attach. The glasses may not
+			// be advertising yet, so this is kept short rather than holding up the backoff loop.
+			if (autoConnectRegistered)
+				cvLink.wait_for(policy.autoConnectTimeout, [this] { return deviceConnected.load() || stopping.load(); });
+
+			while (!stopping) {
+				++attempt;
+				{
+					std::unique_lock lock(outageMutex);
+					++outageStats.attempts;
+				}
+
+				if (reconnect()) {
+					restored = true;
+					break;
+				}
+
+				if (policy.maxAttempts != 0 && policy.maxAttempts <= attempt)
+					break;
+
+				DBG("Reconnect attempt %lu failed; retrying in %ld ms.", attempt, static_cast<long>(delay.count()));
+				backoff.sleepFor(delay);
+				delay = std::min(policy.maxDelay, std::chrono::duration_cast<std::chrono::milliseconds>(delay * policy.multiplier));
+			}
+
+			if (!restored) {
+				if (!stopping)
+					DBG("Giving up on %s after %lu attempts.", address.c_str(), attempt);
+				abandoned = true;
+				cvLink.notify();
+				return;
+			}
+
+			const auto outage = Clock::now() - lostAt;
+			{
+				std::unique_lock lock(outageMutex);
+				++outageStats.outages;
+				outageStats.total += outage;
+				outageStats.last = outage;
+				outageStats.max = std::max<std::chrono::nanoseconds>(outageStats.max, outage);
+			}
+
+			DBG("Reconnected to %s after %.3f seconds.", address.c_str(), std::chrono::duration<double>(outage).count());
+			frameMetrics.reconnects->add();
+
+			{
+				std::unique_lock lock(cvLink.mutex);
+				linkLost = false;
+			}
+			cvLink.notify();
+
+			// A running animation puts up its own frame when it resumes.
+			if (!animating) {
+				uint64_t started;
+				{
+					std::unique_lock lock(frameMutex);
+					started = framesStarted;
+				}
+
+				std::unique_lock send_lock(sendMutex);
+				std::vector<uint8_t> frame;
+				{
+					std::unique_lock lock(frameMutex);
+					// Otherwise a present() since the link came back has already put up a newer frame.
+					if (framesStarted == started) {
+						frame = lastFrame;
+						frameDrops = bluetooth.metrics.commandsDropped->get();
+					}
+				}
+				const Trace::Frame trace;
+				if (!frame.empty()) {
+					if (bluetooth.batch(frame, *rx, nextChunkSize(frame.size()))) {
+						std::unique_lock lock(frameMutex);
+						frameShown = lastFrame == frame;
+					} else
+						DBG("Couldn't restore the last frame.");
+				}
+			}
+		}
+	}
+
+	bool Glasses::waitForLink() {
+		if (!supervisor.joinable())
+			return false;
+
+		return cvLink.wait_for(policy.resumeTimeout, [this] {
+			return (bluetooth.connected.load() && !linkLost.load()) || stopping.load() || abandoned.load();
+		}) && !stopping && !abandoned;
+	}
+
+	bool Glasses::present(std::span<const uint8_t> encoded, size_t chunk_size) {
+		frameMetrics.rendered->add();
+		std::unique_lock send_lock(sendMutex);
+		{
+			std::unique_lock lock(frameMutex);
+			// The glasses hold the last frame they were sent, so sending it again would only take airtime.
+			if (deduplicate && isFrameShown() && std::ranges::equal(encoded, lastFrame)) {
+				frameMetrics.deduplicated->add();
+				return true;
+			}
+			lastFrame.assign(encoded.begin(), encoded.end());
+			++framesStarted;
+			frameShown = false;
+			frameDrops = bluetooth.metrics.commandsDropped->get();
+		}
+
+		if (bluetooth.capture) {
+			char note[64];
+			snprintf(note, sizeof(note), "frame %lu: %lu bytes in chunks of %lu", framesPresented++, encoded.size(), chunk_size);
+			bluetooth.annotate(note);
+		}
+
+		const auto started = Clock::now();
+		if (!bluetooth.batch(encoded, *rx, chunk_size))
+			return false;
+		frameMetrics.sendTime->observe(Clock::now() - started);
+		frameMetrics.sent->add();
+
+		std::unique_lock lock(frameMutex);
+		frameShown = std::ranges::equal(lastFrame, encoded);
+		return true;
+	}
+
+	bool Glasses::isFrameShown() const {
+		if (!frameShown || bluetooth.writeMode == Bluetooth::WriteMode::Request)
+			return frameShown;
+		// Write commands are only queued when batch() returns. Once bt_att has none left and dropped none since, every
+		// chunk is on the link.
+		return bluetooth.queuedCommands == 0 && bluetooth.metrics.commandsDropped->get() == frameDrops;
+	}
+
+	bool Glasses::sendFrame(std::span<const uint8_t> encoded) {
+		if (rx == nullptr)
+			return false;
+		const Trace::Frame trace;
+		return present(encoded, nextChunkSize(encoded.size()));
+	}
+
 	bool Glasses::scroll(Scroller &scroller, size_t initial_delay, size_t count) {
 		assert(rx != nullptr);
 
-		auto batch = [this](const std::vector<uint8_t> &enc, size_t count) {
-			return bluetooth.batch(enc, *rx, count);
+		auto batch = [this, &scroller](const std::vector<uint8_t> &enc, size_t count) {
+			if (controller) {
+				count = nextChunkSize(enc.size());
+				scroller.delay = controller->frameInterval();
+			}
+			return present(enc, count);
 		};
 
+		animating = true;
+
+		// Frames are due at absolute times, so time spent sending doesn't accumulate as drift.
+		auto next = Clock::now();
+
 		for (size_t i = 0; i < count; ++i) {
-			if (!scroller.render(batch))
-				return false;
+			const Trace::Frame trace;
+			if (!scroller.render(batch)) {
+				const auto failed_at = Clock::now();
+				if (!waitForLink()) {
+					animating = false;
+					return false;
+				}
+				// Pick up at the position the scroll would have reached had the link never dropped.
+				scroller.advance(Clock::now() - failed_at);
+				next = Clock::now();
+				continue;
+			}
+
+			next += scroller.hold;
 			if (i == 0)
-				std::this_thread::sleep_for(std::chrono::milliseconds(initial_delay));
+				next += std::chrono::milliseconds(initial_delay);
+
+			if (!pacer.sleepUntil(next)) {
+				animating = false;
+				return false;
+			}
 		}
 
+		animating = false;
+		return true;
+	}
+
+	bool Glasses::play(const Animation &animation, size_t loops) {
+		assert(rx != nullptr);
+		animating = true;
+
+		// Entries are due at absolute times, as in scroll(). One whose time has already passed, because the link was
+		// down or slow, is skipped so the show stays in step with its clock.
+		auto next = Clock::now();
+
+		for (size_t loop = 0; loop < loops; ++loop) {
+			for (size_t i = 0; i < animation.getEntryCount(); ++i) {
+				const Animation::Entry entry = animation.getEntry(i);
+				const auto frame = animation.getFrame(entry.frame);
+				if (frame.empty()) {
+					DBG("Animation entry %lu names frame %u of %lu.", i, entry.frame, animation.getFrameCount());
+					animating = false;
+					return false;
+				}
+
+				next += std::chrono::milliseconds(entry.duration);
+				if (next <= Clock::now())
+					continue;
+
+				const Trace::Frame trace;
+				if (!present(frame, nextChunkSize(frame.size()))) {
+					if (!waitForLink()) {
+						animating = false;
+						return false;
+					}
+					// Put the frame up for whatever is left of its time.
+					if (Clock::now() < next)
+						present(frame, nextChunkSize(frame.size()));
+				}
+
+				if (!pacer.sleepUntil(next)) {
+					animating = false;
+					return false;
+				}
+			}
+		}
+
+		animating = false;
 		return true;
 	}
 
 	bool Glasses::showString(std::string_view string) {
 		if (rx == nullptr)
 			return false;
-		return bluetooth.batch(Chemion::encodeString(string), *rx, 20);
+		const Trace::Frame trace;
+		const auto encoded = Chemion::encodeString(string);
+		return present(encoded, nextChunkSize(encoded.size()));
 	}
 
 	bool Glasses::display(const Image &image) {
 		if (rx == nullptr)
 			return false;
-		return bluetooth.batch(Chemion::fromColumns(image.data), *rx, 20);
+		const Trace::Frame trace;
+		const auto encoded = Chemion::fromColumns(image.data);
+		return present(encoded, nextChunkSize(encoded.size()));
+	}
+
+	bool Glasses::showLatest(const Framebuffer &framebuffer, uint64_t &seen) {
+		if (rx == nullptr)
+			return false;
+		const auto pixels = framebuffer.read(seen);
+		if (!pixels)
+			return true;
+		const Trace::Frame trace;
+		const auto encoded = Chemion::fromColumns(Framebuffer::toColumns(*pixels));
+		return present(encoded, nextChunkSize(encoded.size()));
 	}
 }
@@ -1,24 +1,166 @@
 #pragma once
 
+#include <string>
+#include <thread>
+
 #include "Bluetooth.h"
+#include "Metrics.h"
+#include "RateController.h"
+#include "TimerWheel.h"
+
+class Scanner;
 
 namespace Chemion {
+	class Animation;
+	class Framebuffer;
 	class Image;
 	struct Scroller;
 
+	struct ReconnectPolicy {
+		std::chrono::milliseconds initialDelay {100};
+		std::chrono::milliseconds maxDelay {5'000};
+		double multiplier = 2.;
+		// Zero means keep trying until the Glasses object is destroyed.
+		size_t maxAttempts = 0;
+		// How long an animation waits for the link to come back before giving up.
+		std::chrono::milliseconds resumeTimeout {60'000};
+		// Registers the glasses with the kernel (MGMT_OP_ADD_DEVICE) so the controller reconnects by itself as soon as
+		// they advertise; the supervisor then only has to attach to the link. Falls back to the backoff loop if the
+		// kernel turned the registration down, if the controller hasn't reconnected within autoConnectTimeout, or if
+		// attaching fails.
+		bool autoConnect = false;
+		std::chrono::milliseconds autoConnectTimeout {3'000};
+	};
+
+	struct OutageStats {
+		size_t outages = 0;
+		size_t attempts = 0;
+		std::chrono::nanoseconds total {0};
+		std::chrono::nanoseconds last {0};
+		std::chrono::nanoseconds max {0};
+	};
+
+	struct FrameMetrics {
+		std::shared_ptr<Metrics::Counter> rendered = std::make_shared<Metrics::Counter>();
+		std::shared_ptr<Metrics::Counter> sent = std::make_shared<Metrics::Counter>();
+		std::shared_ptr<Metrics::Counter> deduplicated = std::make_shared<Metrics::Counter>();
+		std::shared_ptr<Metrics::Counter> reconnects = std::make_shared<Metrics::Counter>();
+		std::shared_ptr<Metrics::Histogram> sendTime = std::make_shared<Metrics::Histogram>();
+
+		void list(const Metrics::Labels &) const;
+	};
+
 	class Glasses {
 		private:
+			using Clock = std::chrono::steady_clock;
+
 			Bluetooth bluetooth;
 			Characteristic *rx = nullptr;
+			std::optional<RateController> controller;
+			std::string address;
+			std::string addressType = "random";
+			std::chrono::nanoseconds connectTime {0};
+
+			std::mutex frameMutex;
+			std::vector<uint8_t> lastFrame;
+			// Whether lastFrame was written in full. In command mode that only means queued until isFrameShown() says so.
+			bool frameShown = false;
+			// Dropped commands counted when lastFrame was queued; any more since then may have been some of its chunks.
+			uint64_t frameDrops = 0;
+			// Counts present() calls that got past deduplication, so the supervisor can tell one has sent since the link
+			// came back. Guarded by frameMutex.
+			uint64_t framesStarted = 0;
+			// Held for the whole of a send, so the supervisor's restore can't interleave its chunks with present()'s.
+			std::mutex sendMutex;
+			bool deduplicate = false;
+			FrameMetrics frameMetrics;
+			std::atomic_bool animating {false};
+			std::atomic_size_t framesPresented {0};
+
+			ReconnectPolicy policy;
+			std::thread supervisor;
+			std::atomic_bool stopping {false};
+			std::atomic_bool linkLost {false};
+			std::atomic_bool abandoned {false};
+			std::atomic_bool deviceConnected {false};
+			// Requested once enableReconnect() has asked for auto-connect; registered once the kernel has accepted it.
+			bool autoConnectRequested = false;
+			std::atomic_bool autoConnectRegistered {false};
+			bdaddr_t bdaddr {};
+			Clock::time_point lostAt;
+			CVPair cvLink;
+			Alarm backoff;
+			Alarm pacer;
+			std::mutex outageMutex;
+			OutageStats outageStats;
+
+			size_t nextChunkSize(size_t frame_bytes);
+			bool present(std::span<const uint8_t> encoded, size_t chunk_size);
+			// Expects frameMutex to be held.
+			bool isFrameShown() const;
+			void linkDown();
+			void supervise();
+			bool reconnect();
+			bool waitForLink();
+			void registerAutoConnect();
+			uint8_t mgmtAddressType() const { return addressType == "public"? BDADDR_LE_PUBLIC : BDADDR_LE_RANDOM; }
 
 		public:
 			using Columns = std::vector<std::array<bool, 7>>;
 
+			Glasses() = default;
+			~Glasses();
+
 			void setup(uint16_t index);
-			bool connect(const char *addr);
+			// Must be called before connect(). The default transport talks to real hardware through BlueZ.
+			void setTransport(std::shared_ptr<Transport> transport) { bluetooth.transport = std::move(transport); }
+			bool connect(const char *addr, const char *type = "random");
+			// Connects to the first glasses the scanner sees advertising at or above min_rssi, stopping the scan first.
+			// If that fails, it resumes scanning and tries the next candidate until the timeout passes.
+			bool connect(Scanner &, int8_t min_rssi = -80, std::chrono::milliseconds timeout = std::chrono::milliseconds(10'000));
+			const std::string & getAddress() const { return address; }
+			const std::string & getAddressType() const { return addressType; }
+			// Drops the link and connects again through another adapter's transport, keeping this object (and any
+			// animation using it) in place.
+			bool migrate(uint16_t index, std::shared_ptr<Transport>);
+			uint64_t getBytesSent() const { return bluetooth.bytesSent; }
+			// How long the last successful connect() took, from the call until the RX characteristic was found.
+			std::chrono::nanoseconds getConnectTime() const { return connectTime; }
+			// Records all ATT traffic, annotated with frame numbers. Must be called before connect().
+			void setCapture(std::shared_ptr<Capture> capture) { bluetooth.setCapture(std::move(capture)); }
+
+			// Request mode uses acknowledged Write Requests and resends a frame if any of its chunks fails.
+			void setWriteMode(Bluetooth::WriteMode, size_t max_outstanding = 4, size_t max_retries = 3);
+			AckStats getAckStats() { return bluetooth.getAckStats(); }
+			bt_att_alloc_stats getAttAllocStats() const { return bluetooth.getAttAllocStats(); }
+			SendLatency getSendLatency() { return bluetooth.getSendLatency(); }
+
+			// Replaces fixed pacing with a controller that tracks what the link currently sustains.
+			void setAdaptive(bool enabled, RateBounds = {});
+			// Skips frames identical to the one already on the display. Off by default, since an identical frame is also a
+			// way to repaint glasses that may have missed one.
+			void setDeduplicate(bool enabled);
+			const RateController * getController() const { return controller? &*controller : nullptr; }
+
+			// Starts a supervisor that reconnects after link loss, reusing the handles found by connect(), and then
+			// re-sends the last frame. A scroll in progress waits for the link and resumes where it would have been.
+			void enableReconnect(ReconnectPolicy = {});
+			OutageStats getOutageStats();
+
+			bool isConnected() const { return rx != nullptr && bluetooth.connected.load(); }
+			// Sends a frame that has already been encoded, e.g. once for a whole group.
+			bool sendFrame(std::span<const uint8_t> encoded);
+			// Blocks until every queued write has left the transport (or been acknowledged, in request mode).
+			bool waitForDrain(std::chrono::milliseconds timeout = std::chrono::milliseconds(1'000)) { return bluetooth.waitForDrain(timeout); }
 
 			bool scroll(Scroller &, size_t initial_delay = 0, size_t count = -1);
+			// Streams the animation's frames as they are in the file, timed by its timeline. Waits for the link like
+			// scroll() does, skipping whatever fell due meanwhile.
+			bool play(const Animation &, size_t loops = 1);
 			bool showString(std::string_view);
 			bool display(const Image &);
+			// Sends the newest frame a producer has published if it's newer than seen, and updates seen. Returns false
+			// only if sending failed.
+			bool showLatest(const Framebuffer &, uint64_t &seen);
 	};
 }
@@ -0,0 +1,275 @@
+#include <algorithm>
+
+#include "Debug.h"
+#include "Encoder.h"
+#include "GlassesGroup.h"
+#include "Image.h"
+#include "Scanner.h"
+#include "Trace.h"
+
+namespace Chemion {
+	GlassesGroup::GlassesGroup(uint16_t index_, TransportFactory factory_): index(index_), factory(std::move(factory_)) {}
+
+	GlassesGroup::~GlassesGroup() {
+		for (auto &member: members) {
+			{
+				std::unique_lock lock(member->cv.mutex);
+				member->stopping = true;
+			}
+			member->cv.notify();
+			member->sender.join();
+		}
+	}
+
+	size_t GlassesGroup::connect(const std::vector<std::string> &addresses) {
+		std::vector<std::unique_ptr<Member>> candidates;
+		candidates.reserve(addresses.size());
+		for (const auto &address: addresses)
+			candidates.emplace_back(std::make_unique<Member>(address));
+		return connect(std::move(candidates));
+	}
+
+	size_t GlassesGroup::connect(Scanner &scanner, size_t count, int8_t min_rssi, std::chrono::milliseconds timeout) {
+		if (!scanner.isScanning() && !scanner.start(min_rssi))
+			return 0;
+
+		const auto found = scanner.waitFor([this, min_rssi](const ScanResult &result) {
+			if (!result.connectable || !result.hasRSSI || result.rssi < min_rssi)
+				return false;
+			const auto address = result.addressString();
+			std::unique_lock lock(membersMutex);
+			return std::none_of(members.begin(), members.end(), [&](const auto &member) { return member->address == address; });
+		}, count, timeout);
+
+		scanner.stop();
+
+		if (found.size() < count)
+			DBG("Only found %lu of %lu glasses.", found.size(), count);
+
+		std::vector<std::unique_ptr<Member>> candidates;
+		candidates.reserve(found.size());
+		for (const auto &result: found) {
+			DBG("Connecting to %s (%s) at %.1f dBm.", result.addressString().c_str(), result.name.c_str(), result.smoothedRSSI);
+			candidates.emplace_back(std::make_unique<Member>(result.addressString(), result.typeString()));
+		}
+
+		return connect(std::move(candidates));
+	}
+
+	size_t GlassesGroup::connect(std::vector<std::unique_ptr<Member>> candidates) {
+		std::vector<std::thread> connectors;
+		std::vector<char> succeeded(candidates.size(), false);
+
+		connectors.reserve(candidates.size());
+
+		// Glasses::connect blocks on each step of connection and discovery, so a thread per device lets them overlap.
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			auto &member = *candidates[i];
+			connectors.emplace_back([this, &member, &succeeded, i] {
+				member.glasses->setup(index);
+				if (factory)
+					member.glasses->setTransport(factory(member.address));
+				succeeded[i] = member.glasses->connect(member.address.c_str(), member.addressType.c_str());
+			});
+		}
+
+		for (auto &connector: connectors)
+			connector.join();
+
+		size_t connected = 0;
+		std::unique_lock lock(membersMutex);
+
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			if (!succeeded[i]) {
+				DBG("Couldn't connect to %s.", candidates[i]->address.c_str());
+				continue;
+			}
+
+			auto &member = *members.emplace_back(std::move(candidates[i]));
+			member.position = members.size() - 1;
+			member.sender = std::thread(&GlassesGroup::send, this, std::ref(member));
+			++connected;
+		}
+
+		return connected;
+	}
+
+	size_t GlassesGroup::size() {
+		std::unique_lock lock(membersMutex);
+		return members.size();
+	}
+
+	Glasses & GlassesGroup::operator[](size_t i) {
+		std::unique_lock lock(membersMutex);
+		return *members.at(i)->glasses;
+	}
+
+	const std::string & GlassesGroup::addressOf(size_t i) {
+		std::unique_lock lock(membersMutex);
+		return members.at(i)->address;
+	}
+
+	MemberStats GlassesGroup::getStats(size_t i) {
+		Member *member;
+		{
+			std::unique_lock lock(membersMutex);
+			member = members.at(i).get();
+		}
+		std::unique_lock lock(member->cv.mutex);
+		return member->stats;
+	}
+
+	void GlassesGroup::enqueue(Job job) {
+		job.trace = Trace::current();
+		for (auto &member: members) {
+			std::optional<Job> replaced;
+			{
+				std::unique_lock lock(member->cv.mutex);
+				if (member->pending) {
+					++member->stats.superseded;
+					member->superseded->add();
+					replaced = std::move(member->pending);
+				}
+				member->pending = job;
+			}
+			member->cv.notify();
+
+			if (replaced && replaced->deadline)
+				deliver(*member, *replaced, std::nullopt);
+		}
+	}
+
+	void GlassesGroup::sendFrame(Frame frame) {
+		const Trace::Frame trace;
+		std::unique_lock lock(membersMutex);
+		enqueue({std::move(frame), std::nullopt, 0});
+	}
+
+	void GlassesGroup::sendFrame(std::vector<uint8_t> encoded) {
+		sendFrame(std::make_shared<const std::vector<uint8_t>>(std::move(encoded)));
+	}
+
+	void GlassesGroup::showString(std::string_view string) {
+		const Trace::Frame trace;
+		sendFrame(encodeString(string));
+	}
+
+	void GlassesGroup::display(const Image &image) {
+		const Trace::Frame trace;
+		sendFrame(fromColumns(image.data));
+	}
+
+	uint64_t GlassesGroup::present(Frame frame, Clock::time_point deadline) {
+		const Trace::Frame trace;
+		// Held until the frame is queued, so the tally expects exactly the members that get it.
+		std::unique_lock members_lock(membersMutex);
+		uint64_t id;
+		{
+			std::unique_lock lock(reportMutex);
+			id = nextFrame++;
+			if (members.empty())
+				return id;
+			auto &tally = tallies[id];
+			tally.remaining = members.size();
+			tally.report.frame = id;
+			tally.report.deadline = deadline;
+			tally.report.offsets.resize(members.size());
+		}
+
+		enqueue({std::move(frame), deadline, id});
+		return id;
+	}
+
+	uint64_t GlassesGroup::present(const Image &image, Clock::time_point deadline) {
+		const Trace::Frame trace;
+		return present(std::make_shared<const std::vector<uint8_t>>(fromColumns(image.data)), deadline);
+	}
+
+	std::optional<PresentReport> GlassesGroup::getLastReport() {
+		std::unique_lock lock(reportMutex);
+		return lastReport;
+	}
+
+	void GlassesGroup::send(Member &member) {
+		while (true) {
+			Job job;
+			std::chrono::nanoseconds latency;
+			{
+				std::unique_lock lock(member.cv.mutex);
+				member.cv.var.wait(lock, [&] { return member.pending || member.stopping; });
+				if (member.stopping)
+					return;
+				job = std::move(*member.pending);
+				member.pending.reset();
+				latency = member.stats.latency;
+			}
+
+			if (job.deadline) {
+				// Start early by this link's latency so the frame lands at the deadline on every member.
+				const auto start_at = *job.deadline - latency;
+				std::unique_lock lock(member.cv.mutex);
+				member.cv.var.wait_until(lock, start_at, [&] { return member.stopping; });
+				if (member.stopping)
+					return;
+			}
+
+			const Trace::Frame trace(job.trace);
+			const auto started = Clock::now();
+			const bool sent = member.glasses->sendFrame(*job.frame) && member.glasses->waitForDrain();
+			const auto finished = Clock::now();
+
+			{
+				std::unique_lock lock(member.cv.mutex);
+				if (sent) {
+					++member.stats.sent;
+					const auto elapsed = finished - started;
+					member.stats.latency = member.stats.latency.count() == 0? elapsed : (member.stats.latency * 4 + elapsed) / 5;
+				} else
+					++member.stats.failed;
+			}
+
+			if (job.deadline)
+				deliver(member, job, sent? std::optional(finished) : std::nullopt);
+		}
+	}
+
+	void GlassesGroup::deliver(Member &member, const Job &job, std::optional<Clock::time_point> finished) {
+		std::function<void(const PresentReport &)> fn;
+		PresentReport report;
+		{
+			std::unique_lock lock(reportMutex);
+			auto iter = tallies.find(job.id);
+			if (iter == tallies.end())
+				return;
+
+			auto &tally = iter->second;
+			if (finished)
+				tally.report.offsets.at(member.position) = *finished - *job.deadline;
+
+			if (--tally.remaining != 0)
+				return;
+
+			report = std::move(tally.report);
+			tallies.erase(iter);
+
+			std::optional<std::chrono::nanoseconds> earliest, latest;
+			for (const auto &offset: report.offsets)
+				if (offset) {
+					earliest = earliest? std::min(*earliest, *offset) : *offset;
+					latest = latest? std::max(*latest, *offset) : *offset;
+				}
+
+			if (earliest)
+				report.skew = *latest - *earliest;
+			// A member that missed the frame is out of sync however close the others were.
+			const bool complete = std::all_of(report.offsets.begin(), report.offsets.end(),
+				[](const auto &offset) { return offset.has_value(); });
+			report.withinTarget = complete && report.skew <= targetSkew;
+			lastReport = report;
+			fn = reportFn;
+		}
+
+		if (fn)
+			fn(report);
+	}
+}
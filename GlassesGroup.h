@@ -0,0 +1,133 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "CVPair.h"
+#include "Glasses.h"
+#include "Metrics.h"
+
+namespace Chemion {
+	class Image;
+
+	struct MemberStats {
+		size_t sent = 0;
+		size_t superseded = 0;
+		size_t failed = 0;
+		// Smoothed time between starting to write a frame and the last of it leaving the transport.
+		std::chrono::nanoseconds latency {0};
+	};
+
+	// Times are taken on this side, when Glasses::waitForDrain() returns for the member, i.e. once the last chunk has
+	// left the transport. When the glasses actually show the frame isn't observable, so this is transmit skew, not
+	// arrival skew; links with different air latency can differ on the display by more.
+	struct PresentReport {
+		uint64_t frame = 0;
+		std::chrono::steady_clock::time_point deadline;
+		// Spread between the earliest and latest member to finish sending the frame.
+		std::chrono::nanoseconds skew {0};
+		// Only if every member sent the frame, and within the target skew.
+		bool withinTarget = false;
+		// Per member, how long after the deadline the frame finished sending; empty if the member missed it.
+		std::vector<std::optional<std::chrono::nanoseconds>> offsets;
+	};
+
+	// Drives many glasses at once. Frames are encoded once and handed to a sender thread per member; each member keeps
+	// only the newest frame it hasn't sent yet, so a slow link drops its own stale frames instead of holding up the rest.
+	class GlassesGroup {
+		public:
+			using Clock = std::chrono::steady_clock;
+			using Frame = std::shared_ptr<const std::vector<uint8_t>>;
+			// Makes the transport for a member. Without one, members use the Glasses default, BlueZ.
+			using TransportFactory = std::function<std::shared_ptr<Transport>(const std::string &address)>;
+
+			GlassesGroup(uint16_t index = 0, TransportFactory = {});
+			~GlassesGroup();
+
+			// Connects to all addresses concurrently and returns how many of them connected.
+			size_t connect(const std::vector<std::string> &addresses);
+			// Scans until count glasses at or above min_rssi have been seen (or the timeout passes), then stops the
+			// scan and connects to the strongest of them concurrently.
+			size_t connect(Scanner &, size_t count, int8_t min_rssi = -80,
+			               std::chrono::milliseconds timeout = std::chrono::milliseconds(10'000));
+
+			size_t size();
+			Glasses & operator[](size_t i);
+			const std::string & addressOf(size_t i);
+			MemberStats getStats(size_t i);
+
+			void sendFrame(Frame);
+			void sendFrame(std::vector<uint8_t> encoded);
+			void showString(std::string_view);
+			void display(const Image &);
+
+			// Schedules a frame so that every member finishes receiving it at the deadline. Each member starts writing
+			// early by its own measured latency. Returns the frame's ID, which the matching PresentReport carries.
+			uint64_t present(Frame, Clock::time_point deadline);
+			uint64_t present(const Image &, Clock::time_point deadline);
+
+			void setTargetSkew(std::chrono::nanoseconds target) { targetSkew = target; }
+			void onReport(std::function<void(const PresentReport &)> fn) { reportFn = std::move(fn); }
+			std::optional<PresentReport> getLastReport();
+
+		private:
+			struct Job {
+				Frame frame;
+				std::optional<Clock::time_point> deadline;
+				uint64_t id = 0;
+				// The Trace frame it was encoded under, carried over to the sender threads.
+				uint64_t trace = 0;
+			};
+
+			struct Member {
+				std::unique_ptr<Glasses> glasses = std::make_unique<Glasses>();
+				std::string address;
+				std::string addressType;
+				size_t position = 0;
+				std::thread sender;
+				CVPair cv;
+				std::optional<Job> pending;
+				bool stopping = false;
+				MemberStats stats;
+				std::shared_ptr<Metrics::Counter> superseded = std::make_shared<Metrics::Counter>();
+
+				Member(std::string address_, std::string type = "random"):
+					address(std::move(address_)), addressType(std::move(type)) {
+					Metrics::add("chemion_frames_superseded_total", "Frames replaced by a newer one before being sent.",
+						superseded, {{"device", address}});
+				}
+			};
+
+			struct Tally {
+				PresentReport report;
+				size_t remaining = 0;
+			};
+
+			uint16_t index;
+			TransportFactory factory;
+
+			size_t connect(std::vector<std::unique_ptr<Member>> candidates);
+			// Guards the list itself, which connect() grows while frames are being queued; members don't move once added.
+			std::mutex membersMutex;
+			std::vector<std::unique_ptr<Member>> members;
+			std::chrono::nanoseconds targetSkew = std::chrono::milliseconds(20);
+			std::function<void(const PresentReport &)> reportFn;
+			std::mutex reportMutex;
+			uint64_t nextFrame = 1;
+			std::map<uint64_t, Tally> tallies;
+			std::optional<PresentReport> lastReport;
+
+			// Expects membersMutex to be held.
+			void enqueue(Job);
+			void send(Member &);
+			void deliver(Member &, const Job &, std::optional<Clock::time_point> finished);
+	};
+}
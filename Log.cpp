@@ -0,0 +1,245 @@
+#include <array>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+#include "Log.h"
+
+namespace {
+	// A bounded MPSC queue in the style of Vyukov's: a cell is free for position p when its sequence is p, and
+	// holds p's message once it's p + 1.
+	struct Cell {
+		std::atomic<uint64_t> sequence {0};
+		uint64_t time = 0;
+		Log::Level level = Log::Level::Debug;
+		char text[Log::MESSAGE_SIZE];
+	};
+
+	void notify(int fd) {
+		const uint64_t one = 1;
+		if (write(fd, &one, sizeof(one)) < 0)
+			return;
+	}
+
+	void consume(int fd) {
+		uint64_t value;
+		if (read(fd, &value, sizeof(value)) < 0)
+			return;
+	}
+
+	std::atomic<Log::Level> threshold {Log::Level::Trace};
+	std::atomic<Log::Site *> suppressing {nullptr};
+	// Set once the writer has been torn down at exit; later messages go straight to stdout.
+	std::atomic_bool shutDown {false};
+
+	class Writer {
+		private:
+			std::array<Cell, Log::CAPACITY> cells;
+			std::atomic<uint64_t> head {0};
+			std::atomic<uint64_t> written {0};
+			std::atomic<uint64_t> dropped {0};
+			std::atomic_bool sleeping {false};
+			std::atomic_bool stopping {false};
+			int wakeFD = -1;
+			std::thread thread;
+
+			// Only the writer thread touches these.
+			uint64_t tail = 0;
+			std::string lines;
+			time_t lastReport = 0;
+
+			bool ready() const {
+				return cells[tail % Log::CAPACITY].sequence.load(std::memory_order_acquire) == tail + 1;
+			}
+
+			void append(uint64_t time, Log::Level level, const char *text) {
+				static constexpr char LETTERS[] = "TDIWE";
+				const time_t seconds = time / 1'000'000'000;
+				tm local;
+				localtime_r(&seconds, &local);
+				char prefix[32];
+				snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03lu %c ", local.tm_hour, local.tm_min, local.tm_sec,
+					(time / 1'000'000) % 1000, LETTERS[static_cast<int>(level)]);
+				lines += prefix;
+				lines += text;
+				lines += '\n';
+			}
+
+			void drain() {
+				while (ready()) {
+					Cell &cell = cells[tail % Log::CAPACITY];
+					append(cell.time, cell.level, cell.text);
+					cell.sequence.store(tail + Log::CAPACITY, std::memory_order_release);
+					++tail;
+				}
+
+				timespec now;
+				clock_gettime(CLOCK_REALTIME, &now);
+				const uint64_t time = uint64_t(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+
+				if (const uint64_t count = dropped.exchange(0, std::memory_order_relaxed)) {
+					const std::string note = std::to_string(count) + " log messages dropped (buffer full)";
+					append(time, Log::Level::Warn, note.c_str());
+				}
+
+				if (now.tv_sec != lastReport || stopping.load(std::memory_order_relaxed)) {
+					lastReport = now.tv_sec;
+					for (Log::Site *site = suppressing.load(std::memory_order_acquire); site; site = site->next) {
+						if (const uint32_t count = site->suppressed.exchange(0, std::memory_order_relaxed)) {
+							char note[Log::MESSAGE_SIZE];
+							snprintf(note, sizeof(note), "%u more messages from %s:%d suppressed", count, site->file, site->line);
+							append(time, Log::Level::Warn, note);
+						}
+					}
+				}
+
+				if (!lines.empty()) {
+					fwrite(lines.data(), 1, lines.size(), stdout);
+					fflush(stdout);
+					lines.clear();
+				}
+
+				written.store(tail, std::memory_order_release);
+			}
+
+			void run() {
+				while (true) {
+					drain();
+					if (stopping.load(std::memory_order_acquire) && !ready())
+						return;
+
+					// Announce the sleep before the last look, so a producer either sees it or we see its message.
+					sleeping.store(true, std::memory_order_seq_cst);
+					if (ready() || stopping.load()) {
+						sleeping.store(false, std::memory_order_relaxed);
+						continue;
+					}
+
+					pollfd fd {wakeFD, POLLIN, 0};
+					if (0 < poll(&fd, 1, 100))
+						consume(wakeFD);
+					sleeping.store(false, std::memory_order_relaxed);
+				}
+			}
+
+			void wake() {
+				if (sleeping.load(std::memory_order_seq_cst) && sleeping.exchange(false))
+					notify(wakeFD);
+			}
+
+		public:
+			Writer() {
+				for (size_t i = 0; i < cells.size(); ++i)
+					cells[i].sequence.store(i, std::memory_order_relaxed);
+				wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				thread = std::thread(&Writer::run, this);
+			}
+
+			~Writer() {
+				// Anything logged from here on, e.g. by other static destructors, bypasses the ring.
+				shutDown = true;
+				stopping = true;
+				notify(wakeFD);
+				thread.join();
+				close(wakeFD);
+			}
+
+			void push(Log::Level level, uint64_t time, const char *format, va_list args) {
+				uint64_t position = head.load(std::memory_order_relaxed);
+				Cell *cell;
+
+				while (true) {
+					cell = &cells[position % Log::CAPACITY];
+					const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+					const auto difference = static_cast<int64_t>(sequence - position);
+					if (difference == 0) {
+						if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							break;
+					} else if (difference < 0) {
+						dropped.fetch_add(1, std::memory_order_relaxed);
+						return;
+					} else
+						position = head.load(std::memory_order_relaxed);
+				}
+
+				cell->time = time;
+				cell->level = level;
+				vsnprintf(cell->text, sizeof(cell->text), format, args);
+				cell->sequence.store(position + 1, std::memory_order_seq_cst);
+				wake();
+			}
+
+			void flush() {
+				const uint64_t target = head.load(std::memory_order_acquire);
+				notify(wakeFD);
+				while (written.load(std::memory_order_acquire) < target)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+	};
+
+	Writer & writer() {
+		static Writer instance;
+		return instance;
+	}
+
+	uint64_t realtime() {
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		return uint64_t(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+	}
+
+	void emit(Log::Level level, const char *format, va_list args) {
+		if (shutDown.load(std::memory_order_acquire)) {
+			vfprintf(stdout, format, args);
+			fputc('\n', stdout);
+		} else
+			writer().push(level, realtime(), format, args);
+	}
+
+}
+
+void Log::setLevel(Level level) {
+	threshold.store(level, std::memory_order_relaxed);
+}
+
+Log::Level Log::getLevel() {
+	return threshold.load(std::memory_order_relaxed);
+}
+
+void Log::write(Site &site, Level level, const char *format, ...) {
+	if (level < threshold.load(std::memory_order_relaxed))
+		return;
+
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	const uint64_t second = now.tv_sec;
+
+	uint64_t previous = site.second.load(std::memory_order_relaxed);
+	if (previous != second && site.second.compare_exchange_strong(previous, second, std::memory_order_relaxed))
+		site.count.store(0, std::memory_order_relaxed);
+
+	if (BURST <= site.count.fetch_add(1, std::memory_order_relaxed)) {
+		site.suppressed.fetch_add(1, std::memory_order_relaxed);
+		if (!site.listed.exchange(true, std::memory_order_relaxed)) {
+			site.next = suppressing.load(std::memory_order_relaxed);
+			while (!suppressing.compare_exchange_weak(site.next, &site, std::memory_order_release,
+				std::memory_order_relaxed));
+		}
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	emit(level, format, args);
+	va_end(args);
+}
+
+void Log::flush() {
+	if (!shutDown.load(std::memory_order_acquire))
+		writer().flush();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Levels below LOG_LEVEL compile to nothing, arguments included. Build with -DLOG_LEVEL=LOG_LEVEL_TRACE for
+// everything or LOG_LEVEL_WARN for a quiet build.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_NONE  5
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Logging that never blocks the caller. Messages are formatted into a fixed ring that any thread can claim a slot
+// in without locking, and a background thread writes them to stdout. If the ring is full the message is dropped and
+// counted. Each call site may log BURST messages per second; the background thread reports how many more there were
+// once a second.
+class Log {
+	public:
+		enum class Level: uint8_t {Trace, Debug, Info, Warn, Error};
+
+		static constexpr size_t CAPACITY = 4096;
+		static constexpr size_t MESSAGE_SIZE = 240;
+		static constexpr uint32_t BURST = 20;
+
+		struct Site {
+			const char *file;
+			int line;
+			std::atomic<uint64_t> second {0};
+			std::atomic<uint32_t> count {0};
+			std::atomic<uint32_t> suppressed {0};
+			// Sites join a list for the background thread the first time they suppress anything, and stay on it.
+			std::atomic_bool listed {false};
+			Site *next = nullptr;
+
+			constexpr Site(const char *file_, int line_): file(file_), line(line_) {}
+		};
+
+		// Filters further at runtime, on top of LOG_LEVEL.
+		static void setLevel(Level);
+		static Level getLevel();
+
+		static void write(Site &, Level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+		// Waits until everything logged so far has been written. Blocks, so keep it off the loop thread.
+		static void flush();
+};
+
+#define LOG_AT(level, ...) do { \
+	static Log::Site log_site_ {__FILE__, __LINE__}; \
+	Log::write(log_site_, level, __VA_ARGS__); \
+} while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(Log::Level::Trace, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(Log::Level::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(Log::Level::Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(Log::Level::Warn, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(Log::Level::Error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Debug.h"
+#include "Metrics.h"
+
+namespace {
+	struct Entry {
+		std::weak_ptr<Metrics::Series> series;
+		Metrics::Labels labels;
+	};
+
+	struct Family {
+		std::string help;
+		Metrics::Type type;
+		std::vector<Entry> entries;
+	};
+
+	struct Live {
+		std::shared_ptr<Metrics::Series> series;
+		Metrics::Labels labels;
+	};
+
+	std::mutex registryMutex;
+	std::map<std::string, Family> families;
+
+	const char * typeName(Metrics::Type type) {
+		switch (type) {
+			case Metrics::Type::Counter: return "counter";
+			case Metrics::Type::Gauge: return "gauge";
+			case Metrics::Type::Histogram: return "histogram";
+		}
+		return "untyped";
+	}
+
+	// Strong references keep each series alive while an export reads it, even if its owner lets go meanwhile.
+	std::vector<std::pair<std::string, std::pair<const Family *, std::vector<Live>>>> snapshot(std::unique_lock<std::mutex> &) {
+		std::vector<std::pair<std::string, std::pair<const Family *, std::vector<Live>>>> out;
+		for (auto &[name, family]: families) {
+			std::vector<Live> live;
+			for (const Entry &entry: family.entries)
+				if (auto series = entry.series.lock())
+					live.push_back({std::move(series), entry.labels});
+			if (!live.empty())
+				out.push_back({name, {&family, std::move(live)}});
+		}
+		return out;
+	}
+
+	std::string escapeLabel(const std::string &value) {
+		std::string out;
+		for (const char character: value) {
+			if (character == '\\' || character == '"')
+				out += '\\';
+			if (character == '\n') {
+				out += "\\n";
+				continue;
+			}
+			out += character;
+		}
+		return out;
+	}
+
+	std::string escapeJSON(const std::string &value) {
+		std::string out;
+		for (const char character: value) {
+			if (character == '\\' || character == '"') {
+				out += '\\';
+				out += character;
+			} else if (static_cast<unsigned char>(character) < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+				out += escaped;
+			} else
+				out += character;
+		}
+		return out;
+	}
+
+	std::string number(double value) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.9g", value);
+		return buffer;
+	}
+
+	// Formats {a="x",b="y"}, with an extra label appended if given (for a histogram's le).
+	std::string promLabels(const Metrics::Labels &labels, const char *extra_name = nullptr, const std::string &extra_value = {}) {
+		if (labels.empty() && !extra_name)
+			return {};
+
+		std::string out = "{";
+		for (const auto &[name, value]: labels) {
+			if (out.size() != 1)
+				out += ',';
+			out += name + "=\"" + escapeLabel(value) + '"';
+		}
+		if (extra_name) {
+			if (out.size() != 1)
+				out += ',';
+			out += std::string(extra_name) + "=\"" + extra_value + '"';
+		}
+		return out + '}';
+	}
+}
+
+const std::vector<double> Metrics::Histogram::LATENCY_BOUNDS {
+	50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 500e-3, 1., 2.5
+};
+
+Metrics::Histogram::Histogram(std::vector<double> bounds_):
+	bounds(std::move(bounds_)), buckets(std::make_unique<std::atomic<uint64_t>[]>(bounds.size() + 1)) {
+	std::sort(bounds.begin(), bounds.end());
+}
+
+void Metrics::Histogram::observe(double value) {
+	const size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Metrics::add(const std::string &name, const std::string &help, const std::shared_ptr<Series> &series, Labels labels) {
+	std::unique_lock lock(registryMutex);
+	auto [iter, inserted] = families.try_emplace(name, Family {help, series->type(), {}});
+	Family &family = iter->second;
+
+	if (!inserted && family.type != series->type()) {
+		DBG("Metric %s is a %s, not a %s.", name.c_str(), typeName(family.type), typeName(series->type()));
+		return;
+	}
+
+	std::erase_if(family.entries, [](const Entry &entry) { return entry.series.expired(); });
+
+	for (Entry &entry: family.entries) {
+		if (entry.series.lock() == series) {
+			entry.labels = std::move(labels);
+			return;
+		}
+	}
+
+	family.entries.push_back({series, std::move(labels)});
+}
+
+std::string Metrics::prometheus() {
+	std::unique_lock lock(registryMutex);
+	const auto listed = snapshot(lock);
+	std::ostringstream out;
+
+	for (const auto &[name, pair]: listed) {
+		const auto &[family, live] = pair;
+		out << "# HELP " << name << ' ' << family->help << '\n';
+		out << "# TYPE " << name << ' ' << typeName(family->type) << '\n';
+
+		for (const auto &[series, labels]: live) {
+			switch (series->type()) {
+				case Type::Counter:
+					out << name << promLabels(labels) << ' ' << static_cast<const Counter &>(*series).get() << '\n';
+					break;
+				case Type::Gauge:
+					out << name << promLabels(labels) << ' ' << static_cast<const Gauge &>(*series).get() << '\n';
+					break;
+				case Type::Histogram: {
+					const auto &histogram = static_cast<const Histogram &>(*series);
+					const auto &bounds = histogram.getBounds();
+					// The count is the buckets' total rather than a separate counter, so the two always agree.
+					uint64_t cumulative = 0;
+					for (size_t i = 0; i < bounds.size(); ++i) {
+						cumulative += histogram.getBucket(i);
+						out << name << "_bucket" << promLabels(labels, "le", number(bounds[i])) << ' ' << cumulative << '\n';
+					}
+					cumulative += histogram.getBucket(bounds.size());
+					out << name << "_bucket" << promLabels(labels, "le", "+Inf") << ' ' << cumulative << '\n';
+					out << name << "_sum" << promLabels(labels) << ' ' << number(histogram.getSum()) << '\n';
+					out << name << "_count" << promLabels(labels) << ' ' << cumulative << '\n';
+					break;
+				}
+			}
+		}
+	}
+
+	return out.str();
+}
+
+std::string Metrics::json() {
+	std::unique_lock lock(registryMutex);
+	const auto listed = snapshot(lock);
+	std::ostringstream out;
+
+	out << '{';
+	for (size_t f = 0; f < listed.size(); ++f) {
+		const auto &[name, pair] = listed[f];
+		const auto &[family, live] = pair;
+		if (f != 0)
+			out << ',';
+		out << '"' << name << "\":{\"type\":\"" << typeName(family->type) << "\",\"help\":\"" << escapeJSON(family->help)
+			<< "\",\"series\":[";
+
+		for (size_t s = 0; s < live.size(); ++s) {
+			const auto &[series, labels] = live[s];
+			if (s != 0)
+				out << ',';
+			out << "{\"labels\":{";
+			for (size_t l = 0; l < labels.size(); ++l)
+				out << (l == 0? "" : ",") << '"' << escapeJSON(labels[l].first) << "\":\"" << escapeJSON(labels[l].second) << '"';
+			out << '}';
+
+			switch (series->type()) {
+				case Type::Counter:
+					out << ",\"value\":" << static_cast<const Counter &>(*series).get();
+					break;
+				case Type::Gauge:
+					out << ",\"value\":" << static_cast<const Gauge &>(*series).get();
+					break;
+				case Type::Histogram: {
+					const auto &histogram = static_cast<const Histogram &>(*series);
+					const auto &bounds = histogram.getBounds();
+					uint64_t cumulative = 0;
+					out << ",\"buckets\":[";
+					for (size_t i = 0; i < bounds.size(); ++i) {
+						cumulative += histogram.getBucket(i);
+						out << "{\"le\":" << number(bounds[i]) << ",\"count\":" << cumulative << "},";
+					}
+					cumulative += histogram.getBucket(bounds.size());
+					out << "{\"le\":\"+Inf\",\"count\":" << cumulative << "}],\"sum\":" << number(histogram.getSum())
+						<< ",\"count\":" << cumulative;
+					break;
+				}
+			}
+			out << '}';
+		}
+		out << "]}";
+	}
+	out << "}\n";
+
+	return out.str();
+}
+
+bool Metrics::Server::start() {
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+	if (sizeof(address.sun_path) <= path.size()) {
+		DBG("Metrics socket path too long: %s", path.c_str());
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+
+	listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFD < 0) {
+		DBG("Couldn't create metrics socket: %s", strerror(errno));
+		return false;
+	}
+
+	unlink(path.c_str());
+	if (bind(listenFD, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFD, 16) < 0) {
+		DBG("Couldn't listen on %s: %s", path.c_str(), strerror(errno));
+		close(listenFD);
+		listenFD = -1;
+		return false;
+	}
+
+	stopFD = eventfd(0, EFD_CLOEXEC);
+	if (stopFD < 0) {
+		DBG("Couldn't create metrics eventfd: %s", strerror(errno));
+		close(listenFD);
+		listenFD = -1;
+		unlink(path.c_str());
+		return false;
+	}
+
+	thread = std::thread(&Server::run, this);
+	return true;
+}
+
+void Metrics::Server::stop() {
+	if (!thread.joinable())
+		return;
+
+	const uint64_t one = 1;
+	if (write(stopFD, &one, sizeof(one)) != sizeof(one))
+		DBG("Couldn't signal the metrics server to stop: %s", strerror(errno));
+	thread.join();
+
+	close(listenFD);
+	close(stopFD);
+	listenFD = stopFD = -1;
+	unlink(path.c_str());
+}
+
+void Metrics::Server::run() {
+	pollfd fds[2] {{listenFD, POLLIN, 0}, {stopFD, POLLIN, 0}};
+
+	while (true) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			DBG("Metrics server poll failed: %s", strerror(errno));
+			return;
+		}
+
+		if (fds[1].revents != 0)
+			return;
+
+		if (fds[0].revents & POLLIN) {
+			const int fd = accept4(listenFD, nullptr, nullptr, SOCK_CLOEXEC);
+			if (0 <= fd) {
+				answer(fd);
+				close(fd);
+			}
+		}
+	}
+}
+
+void Metrics::Server::answer(int fd) {
+	// Clients that send nothing get the default after a short wait.
+	const timeval timeout {0, 200'000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	std::string request;
+	char buffer[256];
+	while (request.size() < 1024 && request.find('\n') == std::string::npos) {
+		const ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+		if (count <= 0)
+			break;
+		request.append(buffer, count);
+	}
+
+	const std::string first_line = request.substr(0, request.find('\n'));
+	const bool as_json = first_line.find("json") != std::string::npos;
+	const std::string body = as_json? json() : prometheus();
+
+	std::string response;
+	if (first_line.starts_with("GET ")) {
+		response = "HTTP/1.0 200 OK\r\nContent-Type: ";
+		response += as_json? "application/json" : "text/plain; version=0.0.4";
+		response += "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+	}
+	response += body;
+
+	for (size_t sent = 0; sent < response.size();) {
+		const ssize_t count = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (count <= 0)
+			return;
+		sent += count;
+	}
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A registry of counters, gauges and histograms for a running process. Updating a series is a relaxed atomic
+// operation; the registry's lock is only taken to list or unlist a series and to read them all for an export.
+class Metrics {
+	public:
+		using Labels = std::vector<std::pair<std::string, std::string>>;
+
+		enum class Type {Counter, Gauge, Histogram};
+
+		class Series {
+			public:
+				virtual ~Series() = default;
+				virtual Type type() const = 0;
+		};
+
+		class Counter: public Series {
+			private:
+				std::atomic<uint64_t> value {0};
+
+			public:
+				void add(uint64_t amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+				uint64_t get() const { return value.load(std::memory_order_relaxed); }
+				Type type() const override { return Type::Counter; }
+		};
+
+		class Gauge: public Series {
+			private:
+				std::atomic<int64_t> value {0};
+
+			public:
+				void set(int64_t new_value) { value.store(new_value, std::memory_order_relaxed); }
+				void add(int64_t amount) { value.fetch_add(amount, std::memory_order_relaxed); }
+				int64_t get() const { return value.load(std::memory_order_relaxed); }
+				Type type() const override { return Type::Gauge; }
+		};
+
+		class Histogram: public Series {
+			private:
+				std::vector<double> bounds;
+				// One more than bounds, for +Inf. Not cumulative; exports add them up.
+				std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+				std::atomic<double> sum {0.};
+
+			public:
+				// Upper bounds in seconds, from 50 us to 2.5 s.
+				static const std::vector<double> LATENCY_BOUNDS;
+
+				explicit Histogram(std::vector<double> bounds_ = LATENCY_BOUNDS);
+
+				void observe(double value);
+				void observe(std::chrono::nanoseconds duration) { observe(std::chrono::duration<double>(duration).count()); }
+				const std::vector<double> & getBounds() const { return bounds; }
+				uint64_t getBucket(size_t i) const { return buckets[i].load(std::memory_order_relaxed); }
+				double getSum() const { return sum.load(std::memory_order_relaxed); }
+				Type type() const override { return Type::Histogram; }
+		};
+
+		// Lists a series under a name until the series is destroyed. Adding the same series again replaces its labels.
+		// All series under one name must have the same type.
+		static void add(const std::string &name, const std::string &help, const std::shared_ptr<Series> &, Labels = {});
+
+		template <typename T>
+		static std::shared_ptr<T> make(const std::string &name, const std::string &help, Labels labels = {}) {
+			auto series = std::make_shared<T>();
+			add(name, help, series, std::move(labels));
+			return series;
+		}
+
+		// Prometheus text exposition format, version 0.0.4.
+		static std::string prometheus();
+		static std::string json();
+
+		// Answers each connection on a Unix socket with one export and closes it. A client that sends a line containing
+		// "json" first gets JSON; anything else, including a plain HTTP GET (curl --unix-socket), gets Prometheus text.
+		class Server {
+			private:
+				std::string path;
+				int listenFD = -1;
+				int stopFD = -1;
+				std::thread thread;
+
+				void run();
+				void answer(int fd);
+
+			public:
+				explicit Server(std::string path_): path(std::move(path_)) {}
+				~Server() { stop(); }
+
+				Server(const Server &) = delete;
+				Server & operator=(const Server &) = delete;
+
+				// Replaces whatever is at the path. Returns false if the socket couldn't be set up.
+				bool start();
+				void stop();
+		};
+};
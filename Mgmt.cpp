@@ -1,10 +1,29 @@
 #include <cassert>
+#include <cstring>
+#include <vector>
 
 #include "Debug.h"
+#include "EventLoop.h"
 #include "Mgmt.h"
 
 static void mgmt_device_connected(uint16_t index, uint16_t length, const void *param, void *user_data) {
-	DBG("New device connected");
+	const mgmt_ev_device_connected *ev = (mgmt_ev_device_connected *) param;
+	auto &mgmt = *reinterpret_cast<Mgmt *>(user_data);
+
+	if (length < sizeof(*ev)) {
+		DBG("Malformed device connected event");
+		return;
+	}
+
+	if (mgmt.onDeviceConnected)
+		mgmt.onDeviceConnected(ev->addr);
+	else
+		DBG("New device connected");
+}
+
+static void device_list_cb(uint8_t status, uint16_t length, const void *param, void *user_data) {
+	if (status != MGMT_STATUS_SUCCESS)
+		DBG("%s device failed: %s (%d)", reinterpret_cast<const char *>(user_data), mgmt_errstr(status), status);
 }
 
 static void read_version_complete(uint8_t status, uint16_t length, const void *param, void *user_data) {
@@ -31,9 +50,20 @@ static void mgmt_scanning(uint16_t index, uint16_t length, const void *param, vo
 
 static void mgmt_device_found(uint16_t index, uint16_t length, const void *param, void *user_data) {
 	const mgmt_ev_device_found *ev = (mgmt_ev_device_found *) param;
-	const uint8_t *val = ev->addr.bdaddr.b;
-	assert(length == sizeof(*ev) + ev->eir_len);
-	DBG("Device found: %02X:%02X:%02X:%02X:%02X:%02X type=%X flags=%X", val[5], val[4], val[3], val[2], val[1], val[0], ev->addr.type, ev->flags);
+	[[maybe_unused]] const uint8_t *val = ev->addr.bdaddr.b;
+	auto &mgmt = *reinterpret_cast<Mgmt *>(user_data);
+
+	if (length < sizeof(*ev) || length != sizeof(*ev) + btohs(ev->eir_len)) {
+		DBG("Malformed device found event");
+		return;
+	}
+
+	if (mgmt.onDeviceFound) {
+		mgmt.onDeviceFound(*ev, std::span<const uint8_t>(ev->eir, btohs(ev->eir_len)));
+		return;
+	}
+
+	LOG_TRACE("Device found: %02X:%02X:%02X:%02X:%02X:%02X type=%X flags=%X", val[5], val[4], val[3], val[2], val[1], val[0], ev->addr.type, ev->flags);
 }
 
 static void scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data) {
@@ -41,15 +71,45 @@ static void scan_cb(uint8_t status, uint16_t length, const void *param, void *us
 		DBG("Scan error: %s (%d)", mgmt_errstr(status), status);
 }
 
+static void service_scan_cb(uint8_t status, uint16_t length, const void *param, void *user_data) {
+	auto &mgmt = *reinterpret_cast<Mgmt *>(user_data);
+
+	if (status == MGMT_STATUS_UNKNOWN_COMMAND || status == MGMT_STATUS_NOT_SUPPORTED) {
+		// Kernels before 4.1 only have plain discovery, so the caller has to filter reports itself.
+		DBG("Service discovery unsupported; falling back to unfiltered discovery");
+		mgmt.kernelFiltering = false;
+		mgmt.startScan();
+	} else if (status != MGMT_STATUS_SUCCESS)
+		DBG("Service scan error: %s (%d)", mgmt_errstr(status), status);
+}
+
 Mgmt::Mgmt(): cobj(mgmt_new_default()) {}
 
+Mgmt::~Mgmt() {
+	if (cobj == nullptr)
+		return;
+
+	EventLoop::Guard guard;
+	mgmt_unregister_all(cobj);
+	mgmt_cancel_all(cobj);
+	mgmt_unref(cobj);
+}
+
 void Mgmt::setup(uint16_t new_index) {
 	if (cobj == nullptr) {
-		DBG("Could not connect to the BT management interface, try with su rights");
+		LOG_ERROR("Could not connect to the BT management interface, try with su rights");
 		return;
 	}
 
 	DBG("Setting up mgmt on hci %u", new_index);
+
+	EventLoop::Guard guard;
+
+	// Drop the events registered for the previous controller, or for this one if it's being set up again (a migration
+	// back to the same adapter), which would otherwise run every handler twice.
+	if (index != MGMT_INDEX_NONE)
+		mgmt_unregister_index(cobj, index);
+
 	index = new_index;
 
 	mgmt_set_debug(cobj, +[](const char *str, void *user_data) {
@@ -76,6 +136,7 @@ bool Mgmt::scan(bool starting) {
 	if (cobj == nullptr)
 		return false;
 
+	EventLoop::Guard guard;
 	if (mgmt_send(cobj, opcode, index, sizeof(cp), &cp, scan_cb, nullptr, nullptr) == 0) {
 		DBG("mgmt_send(MGMT_OP_%s_DISCOVERY) failed", starting? "START" : "STOP");
 		return false;
@@ -88,6 +149,160 @@ bool Mgmt::startScan() {
 	return scan(true);
 }
 
+bool Mgmt::startServiceScan(std::span<const UUID128> uuids, int8_t rssi) {
+	if (cobj == nullptr)
+		return false;
+
+	std::vector<uint8_t> buffer(sizeof(mgmt_cp_start_service_discovery) + uuids.size() * sizeof(UUID128));
+	auto *cp = reinterpret_cast<mgmt_cp_start_service_discovery *>(buffer.data());
+	cp->type = (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM);
+	cp->rssi = rssi;
+	cp->uuid_count = htobs(uuids.size());
+	for (size_t i = 0; i < uuids.size(); ++i)
+		memcpy(cp->uuids[i], uuids[i].data(), sizeof(UUID128));
+
+	kernelFiltering = true;
+
+	EventLoop::Guard guard;
+	if (mgmt_send(cobj, MGMT_OP_START_SERVICE_DISCOVERY, index, buffer.size(), buffer.data(), service_scan_cb, this, nullptr) == 0) {
+		DBG("mgmt_send(MGMT_OP_START_SERVICE_DISCOVERY) failed");
+		return false;
+	}
+
+	return true;
+}
+
 bool Mgmt::stopScan() {
 	return scan(false);
 }
+
+bool Mgmt::readIndexList(std::function<void(std::span<const uint16_t>)> callback) {
+	using Callback = std::function<void(std::span<const uint16_t>)>;
+
+	if (cobj == nullptr)
+		return false;
+
+	EventLoop::Guard guard;
+	if (mgmt_send(cobj, MGMT_OP_READ_INDEX_LIST, MGMT_INDEX_NONE, 0, nullptr, +[](uint8_t status, uint16_t length, const void *param, void *user_data) {
+		const mgmt_rp_read_index_list *rp = (mgmt_rp_read_index_list *) param;
+		auto &callback = *reinterpret_cast<Callback *>(user_data);
+
+		if (status != MGMT_STATUS_SUCCESS) {
+			DBG("Failed to read index list: %s (0x%02x)", mgmt_errstr(status), status);
+			callback({});
+			return;
+		}
+
+		const size_t count = length < sizeof(*rp)? 0 : btohs(rp->num_controllers);
+		if (length < sizeof(*rp) + count * sizeof(uint16_t)) {
+			DBG("Wrong size of index list response");
+			callback({});
+			return;
+		}
+
+		std::vector<uint16_t> indices(count);
+		for (size_t i = 0; i < count; ++i)
+			indices[i] = btohs(rp->index[i]);
+		callback(indices);
+	}, new Callback(std::move(callback)), +[](void *user_data) {
+		delete reinterpret_cast<Callback *>(user_data);
+	}) == 0) {
+		DBG("mgmt_send(MGMT_OP_READ_INDEX_LIST) failed");
+		return false;
+	}
+
+	return true;
+}
+
+bool Mgmt::watchIndices() {
+	auto added = +[](uint16_t index, uint16_t length, const void *param, void *user_data) {
+		auto &mgmt = *reinterpret_cast<Mgmt *>(user_data);
+		if (mgmt.onIndexChanged)
+			mgmt.onIndexChanged(index, true);
+	};
+
+	auto removed = +[](uint16_t index, uint16_t length, const void *param, void *user_data) {
+		auto &mgmt = *reinterpret_cast<Mgmt *>(user_data);
+		if (mgmt.onIndexChanged)
+			mgmt.onIndexChanged(index, false);
+	};
+
+	if (cobj == nullptr)
+		return false;
+
+	EventLoop::Guard guard;
+	return mgmt_register(cobj, MGMT_EV_INDEX_ADDED, MGMT_INDEX_NONE, added, this, nullptr) != 0 &&
+		mgmt_register(cobj, MGMT_EV_INDEX_REMOVED, MGMT_INDEX_NONE, removed, this, nullptr) != 0;
+}
+
+bool Mgmt::addDevice(const bdaddr_t &address, uint8_t type, Action action, std::function<void(bool)> callback) {
+	using Callback = std::function<void(bool)>;
+
+	mgmt_cp_add_device cp {};
+	bacpy(&cp.addr.bdaddr, &address);
+	cp.addr.type = type;
+	cp.action = static_cast<uint8_t>(action);
+
+	if (cobj == nullptr)
+		return false;
+
+	EventLoop::Guard guard;
+	if (mgmt_send(cobj, MGMT_OP_ADD_DEVICE, index, sizeof(cp), &cp, +[](uint8_t status, uint16_t length, const void *param, void *user_data) {
+		device_list_cb(status, length, param, (void *) "Adding");
+		if (auto &callback = *reinterpret_cast<Callback *>(user_data))
+			callback(status == MGMT_STATUS_SUCCESS);
+	}, new Callback(std::move(callback)), +[](void *user_data) {
+		delete reinterpret_cast<Callback *>(user_data);
+	}) == 0) {
+		DBG("mgmt_send(MGMT_OP_ADD_DEVICE) failed");
+		return false;
+	}
+
+	return true;
+}
+
+bool Mgmt::removeDevice(const bdaddr_t &address, uint8_t type) {
+	mgmt_cp_remove_device cp {};
+	bacpy(&cp.addr.bdaddr, &address);
+	cp.addr.type = type;
+
+	if (cobj == nullptr)
+		return false;
+
+	EventLoop::Guard guard;
+	if (mgmt_send(cobj, MGMT_OP_REMOVE_DEVICE, index, sizeof(cp), &cp, device_list_cb, (void *) "Removing", nullptr) == 0) {
+		DBG("mgmt_send(MGMT_OP_REMOVE_DEVICE) failed");
+		return false;
+	}
+
+	return true;
+}
+
+bool Mgmt::parseUUID(std::string_view string, UUID128 &uuid) {
+	size_t nibbles = 0;
+
+	for (const char ch: string) {
+		if (ch == '-')
+			continue;
+
+		uint8_t value;
+		if ('0' <= ch && ch <= '9')
+			value = ch - '0';
+		else if ('a' <= ch && ch <= 'f')
+			value = ch - 'a' + 10;
+		else if ('A' <= ch && ch <= 'F')
+			value = ch - 'A' + 10;
+		else
+			return false;
+
+		if (nibbles == 32)
+			return false;
+
+		// The string is big-endian, so the first nibble lands in the last byte.
+		uint8_t &byte = uuid[15 - nibbles / 2];
+		byte = nibbles % 2 == 0? value << 4 : byte | value;
+		++nibbles;
+	}
+
+	return nibbles == 32;
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <functional>
+#include <span>
+#include <string_view>
 
 extern "C" {
 #include "lib/bluetooth.h"
@@ -17,11 +21,41 @@ class Mgmt {
 	public:
 		enum class State {Disconnected, Connecting, Connected, Scanning};
 
+		// 128-bit UUID in the little-endian order used by mgmt and EIR data.
+		using UUID128 = std::array<uint8_t, 16>;
+
 		State state = State::Disconnected;
+		// False once the kernel has turned down service discovery and a service scan fell back to plain discovery.
+		bool kernelFiltering = true;
+		// Actions for addDevice.
+		enum class Action: uint8_t {Scan = 0, Allow = 1, AutoConnect = 2};
+
+		// Called on the loop thread when the controller reports a new connection, including ones it made by itself.
+		std::function<void(const mgmt_addr_info &)> onDeviceConnected;
+		// Called on the loop thread when a controller appears or goes away, once watchIndices() has been called.
+		std::function<void(uint16_t index, bool added)> onIndexChanged;
+		// Called on the loop thread for every advertising report. The EIR data points into mgmt's receive buffer.
+		std::function<void(const mgmt_ev_device_found &, std::span<const uint8_t> eir)> onDeviceFound;
 
 		Mgmt();
+		~Mgmt();
+
+		Mgmt(const Mgmt &) = delete;
+		Mgmt & operator=(const Mgmt &) = delete;
 
 		void setup(uint16_t new_index);
+		uint16_t getIndex() const { return index; }
+		// Asks for the indices of all controllers; the callback runs on the loop thread with the reply.
+		bool readIndexList(std::function<void(std::span<const uint16_t>)>);
+		bool watchIndices();
 		bool startScan();
+		// Discovery that the kernel filters down to devices advertising one of the UUIDs at or above the RSSI.
+		bool startServiceScan(std::span<const UUID128> uuids, int8_t rssi);
 		bool stopScan();
+		// Adds the device to the kernel's list, so with AutoConnect it connects whenever the device advertises. Returns
+		// once the request is queued; the callback, if any, runs on the loop thread with whether the kernel took it.
+		bool addDevice(const bdaddr_t &, uint8_t type, Action = Action::AutoConnect, std::function<void(bool)> = {});
+		bool removeDevice(const bdaddr_t &, uint8_t type);
+
+		static bool parseUUID(std::string_view, UUID128 &);
 };
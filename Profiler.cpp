@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "Profiler.h"
+
+extern "C" {
+#include "src/shared/profile.h"
+}
+
+namespace {
+	// Log-linear buckets: exact below 16 ticks, then 16 per power of two, so any bucket is within 1/16 of its values.
+	constexpr unsigned SUB_BITS = 4;
+	constexpr uint64_t SUB = 1 << SUB_BITS;
+	constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+	size_t bucketOf(uint64_t ticks) {
+		if (ticks < SUB)
+			return ticks;
+		const unsigned exponent = 63 - __builtin_clzll(ticks);
+		return (exponent - SUB_BITS + 1) * SUB + ((ticks >> (exponent - SUB_BITS)) & (SUB - 1));
+	}
+
+	uint64_t bucketLow(size_t bucket) {
+		if (bucket < SUB)
+			return bucket;
+		const unsigned exponent = bucket / SUB + SUB_BITS - 1;
+		return (SUB + bucket % SUB) << (exponent - SUB_BITS);
+	}
+
+	uint64_t bucketWidth(size_t bucket) {
+		return bucket < SUB? 1 : uint64_t(1) << (bucket / SUB - 1);
+	}
+
+	// Only the owning thread writes these, so a relaxed load and store stands in for an atomic add.
+	struct Histogram {
+		std::atomic<uint64_t> count {0};
+		std::atomic<uint64_t> total {0};
+		std::atomic<uint64_t> max {0};
+		std::array<std::atomic<uint64_t>, BUCKETS> buckets {};
+	};
+
+	// Never freed, so a thread's numbers outlive it and readers never race a delete.
+	struct ThreadData {
+		std::array<std::atomic<Histogram *>, Profiler::MAX_SCOPES> scopes {};
+		ThreadData *next = nullptr;
+	};
+
+	struct Merged {
+		uint64_t count = 0;
+		uint64_t total = 0;
+		uint64_t max = 0;
+		std::array<uint64_t, BUCKETS> buckets {};
+	};
+
+	std::array<std::atomic<const char *>, Profiler::MAX_SCOPES> names {};
+	// 0 is reserved for "no scope".
+	std::atomic<uint32_t> scopeCount {1};
+	std::atomic<ThreadData *> threads {nullptr};
+	thread_local ThreadData *local = nullptr;
+
+	// Only report() and clear() take this; recording never does.
+	std::mutex baselineMutex;
+	std::map<std::string, Merged> baseline;
+
+	void bump(std::atomic<uint64_t> &counter, uint64_t amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	ThreadData & localData() {
+		if (!local) {
+			local = new ThreadData;
+			local->next = threads.load(std::memory_order_relaxed);
+			while (!threads.compare_exchange_weak(local->next, local, std::memory_order_release,
+				std::memory_order_relaxed));
+		}
+		return *local;
+	}
+
+	bool detectTSC() {
+#if defined(__x86_64__) || defined(__i386__)
+		unsigned int eax, ebx, ecx, edx;
+		// Invariant TSC: constant rate across P-states and ticking through C-states.
+		if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+			return (edx & (1 << 8)) != 0;
+#endif
+		return false;
+	}
+}
+
+// Defined ahead of the clock origins below so they read the same clock as everything after.
+const bool Profiler::useTSC = detectTSC();
+
+namespace {
+	const auto originSteady = std::chrono::steady_clock::now();
+	const uint64_t originTicks = Profiler::now();
+
+	double nanosPerTick() {
+		auto elapsed = std::chrono::steady_clock::now() - originSteady;
+		if (elapsed < std::chrono::milliseconds(10)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10) - elapsed);
+			elapsed = std::chrono::steady_clock::now() - originSteady;
+		}
+
+		const uint64_t ticks = Profiler::now() - originTicks;
+		return ticks == 0? 1.0 : double(std::chrono::nanoseconds(elapsed).count()) / double(ticks);
+	}
+
+	std::map<std::string, Merged> collect() {
+		std::map<std::string, Merged> out;
+		const uint32_t count = std::min<uint32_t>(scopeCount.load(std::memory_order_acquire), Profiler::MAX_SCOPES);
+
+		for (ThreadData *data = threads.load(std::memory_order_acquire); data; data = data->next) {
+			for (uint32_t scope = 1; scope < count; ++scope) {
+				const Histogram *histogram = data->scopes[scope].load(std::memory_order_acquire);
+				const char *name = names[scope].load(std::memory_order_acquire);
+				if (!histogram || !name)
+					continue;
+
+				Merged &merged = out[name];
+				merged.count += histogram->count.load(std::memory_order_relaxed);
+				merged.total += histogram->total.load(std::memory_order_relaxed);
+				merged.max = std::max(merged.max, histogram->max.load(std::memory_order_relaxed));
+				for (size_t i = 0; i < BUCKETS; ++i)
+					merged.buckets[i] += histogram->buckets[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		return out;
+	}
+}
+
+uint32_t Profiler::registerScope(const char *name) {
+	const uint32_t id = scopeCount.fetch_add(1, std::memory_order_relaxed);
+	if (MAX_SCOPES <= id)
+		return 0;
+	names[id].store(name, std::memory_order_release);
+	return id;
+}
+
+void Profiler::record(uint32_t scope, uint64_t start, uint64_t end) {
+	if (scope == 0 || MAX_SCOPES <= scope)
+		return;
+
+	auto &slot = localData().scopes[scope];
+	Histogram *histogram = slot.load(std::memory_order_relaxed);
+	if (!histogram) {
+		histogram = new Histogram;
+		slot.store(histogram, std::memory_order_release);
+	}
+
+	const uint64_t ticks = start < end? end - start : 0;
+	bump(histogram->count, 1);
+	bump(histogram->total, ticks);
+	if (histogram->max.load(std::memory_order_relaxed) < ticks)
+		histogram->max.store(ticks, std::memory_order_relaxed);
+	bump(histogram->buckets[bucketOf(ticks)], 1);
+}
+
+std::vector<Profiler::ScopeStats> Profiler::report() {
+	std::map<std::string, Merged> current = collect();
+	const double scale = useTSC? nanosPerTick() : 1.0;
+	const auto nanos = [scale](double ticks) {
+		return std::chrono::nanoseconds(static_cast<int64_t>(ticks * scale));
+	};
+
+	std::vector<ScopeStats> out;
+	std::unique_lock lock(baselineMutex);
+
+	for (auto &[name, merged]: current) {
+		if (auto iter = baseline.find(name); iter != baseline.end()) {
+			const Merged &base = iter->second;
+			merged.count -= base.count;
+			merged.total -= base.total;
+			for (size_t i = 0; i < BUCKETS; ++i)
+				merged.buckets[i] -= base.buckets[i];
+		}
+
+		if (merged.count == 0)
+			continue;
+
+		// The raw max can predate clear(), so cap it at the top of the highest bucket seen since.
+		size_t highest = BUCKETS - 1;
+		while (0 < highest && merged.buckets[highest] == 0)
+			--highest;
+		const uint64_t max = std::min(merged.max, bucketLow(highest) + bucketWidth(highest) - 1);
+
+		const auto percentile = [&](double quantile) {
+			const auto rank = static_cast<uint64_t>(quantile * double(merged.count - 1)) + 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < BUCKETS; ++i) {
+				seen += merged.buckets[i];
+				if (rank <= seen)
+					return nanos(std::min<double>(bucketLow(i) + bucketWidth(i) / 2, max));
+			}
+			return nanos(max);
+		};
+
+		ScopeStats &stats = out.emplace_back();
+		stats.name = name;
+		stats.count = merged.count;
+		stats.total = nanos(merged.total);
+		stats.p50 = percentile(0.5);
+		stats.p99 = percentile(0.99);
+		stats.p999 = percentile(0.999);
+		stats.max = nanos(max);
+	}
+
+	std::sort(out.begin(), out.end(), [](const ScopeStats &left, const ScopeStats &right) {
+		return left.total > right.total;
+	});
+
+	return out;
+}
+
+void Profiler::summary(FILE *file, double threshold) {
+	const std::vector<ScopeStats> stats = report();
+	if (stats.empty())
+		return;
+
+	size_t max_length = 0;
+	for (const ScopeStats &scope: stats)
+		max_length = std::max(scope.name.size(), max_length);
+
+	const auto us = [](std::chrono::nanoseconds nanos) {
+		return static_cast<double>(nanos.count()) / 1e3;
+	};
+
+	fprintf(file, "Profiler summary:\n");
+	for (const ScopeStats &scope: stats) {
+		const double seconds = static_cast<double>(scope.total.count()) / 1e9;
+		if (seconds < threshold)
+			continue;
+		fprintf(file, "    \e[1m%-*s\e[22m \e[32m%10.6f\e[39m s over \e[1m%8lu\e[22m  p50 %9.2f us  p99 %9.2f us  "
+			"p999 %9.2f us  max %9.2f us\n", int(max_length), scope.name.c_str(), seconds, scope.count, us(scope.p50),
+			us(scope.p99), us(scope.p999), us(scope.max));
+	}
+}
+
+void Profiler::clear() {
+	std::map<std::string, Merged> current = collect();
+	std::unique_lock lock(baselineMutex);
+	baseline = std::move(current);
+}
+
+extern "C" {
+	unsigned int profile_register(const char *name) {
+		return Profiler::registerScope(name);
+	}
+
+	uint64_t profile_now(void) {
+		return Profiler::now();
+	}
+
+	void profile_record(unsigned int scope, uint64_t start) {
+		Profiler::record(scope, start, Profiler::now());
+	}
+}
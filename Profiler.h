@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Scoped timing cheap enough to leave on hot paths. Each PROFILE_SCOPE site gets its ID once, the first time it runs;
+// after that a scope costs two clock reads and a few uncontended stores into the calling thread's own histogram.
+// Reports merge every thread's histograms without stopping anyone.
+class Profiler {
+	public:
+		static constexpr size_t MAX_SCOPES = 256;
+
+		struct ScopeStats {
+			std::string name;
+			uint64_t count = 0;
+			std::chrono::nanoseconds total {0};
+			std::chrono::nanoseconds p50 {0};
+			std::chrono::nanoseconds p99 {0};
+			std::chrono::nanoseconds p999 {0};
+			std::chrono::nanoseconds max {0};
+		};
+
+		// Sites with the same name share a report line. Returns 0 once MAX_SCOPES is used up; recording into 0 is a
+		// no-op.
+		static uint32_t registerScope(const char *name);
+
+		// In ticks of the TSC where it's invariant, otherwise CLOCK_MONOTONIC nanoseconds.
+		static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+			if (useTSC)
+				return __rdtsc();
+#endif
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return uint64_t(ts.tv_sec) * 1'000'000'000 + uint64_t(ts.tv_nsec);
+		}
+
+		static void record(uint32_t scope, uint64_t start, uint64_t end);
+
+		// Sorted by total time, most first. Covers everything since the last clear().
+		static std::vector<ScopeStats> report();
+		static void summary(FILE * = stderr, double threshold = 0.0);
+		static void clear();
+
+		class Guard {
+			private:
+				uint32_t scope;
+				uint64_t start;
+
+			public:
+				explicit Guard(uint32_t scope_): scope(scope_), start(now()) {}
+				~Guard() { record(scope, start, now()); }
+
+				Guard(const Guard &) = delete;
+				Guard & operator=(const Guard &) = delete;
+		};
+
+	private:
+		static const bool useTSC;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) \
+	static const uint32_t PROFILE_CONCAT(profile_scope_, __LINE__) = Profiler::registerScope(name); \
+	const Profiler::Guard PROFILE_CONCAT(profile_guard_, __LINE__)(PROFILE_CONCAT(profile_scope_, __LINE__))
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Chemion {
+	// Wire format of chemiond's command socket. A request is a Header followed by length bytes of payload; the daemon
+	// answers every request with one Reply. Multi-byte fields are little-endian.
+	namespace Protocol {
+		constexpr uint8_t MAGIC = 0xc7;
+		constexpr uint8_t PROTOCOL_VERSION = 1;
+		constexpr uint8_t ALL_DEVICES = 0xff;
+		constexpr size_t MAX_PAYLOAD = 1024;
+		constexpr const char *DEFAULT_SOCKET = "/run/chemiond.sock";
+
+		enum class Command: uint8_t {
+			// Payload: the text, in characters the font has.
+			ShowText = 1,
+			// Payload: 24 bytes, one per column from the left, with bit n set for a lit pixel in row n.
+			ShowImage = 2,
+			// Payload: a ScrollHeader followed by the text.
+			Scroll = 3,
+			// No payload.
+			Clear = 4,
+			// No payload. Only the reply's device counts are of interest.
+			Status = 5,
+			// No payload, and one device rather than all. The reply carries a memfd (as SCM_RIGHTS) holding the device's
+			// Framebuffer, and the device shows whatever is published there until its next command.
+			Framebuffer = 6,
+			// Payload: a PlayHeader followed by the path of an animation file (see Animation.h) the daemon can read.
+			Play = 7,
+		};
+
+		enum class Result: uint8_t {OK = 0, BadRequest = 1, NoDevice = 2, Unsupported = 3};
+
+		struct [[gnu::packed]] Header {
+			uint8_t magic = MAGIC;
+			uint8_t version = PROTOCOL_VERSION;
+			Command command;
+			// Index into the daemon's device list, or ALL_DEVICES.
+			uint8_t device = ALL_DEVICES;
+			uint16_t length = 0;
+		};
+
+		struct [[gnu::packed]] ScrollHeader {
+			// Milliseconds per column, and extra milliseconds at either end.
+			uint16_t delay;
+			uint16_t edgeDelay;
+			// Frames to show before stopping; 0 scrolls until the next command.
+			uint32_t count;
+		};
+
+		struct [[gnu::packed]] PlayHeader {
+			// Times to play it through; 0 repeats until the next command.
+			uint32_t loops;
+		};
+
+		struct [[gnu::packed]] Reply {
+			Result result;
+			Command command;
+			uint8_t devices;
+			uint8_t connected;
+		};
+
+		static_assert(sizeof(Header) == 6 && sizeof(ScrollHeader) == 8 && sizeof(PlayHeader) == 4 && sizeof(Reply) == 4);
+	}
+}
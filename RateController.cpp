@@ -0,0 +1,74 @@
+#include <algorithm>
+
+#include "Debug.h"
+#include "RateController.h"
+
+namespace Chemion {
+	RateController::RateController(RateBounds bounds_): bounds(bounds_), fps(bounds_.maxFPS), chunk(bounds_.minChunk) {}
+
+	void RateController::reset() {
+		fps = bounds.maxFPS;
+		chunk = bounds.minChunk;
+		bytesPerSecond = 0.;
+		lastTime.reset();
+		lastBytes = 0;
+		calmSamples = 0;
+	}
+
+	void RateController::sample(uint64_t bytes_sent, size_t queue_depth, size_t frame_bytes, uint16_t mtu) {
+		const auto now = Clock::now();
+
+		if (!lastTime) {
+			lastTime = now;
+			lastBytes = bytes_sent;
+			return;
+		}
+
+		const auto elapsed = now - *lastTime;
+		if (elapsed < bounds.window)
+			return;
+
+		const double seconds = std::chrono::duration<double>(elapsed).count();
+		const double measured = static_cast<double>(bytes_sent - lastBytes) / seconds;
+		bytesPerSecond = bytesPerSecond == 0.? measured : 0.7 * bytesPerSecond + 0.3 * measured;
+		lastTime = now;
+		lastBytes = bytes_sent;
+
+		// Never use chunks that wouldn't fit in a single Write Command (3 bytes of ATT header).
+		const size_t max_chunk = std::max(bounds.minChunk, std::min<size_t>(bounds.maxChunk, mtu - 3));
+		chunk = std::min(chunk, max_chunk);
+
+		if (bounds.highWater <= queue_depth) {
+			calmSamples = 0;
+
+			// Fewer, larger PDUs cost less airtime than the same bytes split up, so grow chunks before cutting the rate.
+			if (chunk < max_chunk) {
+				chunk = max_chunk;
+				return;
+			}
+
+			const double sustainable = bounds.headroom * bytesPerSecond / static_cast<double>(std::max<size_t>(frame_bytes, 1));
+			if (sustainable < fps * (1. - bounds.hysteresis))
+				setFPS(sustainable);
+			else
+				setFPS(fps * (1. - bounds.hysteresis));
+			return;
+		}
+
+		if (queue_depth <= bounds.lowWater && ++calmSamples >= bounds.probeSamples) {
+			calmSamples = 0;
+			setFPS(fps * (1. + bounds.hysteresis));
+		}
+	}
+
+	std::chrono::milliseconds RateController::frameInterval() const {
+		return std::chrono::milliseconds(static_cast<int64_t>(1'000. / fps));
+	}
+
+	void RateController::setFPS(double new_fps) {
+		new_fps = std::clamp(new_fps, bounds.minFPS, bounds.maxFPS);
+		if (new_fps != fps)
+			DBG("Frame rate %.2f -> %.2f (%.0f B/s)", fps, new_fps, bytesPerSecond);
+		fps = new_fps;
+	}
+}
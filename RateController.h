@@ -0,0 +1,51 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace Chemion {
+	struct RateBounds {
+		double minFPS = 1.;
+		double maxFPS = 30.;
+		// The default MTU of 23 leaves 20 bytes per Write Command. Chunks grow towards maxChunk only as far as the
+		// negotiated MTU allows; 244 fills the largest MTU LE controllers commonly negotiate (247).
+		size_t minChunk = 20;
+		size_t maxChunk = 244;
+		size_t highWater = 12;
+		size_t lowWater = 2;
+		double headroom = 0.9;
+		double hysteresis = 0.15;
+		size_t probeSamples = 4;
+		std::chrono::milliseconds window {250};
+	};
+
+	// Paces frames to just under the throughput the link is currently sustaining. Rates are cut as soon as the write
+	// queue backs up and only raised again after several consecutive samples show the link keeping up.
+	class RateController {
+		public:
+			using Clock = std::chrono::steady_clock;
+
+			RateController(RateBounds = {});
+
+			void sample(uint64_t bytes_sent, size_t queue_depth, size_t frame_bytes, uint16_t mtu);
+			void reset();
+
+			std::chrono::milliseconds frameInterval() const;
+			size_t chunkSize() const { return chunk; }
+			double targetFPS() const { return fps; }
+			double throughput() const { return bytesPerSecond; }
+
+		private:
+			RateBounds bounds;
+			double fps;
+			size_t chunk;
+			double bytesPerSecond = 0.;
+			std::optional<Clock::time_point> lastTime;
+			uint64_t lastBytes = 0;
+			size_t calmSamples = 0;
+
+			void setFPS(double);
+	};
+}
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cstring>
+
+#include "Debug.h"
+#include "Scanner.h"
+
+std::string ScanResult::addressString() const {
+	char buffer[18];
+	ba2str(&address, buffer);
+	return buffer;
+}
+
+bool EIRReader::next(Field &field) {
+	while (!rest.empty()) {
+		const size_t length = rest[0];
+
+		// A zero length marks the end of the significant part.
+		if (length == 0 || rest.size() < length + 1) {
+			rest = {};
+			return false;
+		}
+
+		field.type = rest[1];
+		field.value = rest.subspan(2, length - 1);
+		rest = rest.subspan(length + 1);
+		return true;
+	}
+
+	return false;
+}
+
+bool EIRReader::hasUUID(std::span<const uint8_t> data, const Mgmt::UUID128 &uuid) {
+	EIRReader reader(data);
+	Field field;
+
+	while (reader.next(field)) {
+		if (field.type != UUID128_SOME && field.type != UUID128_ALL)
+			continue;
+		for (size_t i = 0; i + uuid.size() <= field.value.size(); i += uuid.size())
+			if (memcmp(field.value.data() + i, uuid.data(), uuid.size()) == 0)
+				return true;
+	}
+
+	return false;
+}
+
+Scanner::Scanner(uint16_t index) {
+	mgmt.setup(index);
+	mgmt.onDeviceFound = [this](const mgmt_ev_device_found &ev, std::span<const uint8_t> eir) { found(ev, eir); };
+}
+
+Scanner::~Scanner() {
+	stop();
+}
+
+bool Scanner::start(int8_t min_rssi, std::string_view uuid_string) {
+	if (!Mgmt::parseUUID(uuid_string, uuid)) {
+		DBG("Scanner: bad UUID");
+		return false;
+	}
+
+	minRSSI = min_rssi;
+	if (!mgmt.startServiceScan(std::span(&uuid, 1), min_rssi))
+		return false;
+
+	scanning = true;
+	return true;
+}
+
+bool Scanner::stop() {
+	if (!scanning)
+		return true;
+	scanning = false;
+	return mgmt.stopScan();
+}
+
+uint64_t Scanner::key(const bdaddr_t &address, uint8_t type) {
+	uint64_t out = type;
+	for (const uint8_t byte: address.b)
+		out = (out << 8) | byte;
+	return out;
+}
+
+void Scanner::found(const mgmt_ev_device_found &ev, std::span<const uint8_t> eir) {
+	// 127 means the controller didn't report an RSSI.
+	const bool has_rssi = ev.rssi != 127;
+
+	// With the kernel filtering, anything that gets here already matched; otherwise check the UUID and RSSI here, and
+	// like the kernel, don't let an unknown RSSI through.
+	if (!mgmt.kernelFiltering && (!has_rssi || ev.rssi < minRSSI || !EIRReader::hasUUID(eir, uuid)))
+		return;
+
+	const auto now = Clock::now();
+
+	{
+		std::unique_lock lock(cv.mutex);
+		++reports;
+
+		auto [iter, inserted] = devices.try_emplace(key(ev.addr.bdaddr, ev.addr.type));
+		auto &device = iter->second;
+
+		if (inserted) {
+			bacpy(&device.address, &ev.addr.bdaddr);
+			device.addressType = ev.addr.type;
+			device.firstSeen = now;
+		}
+
+		if (has_rssi) {
+			device.rssi = ev.rssi;
+			if (device.hasRSSI)
+				device.smoothedRSSI += smoothing * (ev.rssi - device.smoothedRSSI);
+			else
+				device.smoothedRSSI = ev.rssi;
+			device.hasRSSI = true;
+		}
+
+		device.connectable = (btohl(ev.flags) & MGMT_DEV_FOUND_NOT_CONNECTABLE) == 0;
+		device.lastSeen = now;
+		++device.reports;
+
+		// Names only come with some reports (often scan responses), so only copy one when it changes.
+		EIRReader reader(eir);
+		EIRReader::Field field;
+		while (reader.next(field)) {
+			if (field.type != EIRReader::NAME_COMPLETE && (field.type != EIRReader::NAME_SHORT || !device.name.empty()))
+				continue;
+			const std::string_view name(reinterpret_cast<const char *>(field.value.data()), field.value.size());
+			if (name != device.name)
+				device.name = name;
+		}
+	}
+
+	cv.notify();
+}
+
+std::vector<ScanResult> Scanner::matching(const Predicate &predicate, size_t count) {
+	std::vector<ScanResult> out;
+
+	for (const auto &[key, device]: devices)
+		if (!predicate || predicate(device))
+			out.push_back(device);
+
+	std::sort(out.begin(), out.end(), [](const ScanResult &left, const ScanResult &right) {
+		if (left.hasRSSI != right.hasRSSI)
+			return left.hasRSSI;
+		return left.smoothedRSSI > right.smoothedRSSI;
+	});
+
+	if (count < out.size())
+		out.resize(count);
+	return out;
+}
+
+std::vector<ScanResult> Scanner::results() {
+	std::unique_lock lock(cv.mutex);
+	return matching({}, devices.size());
+}
+
+std::optional<ScanResult> Scanner::find(const bdaddr_t &address) {
+	std::unique_lock lock(cv.mutex);
+
+	for (const uint8_t type: {BDADDR_LE_PUBLIC, BDADDR_LE_RANDOM}) {
+		auto iter = devices.find(key(address, type));
+		if (iter != devices.end())
+			return iter->second;
+	}
+
+	return std::nullopt;
+}
+
+size_t Scanner::expire(std::chrono::nanoseconds age) {
+	const auto cutoff = Clock::now() - age;
+	std::unique_lock lock(cv.mutex);
+	return std::erase_if(devices, [cutoff](const auto &entry) { return entry.second.lastSeen < cutoff; });
+}
+
+std::vector<ScanResult> Scanner::waitFor(const Predicate &predicate, size_t count, std::chrono::milliseconds timeout) {
+	std::unique_lock lock(cv.mutex);
+	std::vector<ScanResult> out;
+	cv.var.wait_for(lock, timeout, [&] { return count <= (out = matching(predicate, count)).size(); });
+	return out;
+}
+
+size_t Scanner::getReports() {
+	std::unique_lock lock(cv.mutex);
+	return reports;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "CVPair.h"
+#include "Mgmt.h"
+
+inline constexpr std::string_view UART_SERVICE_UUID = "6E400001-B5A3-F393-E0A9-E50E24DCCA9E";
+
+struct ScanResult {
+	using Clock = std::chrono::steady_clock;
+
+	bdaddr_t address;
+	uint8_t addressType = 0;
+	std::string name;
+	bool connectable = true;
+	// Whether any report carried an RSSI; until one does, rssi and smoothedRSSI mean nothing.
+	bool hasRSSI = false;
+	int8_t rssi = 0;
+	// Exponentially weighted, so one lucky report doesn't make a far device look close.
+	double smoothedRSSI = 0;
+	size_t reports = 0;
+	Clock::time_point firstSeen;
+	Clock::time_point lastSeen;
+
+	std::string addressString() const;
+	// In the form Bluetooth::connectDevice takes.
+	const char * typeString() const { return addressType == BDADDR_LE_PUBLIC? "public" : "random"; }
+};
+
+// Walks the length/type/value fields of EIR or advertising data in place.
+class EIRReader {
+	private:
+		std::span<const uint8_t> rest;
+
+	public:
+		// The subset of assigned numbers the scanner looks at.
+		static constexpr uint8_t UUID128_SOME = 0x06;
+		static constexpr uint8_t UUID128_ALL = 0x07;
+		static constexpr uint8_t NAME_SHORT = 0x08;
+		static constexpr uint8_t NAME_COMPLETE = 0x09;
+
+		struct Field {
+			uint8_t type;
+			std::span<const uint8_t> value;
+		};
+
+		EIRReader(std::span<const uint8_t> data): rest(data) {}
+
+		bool next(Field &);
+		// Whether a 128-bit service UUID list (complete or not) contains the UUID.
+		static bool hasUUID(std::span<const uint8_t> data, const Mgmt::UUID128 &);
+};
+
+// Keeps a table of nearby devices advertising a service, fed by kernel-filtered discovery on its own mgmt socket.
+class Scanner {
+	public:
+		using Clock = std::chrono::steady_clock;
+		using Predicate = std::function<bool(const ScanResult &)>;
+
+		Scanner(uint16_t index = 0);
+		~Scanner();
+
+		Scanner(const Scanner &) = delete;
+		Scanner & operator=(const Scanner &) = delete;
+
+		// Adverts weaker than min_rssi, or without an RSSI, are dropped by the kernel.
+		bool start(int8_t min_rssi = -90, std::string_view uuid = UART_SERVICE_UUID);
+		bool stop();
+		bool isScanning() const { return scanning; }
+
+		// Strongest first, by smoothed RSSI, then any without an RSSI yet.
+		std::vector<ScanResult> results();
+		std::optional<ScanResult> find(const bdaddr_t &);
+		// Forgets devices that haven't been heard from for the given time. Returns how many were dropped.
+		size_t expire(std::chrono::nanoseconds age);
+		// Blocks until count devices matching the predicate have been seen or the timeout passes, and returns up to count
+		// of them, strongest first.
+		std::vector<ScanResult> waitFor(const Predicate &, size_t count, std::chrono::milliseconds timeout);
+		size_t getReports();
+
+		// Weight given to each new RSSI sample.
+		double smoothing = 0.25;
+
+	private:
+		Mgmt mgmt;
+		Mgmt::UUID128 uuid {};
+		int8_t minRSSI = -127;
+		bool scanning = false;
+		CVPair cv;
+		std::unordered_map<uint64_t, ScanResult> devices;
+		size_t reports = 0;
+
+		static uint64_t key(const bdaddr_t &, uint8_t type);
+		void found(const mgmt_ev_device_found &, std::span<const uint8_t> eir);
+		std::vector<ScanResult> matching(const Predicate &, size_t count);
+};
@@ -4,8 +4,6 @@
 #include <chrono>
 #include <functional>
 #include <vector>
-#include <thread>
-#include <vector>
 
 #include "Encoder.h"
 
@@ -16,6 +14,8 @@ namespace Chemion {
 		bool increasing = true;
 		std::chrono::milliseconds edgeDelay;
 		std::chrono::milliseconds delay;
+		// How long the frame just rendered should stay up; the caller does the waiting.
+		std::chrono::milliseconds hold {0};
 
 		Scroller(std::string_view str, int64_t edge_delay = 800, int64_t delay_ = 200):
 			columns(Chemion::stringColumns(str)), edgeDelay(edge_delay), delay(delay_) {}
@@ -24,22 +24,36 @@ namespace Chemion {
 			if (!fn(Chemion::fromColumns(std::span(columns).subspan(offset, 24)), 20))
 				return false;
 
+			hold = step()? edgeDelay + delay : delay;
+			return true;
+		}
+
+		// Moves the window by one column. Returns true if an edge was reached and the direction was reversed.
+		bool step() {
 			if (increasing) {
 				if (std::ssize(columns) - 24 <= offset) {
 					increasing = false;
-					std::this_thread::sleep_for(edgeDelay);
-				} else
-					++offset;
+					return true;
+				}
+				++offset;
 			} else {
 				if (offset == 0) {
 					increasing = true;
-					std::this_thread::sleep_for(edgeDelay);
-				} else
-					--offset;
+					return true;
+				}
+				--offset;
 			}
 
-			std::this_thread::sleep_for(delay);
-			return true;
+			return false;
+		}
+
+		// Skips ahead as if the scroll had kept running for the given amount of time.
+		void advance(std::chrono::nanoseconds elapsed) {
+			while (delay.count() > 0 && delay <= elapsed) {
+				elapsed -= delay;
+				if (step())
+					elapsed -= std::min<std::chrono::nanoseconds>(elapsed, edgeDelay);
+			}
 		}
 	};
 }
@@ -0,0 +1,81 @@
+#include <algorithm>
+
+#include "TimerWheel.h"
+
+extern "C" {
+#include "src/shared/timer-wheel.h"
+}
+
+unsigned int TimerWheel::add(std::chrono::milliseconds delay, Callback callback) {
+	auto *wheel = timer_wheel_default();
+	if (wheel == nullptr)
+		return 0;
+
+	return timer_wheel_add(wheel, std::max<std::chrono::milliseconds::rep>(delay.count(), 0), +[](void *data) {
+		return (*static_cast<Callback *>(data))();
+	}, new Callback(std::move(callback)), +[](void *data) {
+		delete static_cast<Callback *>(data);
+	});
+}
+
+bool TimerWheel::remove(unsigned int id) {
+	return timer_wheel_remove(timer_wheel_default(), id);
+}
+
+size_t TimerWheel::pending() {
+	auto *wheel = timer_wheel_default();
+	return wheel == nullptr? 0 : timer_wheel_pending(wheel);
+}
+
+bool Alarm::sleepUntil(std::chrono::steady_clock::time_point deadline) {
+	auto shared = state;
+	uint64_t sequence;
+
+	{
+		std::unique_lock lock(shared->cv.mutex);
+		if (shared->cancelled)
+			return false;
+		sequence = ++shared->sequence;
+	}
+
+	const auto delay = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	if (delay.count() <= 0)
+		return true;
+
+	// Added without holding the mutex, since the callback takes it on the loop thread.
+	const unsigned int id = TimerWheel::add(delay, [shared, sequence] {
+		{
+			std::unique_lock lock(shared->cv.mutex);
+			shared->fired = sequence;
+		}
+		shared->cv.notify();
+		return false;
+	});
+
+	std::unique_lock lock(shared->cv.mutex);
+
+	// Without a wheel, fall back to an ordinary timed wait.
+	if (id == 0)
+		return !shared->cv.var.wait_until(lock, deadline, [&] { return shared->cancelled; });
+
+	shared->cv.var.wait(lock, [&] { return shared->fired == sequence || shared->cancelled; });
+	if (shared->fired == sequence)
+		return true;
+
+	lock.unlock();
+	TimerWheel::remove(id);
+	return false;
+}
+
+void Alarm::cancel() {
+	{
+		std::unique_lock lock(state->cv.mutex);
+		state->cancelled = true;
+	}
+	state->cv.notify();
+}
+
+void Alarm::reset() {
+	std::unique_lock lock(state->cv.mutex);
+	state->cancelled = false;
+}
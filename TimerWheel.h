@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "CVPair.h"
+
+// Deadlines on the timer wheel that also serves ATT timeouts, so everything shares one timerfd on the loop thread.
+class TimerWheel {
+	public:
+		// Runs on the loop thread and must not block. Return true to fire again after the same interval.
+		using Callback = std::function<bool()>;
+
+		// Returns 0 if the wheel couldn't be set up.
+		static unsigned int add(std::chrono::milliseconds, Callback);
+		static bool remove(unsigned int id);
+		static size_t pending();
+};
+
+// A deadline a thread can sleep on, for pacing and backoff. cancel() wakes the sleeper early from any thread and keeps
+// later sleeps from starting until reset().
+class Alarm {
+	private:
+		struct State {
+			CVPair cv;
+			uint64_t sequence = 0;
+			uint64_t fired = 0;
+			bool cancelled = false;
+		};
+
+		// Shared with the pending wheel callback, which may still run after the Alarm is gone.
+		std::shared_ptr<State> state = std::make_shared<State>();
+
+	public:
+		// Returns false if cancelled before the deadline.
+		bool sleepUntil(std::chrono::steady_clock::time_point);
+		bool sleepFor(std::chrono::nanoseconds duration) { return sleepUntil(std::chrono::steady_clock::now() + duration); }
+		void cancel();
+		void reset();
+};
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Trace.h"
+
+extern "C" {
+#include "src/shared/trace.h"
+}
+
+static_assert(TRACE_STAGE_WRITE_QUEUE == static_cast<int>(Trace::Stage::WriteQueue));
+static_assert(TRACE_STAGE_IO_SEND == static_cast<int>(Trace::Stage::Send));
+
+namespace {
+	constexpr std::array<const char *, 5> STAGE_NAMES {"render", "encode", "batch", "write_queue", "io_send"};
+
+	// A seqlock per slot: odd while being written, 2 * (index + 1) once complete, so readers can tell a torn or
+	// overwritten slot from the one they expected and skip it.
+	struct Slot {
+		std::atomic<uint64_t> sequence {0};
+		std::atomic<uint64_t> frame {0};
+		std::atomic<uint64_t> begin {0};
+		std::atomic<uint64_t> end {0};
+		std::atomic<uint32_t> thread {0};
+		std::atomic<uint8_t> stage {0};
+	};
+
+	struct Event {
+		uint64_t frame;
+		uint64_t begin;
+		uint64_t end;
+		uint32_t thread;
+		uint8_t stage;
+	};
+
+	std::array<Slot, Trace::CAPACITY> ring;
+	std::atomic<uint64_t> head {0};
+	std::atomic<uint64_t> clearedAt {0};
+	std::atomic<uint64_t> nextFrame {1};
+	thread_local uint64_t currentFrame = 0;
+
+	// Taken once per thread, the first time it records, to remember its name for the export.
+	std::mutex threadMutex;
+	std::map<uint32_t, std::string> threadNames;
+
+	uint32_t threadID() {
+		thread_local uint32_t id = 0;
+		if (id == 0) {
+			id = gettid();
+			char name[16] = "";
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+			std::unique_lock lock(threadMutex);
+			threadNames[id] = name;
+		}
+		return id;
+	}
+
+	std::vector<Event> snapshot() {
+		const uint64_t end = head.load(std::memory_order_acquire);
+		const uint64_t start = std::max(clearedAt.load(std::memory_order_relaxed), end < Trace::CAPACITY? 0 : end - Trace::CAPACITY);
+		std::vector<Event> out;
+		out.reserve(end - start);
+
+		for (uint64_t index = start; index < end; ++index) {
+			const Slot &slot = ring[index % Trace::CAPACITY];
+			const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence != 2 * (index + 1))
+				continue;
+
+			Event event {
+				slot.frame.load(std::memory_order_relaxed),
+				slot.begin.load(std::memory_order_relaxed),
+				slot.end.load(std::memory_order_relaxed),
+				slot.thread.load(std::memory_order_relaxed),
+				slot.stage.load(std::memory_order_relaxed),
+			};
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == sequence && event.stage < STAGE_NAMES.size())
+				out.push_back(event);
+		}
+
+		std::sort(out.begin(), out.end(), [](const Event &left, const Event &right) {
+			return left.begin < right.begin;
+		});
+
+		return out;
+	}
+
+	std::string escape(const std::string &string) {
+		std::string out;
+		for (const char character: string) {
+			if (character == '"' || character == '\\')
+				out += '\\';
+			if (static_cast<unsigned char>(character) < 0x20)
+				continue;
+			out += character;
+		}
+		return out;
+	}
+}
+
+uint64_t Trace::now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000 + uint64_t(ts.tv_nsec);
+}
+
+uint64_t Trace::current() {
+	return currentFrame;
+}
+
+void Trace::record(uint64_t frame, Stage stage, uint64_t begin, uint64_t end) {
+	const uint32_t thread = threadID();
+	const uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+	Slot &slot = ring[index % CAPACITY];
+
+	slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.frame.store(frame, std::memory_order_relaxed);
+	slot.begin.store(begin, std::memory_order_relaxed);
+	slot.end.store(std::max(begin, end), std::memory_order_relaxed);
+	slot.thread.store(thread, std::memory_order_relaxed);
+	slot.stage.store(static_cast<uint8_t>(stage), std::memory_order_relaxed);
+	slot.sequence.store(2 * (index + 1), std::memory_order_release);
+}
+
+void Trace::write(std::ostream &stream) {
+	const std::vector<Event> events = snapshot();
+	const pid_t pid = getpid();
+	const auto us = [](uint64_t nanos) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%lu.%03lu", nanos / 1000, nanos % 1000);
+		return std::string(buffer);
+	};
+
+	// Each frame also gets an async slice from its first stage to its last, so its whole lifetime reads as one bar.
+	std::map<uint64_t, std::pair<uint64_t, uint64_t>> frames;
+	for (const Event &event: events) {
+		auto [iter, inserted] = frames.try_emplace(event.frame, event.begin, event.end);
+		if (!inserted) {
+			iter->second.first = std::min(iter->second.first, event.begin);
+			iter->second.second = std::max(iter->second.second, event.end);
+		}
+	}
+
+	stream << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	bool first = true;
+	auto next = [&]() -> std::ostream & {
+		if (!first)
+			stream << ",\n";
+		first = false;
+		return stream;
+	};
+
+	{
+		std::unique_lock lock(threadMutex);
+		for (const auto &[thread, name]: threadNames)
+			next() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread
+				<< ",\"args\":{\"name\":\"" << escape(name) << "\"}}";
+	}
+
+	for (const auto &[frame, span]: frames) {
+		next() << "{\"name\":\"frame " << frame << "\",\"cat\":\"frame\",\"ph\":\"b\",\"id\":" << frame << ",\"pid\":"
+			<< pid << ",\"tid\":" << pid << ",\"ts\":" << us(span.first) << "}";
+		next() << "{\"name\":\"frame " << frame << "\",\"cat\":\"frame\",\"ph\":\"e\",\"id\":" << frame << ",\"pid\":"
+			<< pid << ",\"tid\":" << pid << ",\"ts\":" << us(span.second) << "}";
+	}
+
+	// Stages that run on the sending thread nest, so they're plain slices on that thread. Ops in the write queue
+	// overlap each other, so those are async slices, one per op.
+	uint64_t async_id = 0;
+	for (const Event &event: events) {
+		const char *name = STAGE_NAMES[event.stage];
+		if (static_cast<Stage>(event.stage) == Stage::WriteQueue) {
+			++async_id;
+			next() << "{\"name\":\"" << name << "\",\"cat\":\"att\",\"ph\":\"b\",\"id2\":{\"local\":" << async_id
+				<< "},\"pid\":" << pid << ",\"tid\":" << event.thread << ",\"ts\":" << us(event.begin)
+				<< ",\"args\":{\"frame\":" << event.frame << "}}";
+			next() << "{\"name\":\"" << name << "\",\"cat\":\"att\",\"ph\":\"e\",\"id2\":{\"local\":" << async_id
+				<< "},\"pid\":" << pid << ",\"tid\":" << event.thread << ",\"ts\":" << us(event.end) << "}";
+		} else {
+			next() << "{\"name\":\"" << name << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":"
+				<< event.thread << ",\"ts\":" << us(event.begin) << ",\"dur\":" << us(event.end - event.begin)
+				<< ",\"args\":{\"frame\":" << event.frame << "}}";
+		}
+	}
+
+	stream << "\n]}\n";
+}
+
+bool Trace::save(const std::string &path) {
+	std::ofstream stream(path);
+	if (!stream)
+		return false;
+	write(stream);
+	return static_cast<bool>(stream);
+}
+
+void Trace::clear() {
+	clearedAt.store(head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+Trace::Frame::Frame(): previous(currentFrame), id(previous? previous : nextFrame.fetch_add(1, std::memory_order_relaxed)) {
+	currentFrame = id;
+}
+
+Trace::Frame::Frame(uint64_t id_): previous(currentFrame), id(id_) {
+	currentFrame = id;
+}
+
+Trace::Frame::~Frame() {
+	currentFrame = previous;
+}
+
+extern "C" {
+	uint64_t trace_current(void) {
+		return Trace::current();
+	}
+
+	uint64_t trace_now(void) {
+		return Trace::now();
+	}
+
+	void trace_record(uint64_t frame, unsigned int stage, uint64_t begin, uint64_t end) {
+		Trace::record(frame, static_cast<Trace::Stage>(stage), begin, end);
+	}
+}
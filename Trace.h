@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Per-frame lifecycle tracing. Every frame gets an ID, and each stage it passes through on its way to the socket
+// records a start and end time into a fixed ring that any thread can write without locking. The ring keeps the most
+// recent CAPACITY stages and can be exported at any time in Chrome's trace-event format, for Perfetto or
+// chrome://tracing.
+class Trace {
+	public:
+		static constexpr size_t CAPACITY = 1 << 15;
+
+		// WriteQueue and Send are recorded by bt_att; src/shared/trace.h has the same numbers.
+		enum class Stage: uint8_t {Render, Encode, Batch, WriteQueue, Send};
+
+		// CLOCK_MONOTONIC nanoseconds.
+		static uint64_t now();
+		// The calling thread's open frame, or 0.
+		static uint64_t current();
+		static void record(uint64_t frame, Stage, uint64_t begin, uint64_t end);
+
+		// Everything recorded since the last clear() that's still in the ring.
+		static void write(std::ostream &);
+		static bool save(const std::string &path);
+		static void clear();
+
+		// Makes a frame current on this thread until destroyed. With no ID, a new one is assigned unless a frame is
+		// already open, so nested calls trace as one frame; with an ID, that frame is adopted, e.g. on another thread.
+		class Frame {
+			private:
+				uint64_t previous;
+
+			public:
+				const uint64_t id;
+
+				Frame();
+				explicit Frame(uint64_t id_);
+				~Frame();
+
+				Frame(const Frame &) = delete;
+				Frame & operator=(const Frame &) = delete;
+		};
+
+		// Records one stage of the current frame, if there is one.
+		class Span {
+			private:
+				uint64_t frame;
+				Stage stage;
+				uint64_t begin;
+
+			public:
+				explicit Span(Stage stage_): frame(current()), stage(stage_), begin(frame? now() : 0) {}
+				~Span() {
+					if (frame)
+						record(frame, stage, begin, now());
+				}
+
+				Span(const Span &) = delete;
+				Span & operator=(const Span &) = delete;
+		};
+};
@@ -0,0 +1,102 @@
+#include <glib.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern "C" {
+#include "lib/bluetooth.h"
+#include "lib/sdp.h"
+#include "lib/uuid.h"
+#include "btio/btio.h"
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+#include "attrib/gatt.h"
+#include "attrib/gatttool.h"
+}
+
+#include "Debug.h"
+#include "FakePeripheral.h"
+#include "Transport.h"
+
+namespace {
+	struct PendingConnect {
+		GIOChannel *channel;
+		BtIOConnect callback;
+		gpointer userData;
+	};
+
+	gboolean finish_connect(gpointer data) {
+		auto *pending = reinterpret_cast<PendingConnect *>(data);
+		pending->callback(pending->channel, nullptr, pending->userData);
+		g_io_channel_unref(pending->channel);
+		delete pending;
+		return FALSE;
+	}
+}
+
+GIOChannel * adoptSocket(int fd, BtIOConnect callback, gpointer user_data) {
+	GIOChannel *channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(channel, true);
+	g_io_channel_set_encoding(channel, nullptr, nullptr);
+	g_io_channel_set_buffered(channel, false);
+
+	// The idle callback holds its own reference in case the channel is shut down before it runs.
+	g_idle_add(finish_connect, new PendingConnect {g_io_channel_ref(channel), callback, user_data});
+	return channel;
+}
+
+GIOChannel * BluezTransport::connect(const char *addr, const char *type, int mtu, BtIOConnect callback, gpointer user_data, GError **gerr) {
+	return gatt_connect(source.empty()? nullptr : source.c_str(), addr, type, "low", 0, mtu, callback, user_data, gerr);
+}
+
+GIOChannel * FakeTransport::connect(const char *addr, const char *, int, BtIOConnect callback, gpointer user_data, GError **) {
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		DBG("FakeTransport: socketpair failed");
+		return nullptr;
+	}
+
+	DBG("FakeTransport: connecting to fake %s", addr);
+
+	{
+		std::unique_lock lock(mutex);
+		peripherals.push_back(std::make_shared<FakePeripheral>(fds[1]));
+		peripherals.back()->start();
+	}
+
+	return adoptSocket(fds[0], callback, user_data);
+}
+
+std::shared_ptr<FakePeripheral> FakeTransport::getPeripheral() {
+	std::unique_lock lock(mutex);
+	return peripherals.empty()? nullptr : peripherals.back();
+}
+
+GIOChannel * SocketTransport::connect(const char *addr, const char *, int, BtIOConnect callback, gpointer user_data, GError **) {
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+
+	if (sizeof(address.sun_path) <= path.size()) {
+		DBG("SocketTransport: path too long: %s", path.c_str());
+		return nullptr;
+	}
+
+	std::strcpy(address.sun_path, path.c_str());
+
+	const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		DBG("SocketTransport: socket failed: %s", strerror(errno));
+		return nullptr;
+	}
+
+	if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+		DBG("SocketTransport: couldn't connect to %s for %s: %s", path.c_str(), addr, strerror(errno));
+		close(fd);
+		return nullptr;
+	}
+
+	return adoptSocket(fd, callback, user_data);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glib.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "lib/bluetooth.h"
+#include "btio/btio.h"
+}
+
+class FakePeripheral;
+
+// Supplies the channel that Bluetooth runs GAttrib on. Implementations return the channel immediately and invoke the
+// callback on the loop thread once it's usable, the same contract as gatt_connect.
+class Transport {
+	public:
+		virtual ~Transport() = default;
+		virtual GIOChannel * connect(const char *addr, const char *type, int mtu, BtIOConnect callback, gpointer user_data, GError **) = 0;
+};
+
+// Real hardware through an L2CAP ATT socket.
+class BluezTransport: public Transport {
+	private:
+		// Local adapter, e.g. "hci1"; empty lets the kernel pick.
+		std::string source;
+
+	public:
+		BluezTransport(std::string source_ = {}): source(std::move(source_)) {}
+		GIOChannel * connect(const char *addr, const char *type, int mtu, BtIOConnect callback, gpointer user_data, GError **) override;
+};
+
+// Connects to an in-process FakePeripheral over a socketpair, so the whole GAttrib/bt_att/io-glib stack runs without
+// any Bluetooth hardware. Every connect() creates a new peripheral; the most recent one is kept for inspection.
+class FakeTransport: public Transport {
+	private:
+		std::mutex mutex;
+		std::vector<std::shared_ptr<FakePeripheral>> peripherals;
+
+	public:
+		GIOChannel * connect(const char *addr, const char *type, int mtu, BtIOConnect callback, gpointer user_data, GError **) override;
+		std::shared_ptr<FakePeripheral> getPeripheral();
+};
+
+// Connects to a virtual device (see vglasses) listening on a Unix socket.
+class SocketTransport: public Transport {
+	private:
+		std::string path;
+
+	public:
+		SocketTransport(std::string path_): path(std::move(path_)) {}
+		GIOChannel * connect(const char *addr, const char *type, int mtu, BtIOConnect callback, gpointer user_data, GError **) override;
+};
+
+// Shared by transports that hand over an already-connected socket: wraps it in a channel and schedules the callback.
+GIOChannel * adoptSocket(int fd, BtIOConnect callback, gpointer user_data);
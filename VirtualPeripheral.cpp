@@ -0,0 +1,46 @@
+#include <thread>
+
+#include "Debug.h"
+#include "VirtualPeripheral.h"
+
+VirtualPeripheral::VirtualPeripheral(int fd_, LinkModel model_, unsigned seed):
+FakePeripheral(fd_, model_.mtu), model(model_), rng(seed), loss(model_.lossRate), anchor(Clock::now()), event(anchor) {}
+
+VirtualPeripheral::~VirtualPeripheral() {
+	// The reader thread calls received(), so it has to stop before this object's members go away.
+	stop();
+}
+
+void VirtualPeripheral::nextEvent() {
+	const auto now = Clock::now();
+	event += model.connectionInterval;
+
+	// Connection events keep their cadence while the link is idle, so resynchronise to the next one after now.
+	if (event < now) {
+		const auto behind = (now - anchor) / model.connectionInterval + 1;
+		event = anchor + behind * model.connectionInterval;
+	}
+
+	slotsLeft = model.packetsPerEvent;
+}
+
+void VirtualPeripheral::received(const uint8_t *, size_t length) {
+	if (model.mtu < length)
+		DBG("VirtualPeripheral: %lu-byte PDU exceeds the MTU of %u", length, model.mtu);
+
+	size_t packets = (length + 4 + model.llPayload - 1) / model.llPayload;
+
+	while (0 < packets) {
+		if (slotsLeft == 0 || event < Clock::now())
+			nextEvent();
+
+		--slotsLeft;
+
+		if (loss(rng))
+			++retransmissions;
+		else
+			--packets;
+	}
+
+	std::this_thread::sleep_until(event);
+}
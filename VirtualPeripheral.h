@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+
+#include "FakePeripheral.h"
+
+struct LinkModel {
+	std::chrono::microseconds connectionInterval {30'000};
+	size_t packetsPerEvent = 4;
+	uint16_t mtu = 23;
+	double lossRate = 0.;
+	// Largest link-layer data payload. 27 bytes unless Data Length Extension is in use.
+	size_t llPayload = 27;
+};
+
+// A FakePeripheral that only takes PDUs off the socket as fast as a BLE link with the given parameters could carry
+// them. Each PDU (plus its 4-byte L2CAP header) is split into link-layer packets that are sent in connection events;
+// a lost packet is retransmitted in the next slot. Since reading stalls while a PDU is "on air", the sender sees the
+// same backpressure a real link would give it.
+class VirtualPeripheral: public FakePeripheral {
+	public:
+		VirtualPeripheral(int fd_, LinkModel model_, unsigned seed = std::random_device{}());
+		~VirtualPeripheral() override;
+
+		const LinkModel & getModel() const { return model; }
+		size_t getRetransmissions() const { return retransmissions; }
+
+	protected:
+		void received(const uint8_t *, size_t) override;
+
+	private:
+		LinkModel model;
+		std::mt19937 rng;
+		std::bernoulli_distribution loss;
+		Clock::time_point anchor;
+		Clock::time_point event;
+		size_t slotsLeft = 0;
+		std::atomic_size_t retransmissions {0};
+
+		void nextEvent();
+};
@@ -0,0 +1,127 @@
+// Compiles a show script into an animation file (see Animation.h) for Glasses::play() and chemiond. Each line is
+// one of
+//   text MS TEXT                   shows TEXT for MS milliseconds
+//   scroll DELAY EDGE CYCLES TEXT  scrolls TEXT out and back CYCLES times, DELAY ms per column and EDGE ms at the ends
+//   image MS                       shows the next 7 lines for MS milliseconds: 24 columns of ' ', '-', 'x' or 'X'
+//   clear MS                       shows nothing for MS milliseconds
+// Blank lines and lines starting with # are skipped.
+
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "Animation.h"
+#include "Encoder.h"
+
+namespace {
+	void usage(const char *name) {
+		fprintf(stderr, "Usage: %s [-o output] script\n", name);
+	}
+
+	bool compile(std::istream &script, const char *name, Chemion::Animation::Builder &builder) {
+		using std::chrono::milliseconds;
+
+		std::string line;
+		size_t number = 0;
+
+		auto fail = [&](const std::string &problem) {
+			fprintf(stderr, "%s:%lu: %s\n", name, number, problem.c_str());
+			return false;
+		};
+
+		while (std::getline(script, line)) {
+			++number;
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			std::istringstream fields(line);
+			std::string command;
+			fields >> command;
+
+			// The text is the rest of the line after the numbers and one space.
+			auto rest = [&fields] {
+				std::string text;
+				if (fields.peek() == ' ')
+					fields.get();
+				std::getline(fields, text);
+				return text;
+			};
+
+			if (command == "text") {
+				size_t duration;
+				if (!(fields >> duration))
+					return fail("expected text MS TEXT");
+				if (!builder.addText(rest(), milliseconds(duration)))
+					return fail("the font lacks some of the characters");
+			} else if (command == "scroll") {
+				size_t delay, edge_delay, cycles;
+				if (!(fields >> delay >> edge_delay >> cycles) || delay == 0)
+					return fail("expected scroll DELAY EDGE CYCLES TEXT with a nonzero delay");
+				if (!builder.addScroll(rest(), milliseconds(edge_delay), milliseconds(delay), cycles))
+					return fail("the font lacks some of the characters");
+			} else if (command == "image") {
+				size_t duration;
+				if (!(fields >> duration))
+					return fail("expected image MS");
+
+				std::string rows;
+				for (size_t row = 0; row < 7; ++row) {
+					std::string pixels;
+					if (!std::getline(script, pixels))
+						return fail("expected 7 rows after image");
+					++number;
+					rows += pixels + '\n';
+				}
+
+				try {
+					builder.addFrame(Chemion::encode(rows), milliseconds(duration));
+				} catch (const std::exception &error) {
+					return fail(error.what());
+				}
+			} else if (command == "clear") {
+				size_t duration;
+				if (!(fields >> duration))
+					return fail("expected clear MS");
+				builder.addImage({}, milliseconds(duration));
+			} else
+				return fail("unknown command " + command);
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string output = "show.anim";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+			case 'o': output = optarg; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::ifstream script(argv[optind]);
+	if (!script) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	Chemion::Animation::Builder builder;
+	if (!compile(script, argv[optind], builder) || !builder.save(output))
+		return 1;
+
+	printf("%s: %lu entries, %lu distinct frames, %.3f s\n", output.c_str(), builder.getEntryCount(),
+		builder.getFrameCount(), builder.getDuration().count() / 1000.);
+	return 0;
+}
@@ -39,28 +39,44 @@
 #include "src/log.h"
 #include "src/shared/util.h"
 #include "src/shared/att.h"
-#include "src/shared/queue.h"
 #include "attrib/gattrib.h"
 
+#define ID_TABLE_MIN_SIZE	16
+
+/*
+ * Open-addressing hash table with linear probing. Keys may repeat; lookups
+ * return the first match and removals match on both key and value. A zero
+ * key marks an empty slot.
+ */
+struct id_entry {
+	uintptr_t key;
+	uintptr_t value;
+};
+
+struct id_table {
+	struct id_entry *slots;
+	unsigned int size;
+	unsigned int count;
+};
+
 struct _GAttrib {
 	int ref_count;
 	struct bt_att *att;
 	GIOChannel *io;
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
-	struct queue *callbacks;
+	struct id_table callbacks;	/* attrib_callbacks pointers */
 	uint8_t *buf;
 	int buflen;
-	struct queue *track_ids;
+	struct id_table track_ids;	/* Caller's id -> bt_att id */
+	uint8_t *pdu_buf;		/* Reused to deliver full PDUs */
+	uint16_t pdu_buflen;
+	bool pdu_buf_busy;
 };
 
-struct id_pair {
+struct attrib_callbacks {
 	unsigned int org_id;
 	unsigned int pend_id;
-};
-
-struct attrib_callbacks {
-	struct id_pair *id;
 	GAttribResultFunc result_func;
 	GAttribNotifyFunc notify_func;
 	GDestroyNotify destroy_func;
@@ -69,32 +85,163 @@ struct attrib_callbacks {
 	uint16_t notify_handle;
 };
 
-static bool find_with_org_id(const void *data, const void *user_data)
+static unsigned int id_table_home(const struct id_table *table, uintptr_t key)
 {
-	const struct id_pair *p = data;
-	unsigned int orig_id = PTR_TO_UINT(user_data);
+	/* Fibonacci hashing spreads sequential ids and aligned pointers */
+	return (unsigned int) ((key * 0x9E3779B97F4A7C15ull) >> 32) &
+							(table->size - 1);
+}
 
-	return (p->org_id == orig_id);
+static bool id_table_insert(struct id_table *table, uintptr_t key,
+							uintptr_t value);
+
+static bool id_table_resize(struct id_table *table, unsigned int size)
+{
+	struct id_entry *old = table->slots;
+	unsigned int old_size = table->size;
+	unsigned int i;
+
+	table->slots = new0(struct id_entry, size);
+	if (!table->slots) {
+		table->slots = old;
+		return false;
+	}
+
+	table->size = size;
+	table->count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].key)
+			id_table_insert(table, old[i].key, old[i].value);
+	}
+
+	free(old);
+	return true;
 }
 
-static struct id_pair *store_id(GAttrib *attrib, unsigned int org_id,
-							unsigned int pend_id)
+static bool id_table_insert(struct id_table *table, uintptr_t key,
+							uintptr_t value)
 {
-	struct id_pair *t;
+	unsigned int i;
 
-	t = new0(struct id_pair, 1);
-	if (!t)
-		return NULL;
+	if (!key)
+		return false;
 
-	t->org_id = org_id;
-	t->pend_id = pend_id;
+	/* Keep the load factor under 3/4 so probe sequences stay short */
+	if ((table->count + 1) * 4 > table->size * 3 &&
+			!id_table_resize(table, table->size ?
+					table->size * 2 : ID_TABLE_MIN_SIZE))
+		return false;
+
+	i = id_table_home(table, key);
+	while (table->slots[i].key)
+		i = (i + 1) & (table->size - 1);
+
+	table->slots[i].key = key;
+	table->slots[i].value = value;
+	table->count++;
 
-	if (queue_push_tail(attrib->track_ids, t))
-		return t;
+	return true;
+}
+
+static struct id_entry *id_table_find(struct id_table *table, uintptr_t key)
+{
+	unsigned int i;
+
+	if (!key || !table->count)
+		return NULL;
+
+	for (i = id_table_home(table, key); table->slots[i].key;
+					i = (i + 1) & (table->size - 1)) {
+		if (table->slots[i].key == key)
+			return &table->slots[i];
+	}
 
 	return NULL;
 }
 
+/* Backward-shift deletion, so no tombstones are needed. */
+static void id_table_remove_slot(struct id_table *table, unsigned int i)
+{
+	unsigned int mask = table->size - 1;
+	unsigned int j = i;
+	unsigned int home;
+
+	while (true) {
+		j = (j + 1) & mask;
+		if (!table->slots[j].key)
+			break;
+
+		home = id_table_home(table, table->slots[j].key);
+
+		/* Leave entries that would be moved before their home slot */
+		if ((j > i && (home <= i || home > j)) ||
+					(j < i && home <= i && home > j)) {
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+
+	table->slots[i].key = 0;
+	table->slots[i].value = 0;
+	table->count--;
+}
+
+static bool id_table_remove(struct id_table *table, uintptr_t key,
+							uintptr_t value)
+{
+	unsigned int i;
+
+	if (!key || !table->count)
+		return false;
+
+	for (i = id_table_home(table, key); table->slots[i].key;
+					i = (i + 1) & (table->size - 1)) {
+		if (table->slots[i].key == key &&
+					table->slots[i].value == value) {
+			id_table_remove_slot(table, i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Removes and returns any one entry, for emptying a table. */
+static bool id_table_pop(struct id_table *table, struct id_entry *entry)
+{
+	unsigned int i;
+
+	if (!table->count)
+		return false;
+
+	for (i = 0; !table->slots[i].key; i++)
+		;
+
+	*entry = table->slots[i];
+	id_table_remove_slot(table, i);
+
+	return true;
+}
+
+static void id_table_free(struct id_table *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+	table->size = 0;
+	table->count = 0;
+}
+
+static void store_id(GAttrib *attrib, struct attrib_callbacks *cb,
+				unsigned int org_id, unsigned int pend_id)
+{
+	if (!id_table_insert(&attrib->track_ids, org_id, pend_id))
+		return;
+
+	cb->org_id = org_id;
+	cb->pend_id = pend_id;
+}
+
 GAttrib *g_attrib_new(GIOChannel *io, guint16 mtu, bool ext_signed)
 {
 	gint fd;
@@ -126,17 +273,22 @@ GAttrib *g_attrib_new(GIOChannel *io, guint16 mtu, bool ext_signed)
 	if (!attr->buf)
 		goto fail;
 
-	attr->callbacks = queue_new();
-	if (!attr->callbacks)
+	if (!id_table_resize(&attr->callbacks, ID_TABLE_MIN_SIZE))
 		goto fail;
 
-	attr->track_ids = queue_new();
-	if (!attr->track_ids)
+	if (!id_table_resize(&attr->track_ids, ID_TABLE_MIN_SIZE))
+		goto fail;
+
+	attr->pdu_buf = malloc(mtu);
+	attr->pdu_buflen = mtu;
+	if (!attr->pdu_buf)
 		goto fail;
 
 	return g_attrib_ref(attr);
 
 fail:
+	id_table_free(&attr->callbacks);
+	id_table_free(&attr->track_ids);
 	free(attr->buf);
 	bt_att_unref(attr->att);
 	g_io_channel_unref(io);
@@ -163,8 +315,9 @@ static void attrib_callbacks_destroy(void *data)
 	if (cb->destroy_func)
 		cb->destroy_func(cb->user_data);
 
-	if (queue_remove(cb->parent->track_ids, cb->id))
-		free(cb->id);
+	if (cb->org_id)
+		id_table_remove(&cb->parent->track_ids, cb->org_id,
+								cb->pend_id);
 
 	free(data);
 }
@@ -173,7 +326,8 @@ static void attrib_callbacks_remove(void *data)
 {
 	struct attrib_callbacks *cb = data;
 
-	if (!data || !queue_remove(cb->parent->callbacks, data))
+	if (!data || !id_table_remove(&cb->parent->callbacks,
+					(uintptr_t) data, (uintptr_t) data))
 		return;
 
 	attrib_callbacks_destroy(data);
@@ -181,6 +335,8 @@ static void attrib_callbacks_remove(void *data)
 
 void g_attrib_unref(GAttrib *attrib)
 {
+	struct id_entry entry;
+
 	if (!attrib)
 		return;
 
@@ -194,9 +350,13 @@ void g_attrib_unref(GAttrib *attrib)
 
 	bt_att_unref(attrib->att);
 
-	queue_destroy(attrib->callbacks, attrib_callbacks_destroy);
-	queue_destroy(attrib->track_ids, free);
+	while (id_table_pop(&attrib->callbacks, &entry))
+		attrib_callbacks_destroy((void *) entry.value);
+
+	id_table_free(&attrib->callbacks);
+	id_table_free(&attrib->track_ids);
 
+	free(attrib->pdu_buf);
 	free(attrib->buf);
 
 	g_io_channel_unref(attrib->io);
@@ -233,20 +393,49 @@ gboolean g_attrib_set_destroy_function(GAttrib *attrib, GDestroyNotify destroy,
 }
 
 
-static uint8_t *construct_full_pdu(uint8_t opcode, const void *pdu,
-								uint16_t length)
+/*
+ * Callbacks get the opcode and parameters in one buffer. The attrib's PDU
+ * buffer is used unless a callback is already being given it further up the
+ * stack, in which case a temporary one is allocated.
+ */
+static uint8_t *construct_full_pdu(GAttrib *attrib, uint8_t opcode,
+					const void *pdu, uint16_t length)
 {
-	uint8_t *buf = malloc0(length + 1);
+	uint8_t *buf;
+
+	if (attrib->pdu_buf_busy) {
+		buf = malloc(length + 1);
+	} else {
+		if (length + 1 > attrib->pdu_buflen) {
+			buf = realloc(attrib->pdu_buf, length + 1);
+			if (!buf)
+				return NULL;
+			attrib->pdu_buf = buf;
+			attrib->pdu_buflen = length + 1;
+		}
+
+		buf = attrib->pdu_buf;
+		attrib->pdu_buf_busy = true;
+	}
 
 	if (!buf)
 		return NULL;
 
 	buf[0] = opcode;
-	memcpy(buf + 1, pdu, length);
+	if (length)
+		memcpy(buf + 1, pdu, length);
 
 	return buf;
 }
 
+static void release_full_pdu(GAttrib *attrib, uint8_t *buf)
+{
+	if (buf == attrib->pdu_buf)
+		attrib->pdu_buf_busy = false;
+	else
+		free(buf);
+}
+
 static void attrib_callback_result(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
@@ -257,7 +446,7 @@ static void attrib_callback_result(uint8_t opcode, const void *pdu,
 	if (!cb)
 		return;
 
-	buf = construct_full_pdu(opcode, pdu, length);
+	buf = construct_full_pdu(cb->parent, opcode, pdu, length);
 	if (!buf)
 		return;
 
@@ -272,7 +461,7 @@ static void attrib_callback_result(uint8_t opcode, const void *pdu,
 	if (cb->result_func)
 		cb->result_func(status, buf, length + 1, cb->user_data);
 
-	free(buf);
+	release_full_pdu(cb->parent, buf);
 }
 
 static void attrib_callback_notify(uint8_t opcode, const void *pdu,
@@ -291,13 +480,13 @@ static void attrib_callback_notify(uint8_t opcode, const void *pdu,
 					cb->notify_handle != get_le16(pdu))
 		return;
 
-	buf = construct_full_pdu(opcode, pdu, length);
+	buf = construct_full_pdu(cb->parent, opcode, pdu, length);
 	if (!buf)
 		return;
 
 	cb->notify_func(buf, length + 1, cb->user_data);
 
-	free(buf);
+	release_full_pdu(cb->parent, buf);
 }
 
 guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
@@ -323,7 +512,11 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 		cb->user_data = user_data;
 		cb->destroy_func = notify;
 		cb->parent = attrib;
-		queue_push_head(attrib->callbacks, cb);
+		if (!id_table_insert(&attrib->callbacks, (uintptr_t) cb,
+							(uintptr_t) cb)) {
+			free(cb);
+			return 0;
+		}
 		response_cb = attrib_callback_result;
 		destroy_cb = attrib_callbacks_remove;
 
@@ -332,6 +525,17 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 	pend_id = bt_att_send(attrib->att, pdu[0], (void *) pdu + 1, len - 1,
 						response_cb, cb, destroy_cb);
 
+	/*
+	 * bt_att didn't take the callbacks, so drop them without running the
+	 * destroy notify: the caller sees the failure from the return value.
+	 */
+	if (!pend_id) {
+		if (cb && id_table_remove(&attrib->callbacks, (uintptr_t) cb,
+							(uintptr_t) cb))
+			free(cb);
+		return 0;
+	}
+
 	/*
 	 * We store here pair as it is easier to handle it in response and in
 	 * case where user request us to use specific id request - see below.
@@ -344,57 +548,59 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 	 * user a possibility to cancel ongoing request.
 	 */
 	if (cb)
-		cb->id = store_id(attrib, id, pend_id);
+		store_id(attrib, cb, id, pend_id);
 
 	return id;
 }
 
 gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 {
-	struct id_pair *p;
+	struct id_entry *p;
 
 	if (!attrib)
 		return FALSE;
 
 	/*
 	 * If request belongs to gattrib and is not yet done it has to be on
-	 * the tracking id queue
+	 * the tracking id table
 	 *
-	 * FIXME: It can happen that on the queue there is id_pair with
+	 * FIXME: It can happen that in the table there is an entry with
 	 * given id which was provided by the user. In the same time it might
 	 * happen that other attrib user got dynamic allocated req_id with same
 	 * value as the one provided by the other user.
 	 * In such case there are two clients having same request id and in
 	 * this point of time we don't know which one calls cancel. For
-	 * now we cancel request in which id was specified by the user.
+	 * now we cancel whichever of them the lookup finds first.
 	 */
-	p = queue_remove_if(attrib->track_ids, find_with_org_id,
-							UINT_TO_PTR(id));
+	p = id_table_find(&attrib->track_ids, id);
 	if (!p)
 		return FALSE;
 
-	id = p->pend_id;
-	free(p);
+	id = p->value;
+	id_table_remove_slot(&attrib->track_ids, p - attrib->track_ids.slots);
 
 	return bt_att_cancel(attrib->att, id);
 }
 
-static void cancel_request(void *data, void *user_data)
-{
-	struct id_pair *p = data;
-	GAttrib *attrib = user_data;
-
-	bt_att_cancel(attrib->att, p->pend_id);
-}
-
 gboolean g_attrib_cancel_all(GAttrib *attrib)
 {
+	struct id_entry entry;
+	unsigned int count;
+
 	if (!attrib)
 		return FALSE;
 
-	/* Cancel only request which belongs to gattrib */
-	queue_foreach(attrib->track_ids, cancel_request, attrib);
-	queue_remove_all(attrib->track_ids, NULL, NULL, free);
+	/*
+	 * Cancel only request which belongs to gattrib. Each entry is removed
+	 * before its request is cancelled, so the destroy callback finds
+	 * nothing left to remove. Anything a callback adds is left alone.
+	 */
+	for (count = attrib->track_ids.count; count; count--) {
+		if (!id_table_pop(&attrib->track_ids, &entry))
+			break;
+
+		bt_att_cancel(attrib->att, entry.value);
+	}
 
 	return TRUE;
 }
@@ -417,7 +623,11 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 		cb->user_data = user_data;
 		cb->destroy_func = notify;
 		cb->parent = attrib;
-		queue_push_head(attrib->callbacks, cb);
+		if (!id_table_insert(&attrib->callbacks, (uintptr_t) cb,
+							(uintptr_t) cb)) {
+			free(cb);
+			return 0;
+		}
 	}
 
 	if (opcode == GATTRIB_ALL_REQS)
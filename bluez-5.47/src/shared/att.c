@@ -33,6 +33,8 @@
 #include "src/shared/queue.h"
 #include "src/shared/util.h"
 #include "src/shared/timeout.h"
+#include "src/shared/profile.h"
+#include "src/shared/trace.h"
 #include "lib/bluetooth.h"
 #include "lib/l2cap.h"
 #include "lib/uuid.h"
@@ -47,6 +49,15 @@
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
+/* Idle preallocated send ops kept for commands and notifications */
+#define ATT_SEND_POOL_SIZE		32
+
+/* Write queue entries held in the ring before spilling into a queue */
+#define ATT_WRITE_RING_SIZE		64
+
+/* Most commands handed to the kernel in one call */
+#define ATT_SEND_BATCH			16
+
 struct att_send_op;
 
 struct bt_att {
@@ -60,9 +71,17 @@ struct bt_att {
 	struct att_send_op *pending_req;
 	struct queue *ind_queue;	/* Queued ATT protocol indications */
 	struct att_send_op *pending_ind;
-	struct queue *write_queue;	/* Queue of PDUs ready to send */
+	struct queue *write_queue;	/* Overflow of write_ring */
+	struct att_send_op *write_ring[ATT_WRITE_RING_SIZE];
+	unsigned int write_ring_head;
+	unsigned int write_ring_len;
 	bool writer_active;
 
+	struct att_send_op *op_pool[ATT_SEND_POOL_SIZE];
+	unsigned int op_pool_len;
+	uint16_t op_pool_mtu;		/* PDU capacity of pooled ops */
+	struct bt_att_alloc_stats alloc_stats;
+
 	struct queue *notify_list;	/* List of registered callbacks */
 	struct queue *disconn_list;	/* List of disconnect handlers */
 
@@ -82,6 +101,10 @@ struct bt_att {
 	bt_att_destroy_func_t debug_destroy;
 	void *debug_data;
 
+	bt_att_capture_func_t capture_callback;
+	bt_att_destroy_func_t capture_destroy;
+	void *capture_data;
+
 	struct bt_crypto *crypto;
 
 	struct sign_info *local_sign;
@@ -194,8 +217,50 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	struct bt_att *pool;		/* Owner, if the op is pooled */
+	uint64_t trace_frame;		/* Frame being sent, or 0 */
+	uint64_t trace_queued;
+	uint16_t capacity;
+	uint8_t storage[];		/* PDU of pooled ops */
 };
 
+static struct att_send_op *alloc_pooled_op(uint16_t mtu)
+{
+	struct att_send_op *op;
+
+	op = malloc(sizeof(*op) + mtu);
+	if (!op)
+		return NULL;
+
+	memset(op, 0, sizeof(*op));
+	op->capacity = mtu;
+
+	return op;
+}
+
+static void free_att_send_op(void *data)
+{
+	struct att_send_op *op = data;
+
+	if (!op->pool)
+		free(op->pdu);
+
+	free(op);
+}
+
+static void release_pooled_op(struct bt_att *att, struct att_send_op *op)
+{
+	if (op->capacity != att->op_pool_mtu ||
+				att->op_pool_len == ATT_SEND_POOL_SIZE) {
+		free(op);
+		return;
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->capacity = att->op_pool_mtu;
+	att->op_pool[att->op_pool_len++] = op;
+}
+
 static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
@@ -206,10 +271,117 @@ static void destroy_att_send_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
+	if (op->pool) {
+		release_pooled_op(op->pool, op);
+		return;
+	}
+
 	free(op->pdu);
 	free(op);
 }
 
+/* Drops idle ops and refills the pool with ones that fit the current MTU. */
+static void fill_op_pool(struct bt_att *att)
+{
+	while (att->op_pool_len)
+		free(att->op_pool[--att->op_pool_len]);
+
+	att->op_pool_mtu = att->mtu;
+
+	while (att->op_pool_len < ATT_SEND_POOL_SIZE) {
+		struct att_send_op *op = alloc_pooled_op(att->op_pool_mtu);
+
+		if (!op)
+			break;
+
+		att->op_pool[att->op_pool_len++] = op;
+	}
+}
+
+static struct att_send_op *acquire_pooled_op(struct bt_att *att)
+{
+	struct att_send_op *op;
+
+	if (att->op_pool_len) {
+		att->alloc_stats.pool_hits++;
+		op = att->op_pool[--att->op_pool_len];
+	} else {
+		att->alloc_stats.op_allocs++;
+		op = alloc_pooled_op(att->op_pool_mtu);
+		if (!op)
+			return NULL;
+	}
+
+	op->pool = att;
+	op->pdu = op->storage;
+
+	return op;
+}
+
+/* The write queue is a ring, spilling into write_queue once it's full. New
+ * ops go to the overflow queue while it's non-empty so order is kept.
+ */
+static bool write_queue_push(struct bt_att *att, struct att_send_op *op)
+{
+	unsigned int tail;
+
+	if (att->write_ring_len == ATT_WRITE_RING_SIZE ||
+					!queue_isempty(att->write_queue)) {
+		att->alloc_stats.queue_allocs++;
+		return queue_push_tail(att->write_queue, op);
+	}
+
+	tail = (att->write_ring_head + att->write_ring_len) %
+							ATT_WRITE_RING_SIZE;
+	att->write_ring[tail] = op;
+	att->write_ring_len++;
+
+	return true;
+}
+
+static struct att_send_op *write_queue_pop(struct bt_att *att)
+{
+	struct att_send_op *op;
+
+	if (!att->write_ring_len)
+		return queue_pop_head(att->write_queue);
+
+	op = att->write_ring[att->write_ring_head];
+	att->write_ring_head = (att->write_ring_head + 1) % ATT_WRITE_RING_SIZE;
+	att->write_ring_len--;
+
+	return op;
+}
+
+/* Puts back an op that was just popped, ahead of everything else. */
+static void write_queue_unpop(struct bt_att *att, struct att_send_op *op)
+{
+	/* Can't happen: whatever was popped left room in the ring */
+	if (att->write_ring_len == ATT_WRITE_RING_SIZE) {
+		queue_push_head(att->write_queue, op);
+		return;
+	}
+
+	att->write_ring_head = (att->write_ring_head + ATT_WRITE_RING_SIZE - 1)
+							% ATT_WRITE_RING_SIZE;
+	att->write_ring[att->write_ring_head] = op;
+	att->write_ring_len++;
+}
+
+static bool write_queue_isempty(struct bt_att *att)
+{
+	return !att->write_ring_len && queue_isempty(att->write_queue);
+}
+
+static void write_queue_remove_all(struct bt_att *att,
+						queue_destroy_func_t destroy)
+{
+	struct att_send_op *op;
+
+	while ((op = write_queue_pop(att)))
+		destroy(op);
+}
+
 static void cancel_att_send_op(struct att_send_op *op)
 {
 	if (op->destroy)
@@ -289,7 +461,8 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 		return false;
 
 	op->len = pdu_len;
-	op->pdu = malloc(op->len);
+	if (!op->pool)
+		op->pdu = malloc(op->len);
 	if (!op->pdu)
 		return false;
 
@@ -311,7 +484,10 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 					"ATT unable to generate signature");
 
 fail:
-	free(op->pdu);
+	if (!op->pool) {
+		free(op->pdu);
+		op->pdu = NULL;
+	}
 	return false;
 }
 
@@ -335,9 +511,11 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 
 	/* If the opcode corresponds to an operation type that does not elicit a
 	 * response from the remote end, then no callback should have been
-	 * provided, since it will never be called.
+	 * provided, since it will never be called. Commands are the exception:
+	 * their callback reports the write itself (see send_batch).
 	 */
-	if (callback && type != ATT_OP_TYPE_REQ && type != ATT_OP_TYPE_IND)
+	if (callback && type != ATT_OP_TYPE_REQ && type != ATT_OP_TYPE_IND &&
+						type != ATT_OP_TYPE_CMD)
 		return NULL;
 
 	/* Similarly, if the operation does elicit a response then a callback
@@ -346,18 +524,30 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	if (!callback && (type == ATT_OP_TYPE_REQ || type == ATT_OP_TYPE_IND))
 		return NULL;
 
-	op = new0(struct att_send_op, 1);
+	if (type == ATT_OP_TYPE_CMD || type == ATT_OP_TYPE_NOT) {
+		op = acquire_pooled_op(att);
+		if (!op)
+			return NULL;
+	} else {
+		att->alloc_stats.op_allocs++;
+		op = new0(struct att_send_op, 1);
+	}
+
 	op->type = type;
 	op->opcode = opcode;
 	op->callback = callback;
-	op->destroy = destroy;
 	op->user_data = user_data;
+	op->trace_frame = trace_current();
+	op->trace_queued = op->trace_frame ? trace_now() : 0;
 
 	if (!encode_pdu(att, op, pdu, length)) {
-		free(op);
+		/* No destroy callback yet, so this only frees or recycles */
+		destroy_att_send_op(op);
 		return NULL;
 	}
 
+	op->destroy = destroy;
+
 	return op;
 }
 
@@ -366,7 +556,7 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	struct att_send_op *op;
 
 	/* See if any operations are already in the write queue */
-	op = queue_pop_head(att->write_queue);
+	op = write_queue_pop(att);
 	if (op)
 		return op;
 
@@ -439,11 +629,117 @@ static void write_watch_destroy(void *user_data)
 	att->writer_active = false;
 }
 
-static bool can_write_data(struct io *io, void *user_data)
+static void trace_sent(struct att_send_op *op, uint64_t start, uint64_t end)
+{
+	if (!op->trace_frame)
+		return;
+
+	trace_record(op->trace_frame, TRACE_STAGE_WRITE_QUEUE, op->trace_queued,
+									start);
+	trace_record(op->trace_frame, TRACE_STAGE_IO_SEND, start, end);
+}
+
+static bool is_batchable(struct att_send_op *op)
+{
+	return op->type == ATT_OP_TYPE_CMD || op->type == ATT_OP_TYPE_NOT;
+}
+
+/*
+ * Sends the run of commands and notifications at the front of the write
+ * queue with as few syscalls as possible, until the socket is full. Unsent
+ * ops go back to the front of the queue to wait for the next writable event.
+ */
+static void send_batch(struct bt_att *att, struct io *io)
+{
+	struct att_send_op *ops[ATT_SEND_BATCH];
+	struct iovec iov[ATT_SEND_BATCH];
+	struct att_send_op *op;
+	uint64_t start, end;
+	int count;
+	int sent;
+	int i;
+
+	while (true) {
+		count = 0;
+
+		while (count < ATT_SEND_BATCH) {
+			op = write_queue_pop(att);
+			if (!op)
+				break;
+
+			if (!is_batchable(op)) {
+				write_queue_unpop(att, op);
+				break;
+			}
+
+			ops[count] = op;
+			iov[count].iov_base = op->pdu;
+			iov[count].iov_len = op->len;
+			count++;
+		}
+
+		if (!count)
+			return;
+
+		start = trace_now();
+		sent = io_send_multiple(io, iov, count);
+		end = trace_now();
+		if (sent == -EAGAIN)
+			sent = 0;
+
+		if (sent < 0) {
+			util_debug(att->debug_callback, att->debug_data,
+					"write failed: %s", strerror(-sent));
+
+			/* Drop the op that failed, as a single send would */
+			for (i = count - 1; i > 0; i--)
+				write_queue_unpop(att, ops[i]);
+
+			destroy_att_send_op(ops[0]);
+			return;
+		}
+
+		/* Requeue first, in case a destroy callback queues more */
+		for (i = count - 1; i >= sent; i--)
+			write_queue_unpop(att, ops[i]);
+
+		for (i = 0; i < sent; i++) {
+			util_debug(att->debug_callback, att->debug_data,
+					"ATT op 0x%02x", ops[i]->opcode);
+
+			util_hexdump('<', ops[i]->pdu, ops[i]->len,
+					att->debug_callback, att->debug_data);
+
+			if (att->capture_callback)
+				att->capture_callback(true, ops[i]->pdu,
+							ops[i]->len,
+							att->capture_data);
+
+			trace_sent(ops[i], start, end);
+
+			/*
+			 * A command's callback, if any, gets its own opcode once
+			 * it is on the socket. One dropped unsent is destroyed
+			 * without that, or gets an error on disconnect.
+			 */
+			if (ops[i]->callback)
+				ops[i]->callback(ops[i]->opcode, NULL, 0,
+							ops[i]->user_data);
+
+			destroy_att_send_op(ops[i]);
+		}
+
+		if (sent < count)
+			return;
+	}
+}
+
+static bool write_next_op(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
 	struct att_send_op *op;
 	struct timeout_data *timeout;
+	uint64_t start;
 	ssize_t ret;
 	struct iovec iov;
 
@@ -451,9 +747,17 @@ static bool can_write_data(struct io *io, void *user_data)
 	if (!op)
 		return false;
 
+	/* Commands only ever come from the write queue */
+	if (is_batchable(op)) {
+		write_queue_unpop(att, op);
+		send_batch(att, io);
+		return true;
+	}
+
 	iov.iov_base = op->pdu;
 	iov.iov_len = op->len;
 
+	start = trace_now();
 	ret = io_send(io, &iov, 1);
 	if (ret < 0) {
 		util_debug(att->debug_callback, att->debug_data,
@@ -471,6 +775,11 @@ static bool can_write_data(struct io *io, void *user_data)
 
 	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
 
+	if (att->capture_callback)
+		att->capture_callback(true, op->pdu, ret, att->capture_data);
+
+	trace_sent(op, start, trace_now());
+
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
 	 * no need to keep it around.
@@ -505,6 +814,17 @@ static bool can_write_data(struct io *io, void *user_data)
 	return true;
 }
 
+static bool can_write_data(struct io *io, void *user_data)
+{
+	bool ret;
+
+	PROFILE_BEGIN("can_write_data");
+	ret = write_next_op(io, user_data);
+	PROFILE_END();
+
+	return ret;
+}
+
 static void wakeup_writer(struct bt_att *att)
 {
 	if (att->writer_active)
@@ -513,7 +833,7 @@ static void wakeup_writer(struct bt_att *att)
 	/* Set the write handler only if there is anything that can be sent
 	 * at all.
 	 */
-	if (queue_isempty(att->write_queue)) {
+	if (write_queue_isempty(att)) {
 		if ((att->pending_req || queue_isempty(att->req_queue)) &&
 			(att->pending_ind || queue_isempty(att->ind_queue)))
 			return;
@@ -573,7 +893,7 @@ static bool disconnect_cb(struct io *io, void *user_data)
 	/* Notify request callbacks */
 	queue_remove_all(att->req_queue, NULL, NULL, disc_att_send_op);
 	queue_remove_all(att->ind_queue, NULL, NULL, disc_att_send_op);
-	queue_remove_all(att->write_queue, NULL, NULL, disc_att_send_op);
+	write_queue_remove_all(att, disc_att_send_op);
 
 	if (att->pending_req) {
 		disc_att_send_op(att->pending_req);
@@ -856,13 +1176,18 @@ static bool can_read_data(struct io *io, void *user_data)
 	uint8_t *pdu;
 	ssize_t bytes_read;
 
+	/* Drained, which leaves errno at EAGAIN for the loop to see */
 	bytes_read = read(att->fd, att->buf, att->mtu);
 	if (bytes_read < 0)
-		return false;
+		return errno == EAGAIN;
 
 	util_hexdump('>', att->buf, bytes_read,
 					att->debug_callback, att->debug_data);
 
+	if (att->capture_callback)
+		att->capture_callback(false, att->buf, bytes_read,
+							att->capture_data);
+
 	if (bytes_read < ATT_MIN_PDU_LEN)
 		return true;
 
@@ -959,6 +1284,8 @@ static void bt_att_free(struct bt_att *att)
 
 	queue_destroy(att->req_queue, NULL);
 	queue_destroy(att->ind_queue, NULL);
+	if (att->write_queue)
+		write_queue_remove_all(att, free_att_send_op);
 	queue_destroy(att->write_queue, NULL);
 	queue_destroy(att->notify_list, NULL);
 	queue_destroy(att->disconn_list, NULL);
@@ -969,9 +1296,15 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
+	if (att->capture_destroy)
+		att->capture_destroy(att->capture_data);
+
 	free(att->local_sign);
 	free(att->remote_sign);
 
+	while (att->op_pool_len)
+		free(att->op_pool[--att->op_pool_len]);
+
 	free(att->buf);
 
 	free(att);
@@ -1035,6 +1368,8 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	if (!att->buf)
 		goto fail;
 
+	fill_op_pool(att);
+
 	return bt_att_ref(att);
 
 fail:
@@ -1099,6 +1434,33 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 	return true;
 }
 
+bool bt_att_set_capture(struct bt_att *att, bt_att_capture_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy)
+{
+	if (!att)
+		return false;
+
+	if (att->capture_destroy)
+		att->capture_destroy(att->capture_data);
+
+	att->capture_callback = callback;
+	att->capture_destroy = destroy;
+	att->capture_data = user_data;
+
+	return true;
+}
+
+bool bt_att_get_alloc_stats(struct bt_att *att,
+					struct bt_att_alloc_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->alloc_stats;
+
+	return true;
+}
+
 uint16_t bt_att_get_mtu(struct bt_att *att)
 {
 	if (!att)
@@ -1126,6 +1488,8 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 	att->mtu = mtu;
 	att->buf = buf;
 
+	fill_op_pool(att);
+
 	return true;
 }
 
@@ -1247,13 +1611,13 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	case ATT_OP_TYPE_RSP:
 	case ATT_OP_TYPE_CONF:
 	default:
-		result = queue_push_tail(att->write_queue, op);
+		result = write_queue_push(att, op);
 		break;
 	}
 
 	if (!result) {
-		free(op->pdu);
-		free(op);
+		op->destroy = NULL;
+		destroy_att_send_op(op);
 		return 0;
 	}
 
@@ -1270,6 +1634,32 @@ static bool match_op_id(const void *a, const void *b)
 	return op->id == id;
 }
 
+static struct att_send_op *write_queue_remove_id(struct bt_att *att,
+							unsigned int id)
+{
+	struct att_send_op *op;
+	unsigned int i, j;
+
+	for (i = 0; i < att->write_ring_len; i++) {
+		op = att->write_ring[(att->write_ring_head + i) %
+							ATT_WRITE_RING_SIZE];
+		if (op->id != id)
+			continue;
+
+		/* Close the gap by shifting the later entries forward */
+		for (j = i; j + 1 < att->write_ring_len; j++)
+			att->write_ring[(att->write_ring_head + j) %
+							ATT_WRITE_RING_SIZE] =
+				att->write_ring[(att->write_ring_head + j + 1) %
+							ATT_WRITE_RING_SIZE];
+
+		att->write_ring_len--;
+		return op;
+	}
+
+	return queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
+}
+
 bool bt_att_cancel(struct bt_att *att, unsigned int id)
 {
 	struct att_send_op *op;
@@ -1297,7 +1687,7 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 	if (op)
 		goto done;
 
-	op = queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
+	op = write_queue_remove_id(att, id);
 	if (op)
 		goto done;
 
@@ -1319,7 +1709,7 @@ bool bt_att_cancel_all(struct bt_att *att)
 
 	queue_remove_all(att->req_queue, NULL, NULL, destroy_att_send_op);
 	queue_remove_all(att->ind_queue, NULL, NULL, destroy_att_send_op);
-	queue_remove_all(att->write_queue, NULL, NULL, destroy_att_send_op);
+	write_queue_remove_all(att, destroy_att_send_op);
 
 	if (att->pending_req)
 		/* Don't cancel the pending request; remove it's handlers */
@@ -47,10 +47,25 @@ typedef void (*bt_att_timeout_func_t)(unsigned int id, uint8_t opcode,
 							void *user_data);
 typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
 typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
+typedef void (*bt_att_capture_func_t)(bool sent, const void *pdu,
+					uint16_t length, void *user_data);
 
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
+/* Called with every PDU written to or read from the bearer. */
+bool bt_att_set_capture(struct bt_att *att, bt_att_capture_func_t callback,
+				void *user_data, bt_att_destroy_func_t destroy);
+
+struct bt_att_alloc_stats {
+	unsigned long op_allocs;	/* Send ops allocated from the heap */
+	unsigned long pool_hits;	/* Send ops reused from the pool */
+	unsigned long queue_allocs;	/* Writes that overflowed the ring */
+};
+
+bool bt_att_get_alloc_stats(struct bt_att *att,
+					struct bt_att_alloc_stats *stats);
+
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 uint8_t bt_att_get_link_type(struct bt_att *att);
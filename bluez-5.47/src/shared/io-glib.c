@@ -26,11 +26,16 @@
 #endif
 
 #include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
 
 #include <glib.h>
 
 #include "src/shared/io.h"
 
+/* Messages per sendmmsg call */
+#define IO_SEND_BATCH 32
+
 struct io_watch {
 	struct io *io;
 	guint id;
@@ -280,6 +285,64 @@ ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt)
 	return ret;
 }
 
+int io_send_multiple(struct io *io, const struct iovec *iov, int count)
+{
+	struct mmsghdr msgs[IO_SEND_BATCH];
+	int fd;
+	int sent = 0;
+	int batch;
+	int ret;
+	int i;
+
+	if (!io || !io->channel)
+		return -ENOTCONN;
+
+	fd = io_get_fd(io);
+
+	while (sent < count) {
+		batch = MIN(count - sent, IO_SEND_BATCH);
+		memset(msgs, 0, sizeof(msgs[0]) * batch);
+
+		for (i = 0; i < batch; i++) {
+			msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[sent + i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		do {
+			ret = sendmmsg(fd, msgs, batch,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0 && errno == ENOTSOCK) {
+			/* Not a socket, so the batch goes out as one writev */
+			ret = io_send(io, &iov[sent], batch);
+			if (ret < 0)
+				return sent ? sent : ret;
+
+			/* One cut short counts, as resending would repeat it */
+			for (i = 0; i < batch && ret > 0; i++)
+				ret -= iov[sent + i].iov_len;
+
+			sent += i;
+			if (i < batch)
+				break;
+			continue;
+		}
+
+		if (ret < 0) {
+			if (errno == EWOULDBLOCK)
+				errno = EAGAIN;
+			return sent ? sent : -errno;
+		}
+
+		sent += ret;
+		if (ret < batch)
+			break;
+	}
+
+	return sent;
+}
+
 bool io_shutdown(struct io *io)
 {
 	if (!io || !io->channel)
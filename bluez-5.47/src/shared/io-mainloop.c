@@ -0,0 +1,411 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012-2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "src/shared/mainloop.h"
+#include "src/shared/util.h"
+#include "src/shared/io.h"
+
+/* Messages per sendmmsg call */
+#define IO_SEND_BATCH 32
+
+/* Callbacks run back to back for one edge before yielding to other fds */
+#define IO_BUDGET 16
+
+/*
+ * Descriptors are registered edge-triggered, so an event only arrives when
+ * an fd becomes readable or writable. A callback that wants to run again
+ * is called again straight away until it leaves errno at EAGAIN, which it
+ * does by returning true right after its read or write would have blocked,
+ * or until it has run IO_BUDGET times, after which the registration is
+ * re-armed so the next epoll_wait picks it up.
+ */
+#define IO_EPOLL_FLAGS (EPOLLET)
+
+struct io {
+	int ref_count;
+	int fd;
+	uint32_t events;
+	bool close_on_destroy;
+	io_callback_func_t read_callback;
+	io_destroy_func_t read_destroy;
+	void *read_data;
+	io_callback_func_t write_callback;
+	io_destroy_func_t write_destroy;
+	void *write_data;
+	io_callback_func_t disconnect_callback;
+	io_destroy_func_t disconnect_destroy;
+	void *disconnect_data;
+};
+
+static struct io *io_ref(struct io *io)
+{
+	if (!io)
+		return NULL;
+
+	__sync_fetch_and_add(&io->ref_count, 1);
+
+	return io;
+}
+
+static void io_unref(struct io *io)
+{
+	if (!io)
+		return;
+
+	if (__sync_sub_and_fetch(&io->ref_count, 1))
+		return;
+
+	free(io);
+}
+
+static void io_cleanup(void *user_data)
+{
+	struct io *io = user_data;
+
+	if (io->write_destroy)
+		io->write_destroy(io->write_data);
+
+	if (io->read_destroy)
+		io->read_destroy(io->read_data);
+
+	if (io->disconnect_destroy)
+		io->disconnect_destroy(io->disconnect_data);
+
+	if (io->close_on_destroy)
+		close(io->fd);
+
+	io->fd = -1;
+
+	io_unref(io);
+}
+
+static void clear_handler(struct io *io, uint32_t event,
+				io_callback_func_t *callback,
+				io_destroy_func_t *destroy, void **data)
+{
+	if (*destroy)
+		(*destroy)(*data);
+
+	*callback = NULL;
+	*destroy = NULL;
+	*data = NULL;
+
+	io->events &= ~event;
+	mainloop_modify_fd(io->fd, io->events);
+}
+
+/* Returns true if the handler still wants events but ran out of budget. */
+static bool run_handler(struct io *io, uint32_t event,
+				io_callback_func_t *callback,
+				io_destroy_func_t *destroy, void **data)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_BUDGET; i++) {
+		if (!*callback || io->fd < 0)
+			return false;
+
+		errno = 0;
+
+		if (!(*callback)(io, *data)) {
+			clear_handler(io, event, callback, destroy, data);
+			return false;
+		}
+
+		/* Drained; the next edge will wake us */
+		if (errno == EAGAIN)
+			return false;
+	}
+
+	return true;
+}
+
+static void io_callback(int fd, uint32_t events, void *user_data)
+{
+	struct io *io = user_data;
+	bool rearm = false;
+
+	io_ref(io);
+
+	if ((events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		io->read_callback = NULL;
+		io->write_callback = NULL;
+
+		if (!io->disconnect_callback) {
+			mainloop_remove_fd(io->fd);
+			io_unref(io);
+			return;
+		}
+
+		if (!io->disconnect_callback(io, io->disconnect_data)) {
+			if (io->disconnect_destroy)
+				io->disconnect_destroy(io->disconnect_data);
+
+			io->disconnect_callback = NULL;
+			io->disconnect_destroy = NULL;
+			io->disconnect_data = NULL;
+
+			io->events &= ~EPOLLRDHUP;
+			mainloop_modify_fd(io->fd, io->events);
+		}
+	}
+
+	if ((events & EPOLLIN) && run_handler(io, EPOLLIN,
+					&io->read_callback, &io->read_destroy,
+					&io->read_data))
+		rearm = true;
+
+	if ((events & EPOLLOUT) && run_handler(io, EPOLLOUT,
+					&io->write_callback, &io->write_destroy,
+					&io->write_data))
+		rearm = true;
+
+	if (rearm && io->fd >= 0)
+		mainloop_modify_fd(io->fd, io->events);
+
+	io_unref(io);
+}
+
+struct io *io_new(int fd)
+{
+	struct io *io;
+
+	if (fd < 0)
+		return NULL;
+
+	io = new0(struct io, 1);
+	if (!io)
+		return NULL;
+
+	io->fd = fd;
+	io->events = IO_EPOLL_FLAGS;
+	io->close_on_destroy = false;
+
+	if (mainloop_add_fd(io->fd, io->events, io_callback,
+						io, io_cleanup) < 0) {
+		free(io);
+		return NULL;
+	}
+
+	return io_ref(io);
+}
+
+void io_destroy(struct io *io)
+{
+	if (!io)
+		return;
+
+	mainloop_lock();
+
+	io->read_callback = NULL;
+	io->write_callback = NULL;
+	io->disconnect_callback = NULL;
+
+	mainloop_remove_fd(io->fd);
+
+	mainloop_unlock();
+
+	io_unref(io);
+}
+
+int io_get_fd(struct io *io)
+{
+	if (!io)
+		return -ENOTCONN;
+
+	return io->fd;
+}
+
+bool io_set_close_on_destroy(struct io *io, bool do_close)
+{
+	if (!io)
+		return false;
+
+	io->close_on_destroy = do_close;
+
+	return true;
+}
+
+static bool io_set_handler(struct io *io, uint32_t event,
+				io_callback_func_t callback, void *user_data,
+				io_destroy_func_t destroy,
+				io_callback_func_t *cur_callback,
+				io_destroy_func_t *cur_destroy, void **cur_data)
+{
+	uint32_t events;
+	bool result = true;
+
+	if (!io || io->fd < 0)
+		return false;
+
+	/* Usually called from the loop thread, but writers may be elsewhere */
+	mainloop_lock();
+
+	if (*cur_destroy)
+		(*cur_destroy)(*cur_data);
+
+	if (callback)
+		events = io->events | event;
+	else
+		events = io->events & ~event;
+
+	*cur_callback = callback;
+	*cur_destroy = destroy;
+	*cur_data = user_data;
+
+	/* Modifying also re-arms the edge for fds that are already ready */
+	if (events != io->events || callback) {
+		if (mainloop_modify_fd(io->fd, events) < 0)
+			result = false;
+		else
+			io->events = events;
+	}
+
+	mainloop_unlock();
+
+	return result;
+}
+
+bool io_set_read_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, EPOLLIN, callback, user_data, destroy,
+				&io->read_callback, &io->read_destroy,
+				&io->read_data);
+}
+
+bool io_set_write_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, EPOLLOUT, callback, user_data, destroy,
+				&io->write_callback, &io->write_destroy,
+				&io->write_data);
+}
+
+bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, EPOLLRDHUP, callback, user_data, destroy,
+				&io->disconnect_callback,
+				&io->disconnect_destroy,
+				&io->disconnect_data);
+}
+
+ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	if (!io || io->fd < 0)
+		return -ENOTCONN;
+
+	do {
+		ret = writev(io->fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+int io_send_multiple(struct io *io, const struct iovec *iov, int count)
+{
+	struct mmsghdr msgs[IO_SEND_BATCH];
+	int sent = 0;
+	int batch;
+	int ret;
+	int i;
+
+	if (!io || io->fd < 0)
+		return -ENOTCONN;
+
+	while (sent < count) {
+		batch = count - sent < IO_SEND_BATCH ?
+						count - sent : IO_SEND_BATCH;
+		memset(msgs, 0, sizeof(msgs[0]) * batch);
+
+		for (i = 0; i < batch; i++) {
+			msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[sent + i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		do {
+			ret = sendmmsg(io->fd, msgs, batch,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0 && errno == ENOTSOCK) {
+			/* Not a socket, so the batch goes out as one writev */
+			ret = io_send(io, &iov[sent], batch);
+			if (ret < 0)
+				return sent ? sent : ret;
+
+			/* One cut short counts, as resending would repeat it */
+			for (i = 0; i < batch && ret > 0; i++)
+				ret -= iov[sent + i].iov_len;
+
+			sent += i;
+			if (i < batch)
+				break;
+			continue;
+		}
+
+		if (ret < 0) {
+			if (errno == EWOULDBLOCK)
+				errno = EAGAIN;
+			return sent ? sent : -errno;
+		}
+
+		sent += ret;
+		if (ret < batch)
+			break;
+	}
+
+	return sent;
+}
+
+bool io_shutdown(struct io *io)
+{
+	if (!io || io->fd < 0)
+		return false;
+
+	return shutdown(io->fd, SHUT_RDWR) == 0;
+}
@@ -35,6 +35,11 @@ int io_get_fd(struct io *io);
 bool io_set_close_on_destroy(struct io *io, bool do_close);
 
 ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt);
+/* Sends each iovec as its own message without blocking, or all of them in
+ * one writev if the fd isn't a socket. Returns how many were sent, or a
+ * negative errno (-EAGAIN if the socket is full) if none.
+ */
+int io_send_multiple(struct io *io, const struct iovec *iov, int count);
 bool io_shutdown(struct io *io);
 
 typedef bool (*io_callback_func_t)(struct io *io, void *user_data);
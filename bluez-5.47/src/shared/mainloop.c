@@ -0,0 +1,512 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012-2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "src/shared/util.h"
+#include "src/shared/mainloop.h"
+
+#define MAX_EPOLL_EVENTS 10
+
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static volatile int epoll_terminate;
+static int exit_status;
+
+static pthread_mutex_t loop_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct mainloop_data {
+	int fd;
+	uint32_t events;
+	bool removed;
+	mainloop_event_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+	struct mainloop_data *next_removed;
+};
+
+/* Indexed by fd, grown as needed */
+static struct mainloop_data **mainloop_list;
+static unsigned int mainloop_list_size;
+
+/* Removed entries, kept until their events can no longer be dispatched */
+static struct mainloop_data *removed_list;
+
+struct timeout_data {
+	int fd;
+	mainloop_timeout_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+struct signal_data {
+	int fd;
+	sigset_t mask;
+	mainloop_signal_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+static struct signal_data *signal_data;
+
+void mainloop_lock(void)
+{
+	pthread_mutex_lock(&loop_lock);
+}
+
+void mainloop_unlock(void)
+{
+	pthread_mutex_unlock(&loop_lock);
+}
+
+static void wakeup_callback(int fd, uint32_t events, void *user_data)
+{
+	uint64_t value;
+
+	if (read(fd, &value, sizeof(value)) < 0)
+		return;
+}
+
+void mainloop_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	epoll_terminate = 0;
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd >= 0)
+		mainloop_add_fd(wakeup_fd, EPOLLIN, wakeup_callback,
+								NULL, NULL);
+}
+
+void mainloop_quit(void)
+{
+	uint64_t value = 1;
+
+	epoll_terminate = 1;
+
+	/* May be called from another thread while the loop is waiting */
+	if (wakeup_fd >= 0 && write(wakeup_fd, &value, sizeof(value)) < 0)
+		return;
+}
+
+void mainloop_exit_success(void)
+{
+	exit_status = EXIT_SUCCESS;
+	mainloop_quit();
+}
+
+void mainloop_exit_failure(void)
+{
+	exit_status = EXIT_FAILURE;
+	mainloop_quit();
+}
+
+static void signal_callback(int fd, uint32_t events, void *user_data)
+{
+	struct signal_data *data = user_data;
+	struct signalfd_siginfo si;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		mainloop_quit();
+		return;
+	}
+
+	result = read(fd, &si, sizeof(si));
+	if (result != sizeof(si))
+		return;
+
+	if (data->callback)
+		data->callback(si.ssi_signo, data->user_data);
+}
+
+static void free_removed(void)
+{
+	struct mainloop_data *data;
+
+	while (removed_list) {
+		data = removed_list;
+		removed_list = data->next_removed;
+		free(data);
+	}
+}
+
+int mainloop_run(void)
+{
+	unsigned int i;
+
+	if (signal_data) {
+		if (sigprocmask(SIG_BLOCK, &signal_data->mask, NULL) < 0)
+			return EXIT_FAILURE;
+
+		signal_data->fd = signalfd(-1, &signal_data->mask,
+						SFD_NONBLOCK | SFD_CLOEXEC);
+		if (signal_data->fd < 0)
+			return EXIT_FAILURE;
+
+		if (mainloop_add_fd(signal_data->fd, EPOLLIN,
+				signal_callback, signal_data, NULL) < 0) {
+			close(signal_data->fd);
+			return EXIT_FAILURE;
+		}
+	}
+
+	exit_status = EXIT_SUCCESS;
+
+	while (!epoll_terminate) {
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+		int n, nfds;
+
+		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nfds < 0)
+			continue;
+
+		mainloop_lock();
+
+		for (n = 0; n < nfds; n++) {
+			struct mainloop_data *data = events[n].data.ptr;
+
+			if (data->removed)
+				continue;
+
+			data->callback(data->fd, events[n].events,
+							data->user_data);
+		}
+
+		free_removed();
+
+		mainloop_unlock();
+	}
+
+	mainloop_lock();
+
+	if (signal_data) {
+		mainloop_remove_fd(signal_data->fd);
+		close(signal_data->fd);
+
+		if (signal_data->destroy)
+			signal_data->destroy(signal_data->user_data);
+
+		free(signal_data);
+		signal_data = NULL;
+	}
+
+	for (i = 0; i < mainloop_list_size; i++) {
+		if (mainloop_list[i])
+			mainloop_remove_fd(i);
+	}
+
+	free_removed();
+
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_list_size = 0;
+
+	if (wakeup_fd >= 0) {
+		close(wakeup_fd);
+		wakeup_fd = -1;
+	}
+
+	close(epoll_fd);
+	epoll_fd = -1;
+
+	mainloop_unlock();
+
+	return exit_status;
+}
+
+static bool grow_list(unsigned int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size = mainloop_list_size ? mainloop_list_size : 64;
+
+	while (size <= fd)
+		size *= 2;
+
+	if (size == mainloop_list_size)
+		return true;
+
+	list = realloc(mainloop_list, size * sizeof(*list));
+	if (!list)
+		return false;
+
+	memset(list + mainloop_list_size, 0,
+			(size - mainloop_list_size) * sizeof(*list));
+
+	mainloop_list = list;
+	mainloop_list_size = size;
+
+	return true;
+}
+
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err = 0;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	mainloop_lock();
+
+	if (!grow_list(fd)) {
+		err = -ENOMEM;
+		goto done;
+	}
+
+	if (mainloop_list[fd]) {
+		err = -EEXIST;
+		goto done;
+	}
+
+	data = new0(struct mainloop_data, 1);
+	data->fd = fd;
+	data->events = events;
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev) < 0) {
+		err = -errno;
+		free(data);
+		goto done;
+	}
+
+	mainloop_list[fd] = data;
+
+done:
+	mainloop_unlock();
+	return err;
+}
+
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err = 0;
+
+	if (fd < 0)
+		return -EINVAL;
+
+	mainloop_lock();
+
+	if ((unsigned int) fd >= mainloop_list_size || !mainloop_list[fd]) {
+		err = -ENXIO;
+		goto done;
+	}
+
+	data = mainloop_list[fd];
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	/* With EPOLLET this also re-arms: a still-ready fd fires again */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	data->events = events;
+
+done:
+	mainloop_unlock();
+	return err;
+}
+
+int mainloop_remove_fd(int fd)
+{
+	struct mainloop_data *data;
+	int err = 0;
+
+	if (fd < 0)
+		return -EINVAL;
+
+	mainloop_lock();
+
+	if ((unsigned int) fd >= mainloop_list_size || !mainloop_list[fd]) {
+		err = -ENXIO;
+		goto done;
+	}
+
+	data = mainloop_list[fd];
+	mainloop_list[fd] = NULL;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL) < 0)
+		err = -errno;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	/* An event for it may still be in the batch being dispatched, so the
+	 * entry itself is only freed after the batch.
+	 */
+	data->removed = true;
+	data->next_removed = removed_list;
+	removed_list = data;
+
+done:
+	mainloop_unlock();
+	return err;
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	close(data->fd);
+	data->fd = -1;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static void timeout_callback(int fd, uint32_t events, void *user_data)
+{
+	struct timeout_data *data = user_data;
+	uint64_t expired;
+	ssize_t result;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	result = read(data->fd, &expired, sizeof(expired));
+	if (result != sizeof(expired))
+		return;
+
+	if (data->callback)
+		data->callback(data->fd, data->user_data);
+}
+
+static inline int timeout_set(int fd, unsigned int msec)
+{
+	struct itimerspec itimer;
+	unsigned int sec = msec / 1000;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_interval.tv_sec = 0;
+	itimer.it_interval.tv_nsec = 0;
+	itimer.it_value.tv_sec = sec;
+	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
+
+	return timerfd_settime(fd, 0, &itimer, NULL);
+}
+
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct timeout_data *data;
+
+	if (!callback)
+		return -EINVAL;
+
+	data = new0(struct timeout_data, 1);
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->fd < 0) {
+		free(data);
+		return -EIO;
+	}
+
+	if (msec > 0) {
+		if (timeout_set(data->fd, msec) < 0) {
+			close(data->fd);
+			free(data);
+			return -EIO;
+		}
+	}
+
+	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
+				timeout_callback, data, timeout_destroy) < 0) {
+		close(data->fd);
+		free(data);
+		return -EIO;
+	}
+
+	return data->fd;
+}
+
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	if (msec > 0) {
+		if (timeout_set(id, msec) < 0)
+			return -EIO;
+	}
+
+	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+int mainloop_remove_timeout(int id)
+{
+	return mainloop_remove_fd(id);
+}
+
+int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct signal_data *data;
+
+	if (!mask || !callback)
+		return -EINVAL;
+
+	data = new0(struct signal_data, 1);
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	data->fd = -1;
+	memcpy(&data->mask, mask, sizeof(sigset_t));
+
+	free(signal_data);
+	signal_data = data;
+
+	return 0;
+}
@@ -49,3 +49,10 @@ int mainloop_remove_timeout(int id);
 
 int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
 				void *user_data, mainloop_destroy_func destroy);
+
+/* Callbacks run with this held. Other threads take it before touching
+ * anything the loop thread uses. It's recursive, so callbacks may call back
+ * into the mainloop.
+ */
+void mainloop_lock(void);
+void mainloop_unlock(void);
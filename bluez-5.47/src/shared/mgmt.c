@@ -321,9 +321,10 @@ static bool can_read_data(struct io *io, void *user_data)
 	ssize_t bytes_read;
 	uint16_t opcode, event, index, length;
 
+	/* Drained, which leaves errno at EAGAIN for the loop to see */
 	bytes_read = read(mgmt->fd, mgmt->buf, mgmt->len);
 	if (bytes_read < 0)
-		return false;
+		return errno == EAGAIN;
 
 	util_hexdump('>', mgmt->buf, bytes_read,
 				mgmt->debug_callback, mgmt->debug_data);
@@ -0,0 +1,38 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#include <stdint.h>
+
+/*
+ * Scope timing hooks. The application provides these (Profiler.cpp) so the
+ * hot paths in here land in the same per-thread histograms as its own.
+ * Each PROFILE_BEGIN site registers its name on first use and keeps the id.
+ */
+
+unsigned int profile_register(const char *name);
+uint64_t profile_now(void);
+void profile_record(unsigned int scope, uint64_t start);
+
+#define PROFILE_BEGIN(name)						\
+	static unsigned int profile_scope__;				\
+	uint64_t profile_start__ = profile_now();			\
+	if (!__atomic_load_n(&profile_scope__, __ATOMIC_RELAXED))	\
+		__atomic_store_n(&profile_scope__, profile_register(name),	\
+							__ATOMIC_RELAXED)
+
+#define PROFILE_END()							\
+	profile_record(__atomic_load_n(&profile_scope__, __ATOMIC_RELAXED), \
+							profile_start__)
@@ -0,0 +1,564 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "src/shared/util.h"
+#include "src/shared/io.h"
+#include "src/shared/timer-wheel.h"
+
+/*
+ * Four levels of 64 slots. Level n holds timers due between 64^n and
+ * 64^(n+1) ticks from now, and each slot of a level above 0 is cascaded
+ * into the levels below when the wheel reaches it. Anything further away
+ * than the top level covers (about 4.6 hours) is parked in its last slot
+ * and cascaded again until it comes into range.
+ */
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+#define WHEEL_RANGE		((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define TIMER_NONE		UINT32_MAX
+#define TIMER_INDEX_BITS	20
+#define TIMER_INDEX_MASK	((1U << TIMER_INDEX_BITS) - 1)
+#define TIMER_MAX		TIMER_INDEX_MASK
+#define TICK_NEVER		UINT64_MAX
+
+enum timer_state {
+	TIMER_FREE,
+	TIMER_QUEUED,
+	TIMER_RUNNING,
+	TIMER_CANCELLED,
+};
+
+struct wheel_timer {
+	uint32_t next;
+	uint32_t prev;
+	uint64_t expires;
+	unsigned int interval;
+	timeout_func_t func;
+	timeout_destroy_func_t destroy;
+	void *user_data;
+	uint16_t generation;
+	uint8_t level;
+	uint8_t slot;
+	uint8_t state;
+};
+
+struct timer_wheel {
+	pthread_mutex_t lock;
+	int fd;
+	struct io *io;
+	struct timespec epoch;
+	uint64_t now;
+	uint64_t armed;
+	uint32_t slots[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wheel_timer *timers;
+	uint32_t capacity;
+	uint32_t free_list;
+	unsigned int count;
+};
+
+static struct timer_wheel *default_wheel;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static uint64_t current_tick(struct timer_wheel *wheel)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t) (ts.tv_sec - wheel->epoch.tv_sec) * 1000000000 +
+				ts.tv_nsec - wheel->epoch.tv_nsec) / 1000000;
+}
+
+static unsigned int timer_id(struct timer_wheel *wheel, uint32_t index)
+{
+	unsigned int generation = wheel->timers[index].generation;
+
+	return (generation << TIMER_INDEX_BITS) | (index + 1);
+}
+
+static struct wheel_timer *find_timer(struct timer_wheel *wheel,
+					unsigned int id, uint32_t *index)
+{
+	struct wheel_timer *timer;
+	uint32_t i = (id & TIMER_INDEX_MASK) - 1;
+
+	if (!id || i >= wheel->capacity)
+		return NULL;
+
+	timer = &wheel->timers[i];
+	if (timer->state == TIMER_FREE ||
+			timer->generation != id >> TIMER_INDEX_BITS)
+		return NULL;
+
+	*index = i;
+	return timer;
+}
+
+static bool grow_timers(struct timer_wheel *wheel)
+{
+	struct wheel_timer *timers;
+	uint32_t capacity, i;
+
+	if (wheel->capacity >= TIMER_MAX)
+		return false;
+
+	capacity = wheel->capacity ? wheel->capacity * 2 : 64;
+	if (capacity > TIMER_MAX)
+		capacity = TIMER_MAX;
+
+	timers = realloc(wheel->timers, capacity * sizeof(*timers));
+	if (!timers)
+		return false;
+
+	memset(timers + wheel->capacity, 0,
+			(capacity - wheel->capacity) * sizeof(*timers));
+
+	for (i = capacity; i-- > wheel->capacity;) {
+		timers[i].next = wheel->free_list;
+		wheel->free_list = i;
+	}
+
+	wheel->timers = timers;
+	wheel->capacity = capacity;
+
+	return true;
+}
+
+static uint32_t alloc_timer(struct timer_wheel *wheel)
+{
+	uint32_t index;
+
+	if (wheel->free_list == TIMER_NONE && !grow_timers(wheel))
+		return TIMER_NONE;
+
+	index = wheel->free_list;
+	wheel->free_list = wheel->timers[index].next;
+	wheel->count++;
+
+	return index;
+}
+
+static void release_timer(struct timer_wheel *wheel, uint32_t index)
+{
+	struct wheel_timer *timer = &wheel->timers[index];
+
+	timer->state = TIMER_FREE;
+	timer->func = NULL;
+	timer->destroy = NULL;
+	timer->user_data = NULL;
+	/* Stale ids stop matching once the slot is reused */
+	timer->generation = (timer->generation + 1) &
+					((1U << (32 - TIMER_INDEX_BITS)) - 1);
+	timer->next = wheel->free_list;
+	wheel->free_list = index;
+	wheel->count--;
+}
+
+static void link_timer(struct timer_wheel *wheel, uint32_t index)
+{
+	struct wheel_timer *timer = &wheel->timers[index];
+	uint64_t expires = timer->expires;
+	uint64_t delta = expires - wheel->now;
+	unsigned int level;
+	uint32_t *head;
+
+	if (delta > WHEEL_RANGE)
+		expires = wheel->now + WHEEL_RANGE;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < UINT64_C(1) << (WHEEL_BITS * (level + 1)))
+			break;
+
+	timer->level = level;
+	timer->slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	head = &wheel->slots[level][timer->slot];
+	timer->prev = TIMER_NONE;
+	timer->next = *head;
+	if (*head != TIMER_NONE)
+		wheel->timers[*head].prev = index;
+	*head = index;
+
+	wheel->occupied[level] |= UINT64_C(1) << timer->slot;
+}
+
+static void unlink_timer(struct timer_wheel *wheel, uint32_t index)
+{
+	struct wheel_timer *timer = &wheel->timers[index];
+	uint32_t *head = &wheel->slots[timer->level][timer->slot];
+
+	if (timer->prev != TIMER_NONE)
+		wheel->timers[timer->prev].next = timer->next;
+	else
+		*head = timer->next;
+
+	if (timer->next != TIMER_NONE)
+		wheel->timers[timer->next].prev = timer->prev;
+
+	if (*head == TIMER_NONE)
+		wheel->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+}
+
+/* The tick at which the wheel next visits a slot after the current one */
+static uint64_t slot_tick(uint64_t now, unsigned int level, unsigned int slot)
+{
+	unsigned int shift = WHEEL_BITS * level;
+	uint64_t base = (now >> shift) + 1;
+
+	return (base + ((slot - base) & WHEEL_MASK)) << shift;
+}
+
+static uint64_t next_event(struct timer_wheel *wheel)
+{
+	uint64_t next = TICK_NEVER;
+	unsigned int level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		uint64_t bits = wheel->occupied[level];
+		unsigned int shift = WHEEL_BITS * level;
+		unsigned int start, slot;
+		uint64_t tick;
+
+		if (!bits)
+			continue;
+
+		start = ((wheel->now >> shift) + 1) & WHEEL_MASK;
+		if (start)
+			bits = (bits >> start) | (bits << (WHEEL_SIZE - start));
+		slot = (start + __builtin_ctzll(bits)) & WHEEL_MASK;
+
+		tick = slot_tick(wheel->now, level, slot);
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+static void arm_timerfd(struct timer_wheel *wheel, uint64_t tick)
+{
+	struct itimerspec its;
+
+	if (tick == wheel->armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+
+	if (tick != TICK_NEVER) {
+		its.it_value.tv_sec = wheel->epoch.tv_sec + tick / 1000;
+		its.it_value.tv_nsec = wheel->epoch.tv_nsec +
+						(tick % 1000) * 1000000;
+		if (its.it_value.tv_nsec >= 1000000000) {
+			its.it_value.tv_sec++;
+			its.it_value.tv_nsec -= 1000000000;
+		}
+	}
+
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return;
+
+	wheel->armed = tick;
+}
+
+static void cascade(struct timer_wheel *wheel)
+{
+	unsigned int level;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = WHEEL_BITS * level;
+		unsigned int slot;
+		uint32_t index;
+
+		if (wheel->now & ((UINT64_C(1) << shift) - 1))
+			break;
+
+		slot = (wheel->now >> shift) & WHEEL_MASK;
+		index = wheel->slots[level][slot];
+		wheel->slots[level][slot] = TIMER_NONE;
+		wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+
+		while (index != TIMER_NONE) {
+			uint32_t next = wheel->timers[index].next;
+
+			link_timer(wheel, index);
+			index = next;
+		}
+	}
+}
+
+static void expire(struct timer_wheel *wheel)
+{
+	uint32_t *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+
+	while (*head != TIMER_NONE) {
+		uint32_t index = *head;
+		struct wheel_timer *timer = &wheel->timers[index];
+		timeout_func_t func = timer->func;
+		timeout_destroy_func_t destroy;
+		void *user_data = timer->user_data;
+		bool again;
+
+		unlink_timer(wheel, index);
+		timer->state = TIMER_RUNNING;
+
+		pthread_mutex_unlock(&wheel->lock);
+		again = func(user_data);
+		pthread_mutex_lock(&wheel->lock);
+
+		/* The callback may have added timers and moved the array */
+		timer = &wheel->timers[index];
+
+		if (again && timer->state == TIMER_RUNNING) {
+			timer->state = TIMER_QUEUED;
+			timer->expires = wheel->now +
+					(timer->interval ? timer->interval : 1);
+			link_timer(wheel, index);
+			continue;
+		}
+
+		destroy = timer->destroy;
+		release_timer(wheel, index);
+
+		if (destroy) {
+			pthread_mutex_unlock(&wheel->lock);
+			destroy(user_data);
+			pthread_mutex_lock(&wheel->lock);
+		}
+	}
+}
+
+static void advance(struct timer_wheel *wheel, uint64_t target)
+{
+	while (wheel->now < target) {
+		uint64_t next = next_event(wheel);
+
+		/* Nothing needs the slots in between, so skip over them */
+		if (next > target) {
+			wheel->now = target;
+			break;
+		}
+
+		wheel->now = next;
+		cascade(wheel);
+		expire(wheel);
+	}
+}
+
+static bool wheel_read(struct io *io, void *user_data)
+{
+	struct timer_wheel *wheel = user_data;
+	uint64_t expirations;
+
+	if (read(wheel->fd, &expirations, sizeof(expirations)) < 0)
+		return errno == EAGAIN;
+
+	pthread_mutex_lock(&wheel->lock);
+
+	/* The timerfd fired, so whatever it was set for has passed */
+	wheel->armed = TICK_NEVER;
+	advance(wheel, current_tick(wheel));
+	arm_timerfd(wheel, next_event(wheel));
+
+	pthread_mutex_unlock(&wheel->lock);
+
+	return true;
+}
+
+struct timer_wheel *timer_wheel_new(void)
+{
+	struct timer_wheel *wheel;
+
+	wheel = new0(struct timer_wheel, 1);
+	if (!wheel)
+		return NULL;
+
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0) {
+		free(wheel);
+		return NULL;
+	}
+
+	pthread_mutex_init(&wheel->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &wheel->epoch);
+	memset(wheel->slots, 0xff, sizeof(wheel->slots));
+	wheel->free_list = TIMER_NONE;
+	wheel->armed = TICK_NEVER;
+
+	/* The loop may dispatch as soon as the fd is registered */
+	wheel->io = io_new(wheel->fd);
+	if (!wheel->io || !io_set_read_handler(wheel->io, wheel_read,
+								wheel, NULL)) {
+		io_destroy(wheel->io);
+		close(wheel->fd);
+		pthread_mutex_destroy(&wheel->lock);
+		free(wheel);
+		return NULL;
+	}
+
+	return wheel;
+}
+
+void timer_wheel_free(struct timer_wheel *wheel)
+{
+	uint32_t i;
+
+	if (!wheel)
+		return;
+
+	io_destroy(wheel->io);
+	close(wheel->fd);
+
+	for (i = 0; i < wheel->capacity; i++) {
+		struct wheel_timer *timer = &wheel->timers[i];
+
+		if (timer->state != TIMER_FREE && timer->destroy)
+			timer->destroy(timer->user_data);
+	}
+
+	pthread_mutex_destroy(&wheel->lock);
+	free(wheel->timers);
+	free(wheel);
+}
+
+static void create_default(void)
+{
+	default_wheel = timer_wheel_new();
+}
+
+struct timer_wheel *timer_wheel_default(void)
+{
+	pthread_once(&default_once, create_default);
+
+	return default_wheel;
+}
+
+unsigned int timer_wheel_add(struct timer_wheel *wheel, unsigned int msec,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy)
+{
+	struct wheel_timer *timer;
+	uint64_t tick, expires;
+	unsigned int id;
+	uint32_t index;
+
+	if (!wheel || !func)
+		return 0;
+
+	pthread_mutex_lock(&wheel->lock);
+
+	tick = current_tick(wheel);
+
+	/* An idle wheel may be far behind; catch up so the levels fit */
+	if (!wheel->count)
+		wheel->now = tick;
+
+	index = alloc_timer(wheel);
+	if (index == TIMER_NONE) {
+		pthread_mutex_unlock(&wheel->lock);
+		return 0;
+	}
+
+	expires = tick + msec;
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+
+	timer = &wheel->timers[index];
+	timer->expires = expires;
+	timer->interval = msec;
+	timer->func = func;
+	timer->destroy = destroy;
+	timer->user_data = user_data;
+	timer->state = TIMER_QUEUED;
+	link_timer(wheel, index);
+
+	/* Only reprogram the timerfd if this comes before what it's set for */
+	tick = timer->level ? slot_tick(wheel->now, timer->level, timer->slot) :
+								expires;
+	if (tick < wheel->armed)
+		arm_timerfd(wheel, tick);
+
+	id = timer_id(wheel, index);
+
+	pthread_mutex_unlock(&wheel->lock);
+
+	return id;
+}
+
+bool timer_wheel_remove(struct timer_wheel *wheel, unsigned int id)
+{
+	struct wheel_timer *timer;
+	timeout_destroy_func_t destroy;
+	void *user_data;
+	uint32_t index;
+
+	if (!wheel)
+		return false;
+
+	pthread_mutex_lock(&wheel->lock);
+
+	timer = find_timer(wheel, id, &index);
+	if (!timer || timer->state == TIMER_CANCELLED) {
+		pthread_mutex_unlock(&wheel->lock);
+		return false;
+	}
+
+	/* A running timer is released once its callback returns */
+	if (timer->state == TIMER_RUNNING) {
+		timer->state = TIMER_CANCELLED;
+		pthread_mutex_unlock(&wheel->lock);
+		return true;
+	}
+
+	destroy = timer->destroy;
+	user_data = timer->user_data;
+	unlink_timer(wheel, index);
+	release_timer(wheel, index);
+
+	pthread_mutex_unlock(&wheel->lock);
+
+	if (destroy)
+		destroy(user_data);
+
+	return true;
+}
+
+unsigned int timer_wheel_pending(struct timer_wheel *wheel)
+{
+	unsigned int count;
+
+	pthread_mutex_lock(&wheel->lock);
+	count = wheel->count;
+	pthread_mutex_unlock(&wheel->lock);
+
+	return count;
+}
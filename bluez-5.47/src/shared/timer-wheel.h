@@ -0,0 +1,41 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#include <stdbool.h>
+
+#include "src/shared/timeout.h"
+
+/*
+ * A hierarchical timer wheel with millisecond ticks, served by a single
+ * timerfd on the main loop. Adding and removing a timer are O(1); the
+ * timerfd is only reprogrammed when a new timer expires before the one it
+ * is already set for. Timers can be added and removed from any thread;
+ * callbacks run on the loop thread without the wheel's lock held.
+ */
+
+struct timer_wheel;
+
+struct timer_wheel *timer_wheel_new(void);
+void timer_wheel_free(struct timer_wheel *wheel);
+
+/* The wheel behind timeout_add(), created on first use */
+struct timer_wheel *timer_wheel_default(void);
+
+unsigned int timer_wheel_add(struct timer_wheel *wheel, unsigned int msec,
+				timeout_func_t func, void *user_data,
+				timeout_destroy_func_t destroy);
+bool timer_wheel_remove(struct timer_wheel *wheel, unsigned int id);
+unsigned int timer_wheel_pending(struct timer_wheel *wheel);
@@ -0,0 +1,33 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#include <stdint.h>
+
+/*
+ * Frame lifecycle tracing hooks, provided by the application (Trace.cpp).
+ * An op queued while the sending thread has a frame open is tagged with it,
+ * and records how long it waited in the write queue and how long io_send
+ * took once it goes out.
+ */
+
+/* Stage numbers, matching Trace::Stage */
+#define TRACE_STAGE_WRITE_QUEUE	3
+#define TRACE_STAGE_IO_SEND	4
+
+uint64_t trace_current(void);
+uint64_t trace_now(void);
+void trace_record(uint64_t frame, unsigned int stage, uint64_t begin,
+							uint64_t end);
@@ -0,0 +1,204 @@
+// Sends one command to chemiond and prints its reply.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <getopt.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "Protocol.h"
+
+using namespace Chemion::Protocol;
+
+namespace {
+	void usage(const char *name) {
+		fprintf(stderr,
+			"Usage: %s [-s path] [-d device] command\n"
+			"  text TEXT\n"
+			"  scroll TEXT [delay_ms [edge_delay_ms [frames]]]\n"
+			"  image        reads 7 rows of 24 columns from stdin, with X for a lit pixel\n"
+			"  play FILE [loops]  plays an animation built with animc; 0 loops repeats until the next command\n"
+			"  clear\n"
+			"  framebuffer  takes over a device's framebuffer (needs -d) and publishes every 7 rows read from stdin\n"
+			"  status\n", name);
+	}
+
+	bool readImage(std::vector<uint8_t> &payload) {
+		payload.assign(24, 0);
+		char line[64];
+		for (size_t row = 0; row < 7; ++row) {
+			if (!fgets(line, sizeof(line), stdin))
+				return false;
+			for (size_t column = 0; column < 24 && line[column] != '\0' && line[column] != '\n'; ++column)
+				if (line[column] == 'X')
+					payload[column] |= 1 << row;
+		}
+		return true;
+	}
+
+	// Reads the reply along with the descriptor it may carry.
+	bool receiveReply(int fd, Reply &reply, int &attached) {
+		iovec iov {&reply, sizeof(reply)};
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		msghdr message {};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(reply))
+			return false;
+
+		attached = -1;
+		for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+			if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+				std::memcpy(&attached, CMSG_DATA(header), sizeof(int));
+		return true;
+	}
+
+	bool sendAll(int fd, const void *data, size_t size) {
+		for (size_t sent = 0; sent < size;) {
+			const ssize_t count = send(fd, static_cast<const char *>(data) + sent, size - sent, MSG_NOSIGNAL);
+			if (count <= 0)
+				return false;
+			sent += count;
+		}
+		return true;
+	}
+
+	const char * resultName(Result result) {
+		switch (result) {
+			case Result::OK: return "ok";
+			case Result::BadRequest: return "bad request";
+			case Result::NoDevice: return "no such device";
+			case Result::Unsupported: return "unsupported";
+		}
+		return "unknown";
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string path = DEFAULT_SOCKET;
+	Header header;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:d:h")) != -1) {
+		switch (opt) {
+			case 's': path = optarg; break;
+			case 'd': header.device = std::stoul(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const std::string command = argv[optind];
+	const int arguments = argc - optind - 1;
+	std::vector<uint8_t> payload;
+
+	if (command == "text" && arguments == 1) {
+		header.command = Command::ShowText;
+		payload.assign(argv[optind + 1], argv[optind + 1] + strlen(argv[optind + 1]));
+	} else if (command == "scroll" && 1 <= arguments && arguments <= 4) {
+		header.command = Command::Scroll;
+		const ScrollHeader scroll {
+			htole16(2 <= arguments? std::stoul(argv[optind + 2]) : 200),
+			htole16(3 <= arguments? std::stoul(argv[optind + 3]) : 800),
+			htole32(4 <= arguments? std::stoul(argv[optind + 4]) : 0),
+		};
+		payload.resize(sizeof(scroll));
+		std::memcpy(payload.data(), &scroll, sizeof(scroll));
+		payload.insert(payload.end(), argv[optind + 1], argv[optind + 1] + strlen(argv[optind + 1]));
+	} else if (command == "image" && arguments == 0) {
+		header.command = Command::ShowImage;
+		if (!readImage(payload)) {
+			fprintf(stderr, "Expected 7 rows on stdin.\n");
+			return 1;
+		}
+	} else if (command == "play" && 1 <= arguments && arguments <= 2) {
+		header.command = Command::Play;
+		// The daemon has its own working directory.
+		char *file = realpath(argv[optind + 1], nullptr);
+		if (!file) {
+			perror(argv[optind + 1]);
+			return 1;
+		}
+		const PlayHeader play {htole32(arguments == 2? std::stoul(argv[optind + 2]) : 1)};
+		payload.resize(sizeof(play));
+		std::memcpy(payload.data(), &play, sizeof(play));
+		payload.insert(payload.end(), file, file + strlen(file));
+		free(file);
+	} else if (command == "clear" && arguments == 0) {
+		header.command = Command::Clear;
+	} else if (command == "status" && arguments == 0) {
+		header.command = Command::Status;
+	} else if (command == "framebuffer" && arguments == 0 && header.device != ALL_DEVICES) {
+		header.command = Command::Framebuffer;
+	} else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (MAX_PAYLOAD < payload.size()) {
+		fprintf(stderr, "Payload too long (%lu bytes, at most %lu).\n", payload.size(), MAX_PAYLOAD);
+		return 1;
+	}
+	header.length = htole16(payload.size());
+
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+	if (sizeof(address.sun_path) <= path.size()) {
+		fprintf(stderr, "Socket path too long.\n");
+		return 1;
+	}
+	std::strcpy(address.sun_path, path.c_str());
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+		perror("chemionctl");
+		return 1;
+	}
+
+	Reply reply;
+	int attached;
+	if (!sendAll(fd, &header, sizeof(header)) || !sendAll(fd, payload.data(), payload.size())
+		|| !receiveReply(fd, reply, attached)) {
+		fprintf(stderr, "No reply from %s.\n", path.c_str());
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("%s (%u of %u devices connected)\n", resultName(reply.result), reply.connected, reply.devices);
+	if (reply.result != Result::OK)
+		return 1;
+
+	if (header.command == Command::Framebuffer) {
+		Chemion::Framebuffer framebuffer(attached);
+		if (!framebuffer.isOpen()) {
+			fprintf(stderr, "No usable framebuffer in the reply.\n");
+			return 1;
+		}
+
+		std::vector<uint8_t> columns;
+		while (readImage(columns)) {
+			Chemion::Framebuffer::Pixels pixels;
+			std::copy(columns.begin(), columns.end(), pixels.begin());
+			framebuffer.publish(pixels);
+		}
+	}
+
+	return 0;
+}
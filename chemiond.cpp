@@ -0,0 +1,95 @@
+// Keeps the given glasses connected and shows what clients send to its command socket (see Protocol.h, and
+// chemionctl for a client).
+
+#include <csignal>
+#include <getopt.h>
+#include <optional>
+#include <pthread.h>
+#include <string>
+
+#include "Daemon.h"
+#include "Debug.h"
+#include "EventLoop.h"
+#include "Metrics.h"
+#include "Protocol.h"
+#include "Transport.h"
+
+namespace {
+	void usage(const char *name) {
+		fprintf(stderr, "Usage: %s [-s path] [-i hci_index] [-m metrics_path] [-v vglasses_path] address[/public]...\n", name);
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string path = Chemion::Protocol::DEFAULT_SOCKET;
+	uint16_t index = 0;
+	const char *metrics_path = nullptr;
+	const char *virtual_path = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:i:m:v:h")) != -1) {
+		switch (opt) {
+			case 's': path = optarg; break;
+			case 'i': index = std::stoul(optarg); break;
+			case 'm': metrics_path = optarg; break;
+			case 'v': virtual_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Every thread started from here on inherits the mask, so the signals only ever reach sigwait below.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	EventLoop event_loop;
+	event_loop.start();
+
+	std::optional<Metrics::Server> metrics;
+	if (metrics_path) {
+		metrics.emplace(metrics_path);
+		if (!metrics->start())
+			metrics.reset();
+	}
+
+	Chemion::Daemon::TransportFactory factory;
+	Chemion::ReconnectPolicy policy;
+	if (virtual_path) {
+		factory = [virtual_path](uint16_t) { return std::make_shared<SocketTransport>(virtual_path); };
+	} else {
+		// Let the controller reconnect as soon as the glasses advertise again.
+		policy.autoConnect = true;
+	}
+
+	Chemion::Daemon daemon(path, index, factory);
+	daemon.setReconnectPolicy(policy);
+
+	for (int i = optind; i < argc; ++i) {
+		const std::string argument = argv[i];
+		const size_t slash = argument.find('/');
+		if (slash == std::string::npos)
+			daemon.add(argument);
+		else
+			daemon.add(argument.substr(0, slash), argument.substr(slash + 1));
+	}
+
+	if (!daemon.start())
+		return 1;
+	DBG("Listening on %s for %d device(s).", path.c_str(), argc - optind);
+
+	int signal;
+	sigwait(&signals, &signal);
+	DBG("Stopping.");
+
+	daemon.stop();
+	return 0;
+}
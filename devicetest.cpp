@@ -0,0 +1,92 @@
+// Exercises DeviceManager against fake glasses, with one FakeTransport standing in for each adapter: spreading new
+// glasses, moving one off a saturated adapter and evacuating a removed adapter, including a device whose link dropped
+// before the evacuation. Exits nonzero if any check fails.
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "DeviceManager.h"
+#include "EventLoop.h"
+#include "FakePeripheral.h"
+#include "Transport.h"
+
+namespace {
+	using Check::check;
+	using Check::failures;
+
+	size_t linksOn(Chemion::DeviceManager &manager, uint16_t index) {
+		for (const auto &adapter: manager.getAdapters())
+			if (adapter.index == index)
+				return adapter.links;
+		return 0;
+	}
+
+	size_t hostedOn(Chemion::DeviceManager &manager, const std::vector<Chemion::Glasses *> &glasses, uint16_t index) {
+		size_t count = 0;
+		for (const auto *one: glasses)
+			if (manager.adapterOf(*one) == index)
+				++count;
+		return count;
+	}
+}
+
+int main() {
+	EventLoop event_loop;
+	event_loop.start();
+
+	std::map<uint16_t, std::shared_ptr<FakeTransport>> transports;
+	for (uint16_t index = 0; index < 2; ++index)
+		transports[index] = std::make_shared<FakeTransport>();
+
+	Chemion::BalancePolicy policy;
+	policy.maxLinks = 4;
+	policy.saturation = .5;
+	// Only link counts matter here.
+	policy.maxThroughput = 1e12;
+
+	{
+		Chemion::DeviceManager manager(policy, [&transports](uint16_t index) { return transports.at(index); });
+		manager.addAdapter(0);
+
+		std::vector<Chemion::Glasses *> glasses;
+		for (const char *address: {"00:00:00:00:00:01", "00:00:00:00:00:02", "00:00:00:00:00:03"})
+			glasses.push_back(manager.add(address));
+
+		check(std::find(glasses.begin(), glasses.end(), nullptr) == glasses.end(), "add connects every device");
+		if (failures != 0)
+			return 1;
+		check(linksOn(manager, 0) == 3, "add counts the links on hci0");
+
+		// Three of four links is over the saturation threshold; one device should move to the new adapter.
+		manager.addAdapter(1);
+		check(manager.rebalance() == 1, "rebalance moves one device off a saturated adapter");
+		check(hostedOn(manager, glasses, 0) == 2 && hostedOn(manager, glasses, 1) == 1, "the device is on hci1");
+		check(linksOn(manager, 0) == 2 && linksOn(manager, 1) == 1, "links follow the move");
+		check(manager.rebalance() == 0, "rebalance leaves a balanced pair alone");
+
+		// Drop the moved device's link, then take its adapter away: sample() counts the dark link as zero, and the
+		// evacuation mustn't take it off the count a second time.
+		transports[1]->getPeripheral()->stop();
+		Chemion::Glasses *moved = nullptr;
+		for (auto *one: glasses)
+			if (manager.adapterOf(*one) == 1)
+				moved = one;
+		for (int i = 0; i < 1000 && moved->isConnected(); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		check(!moved->isConnected(), "stopping the peripheral drops the link");
+
+		manager.removeAdapter(1);
+		check(manager.rebalance() == 1, "rebalance evacuates a removed adapter");
+		check(hostedOn(manager, glasses, 0) == 3, "every device is back on hci0");
+		check(moved->isConnected(), "the evacuated device reconnected");
+		check(linksOn(manager, 0) == 3 && linksOn(manager, 1) == 0, "link counts don't underflow");
+		check(manager.getMigrations() == 2, "two migrations were counted");
+	}
+
+	return Check::finish();
+}
@@ -0,0 +1,152 @@
+// Exercises GlassesGroup against many fake glasses at once: connecting them concurrently, growing the group while
+// frames are being queued, presenting frames to every member, and reporting skew when one member drops out. Exits
+// nonzero if any check fails.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "Encoder.h"
+#include "EventLoop.h"
+#include "FakePeripheral.h"
+#include "GlassesGroup.h"
+#include "Transport.h"
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+	using Check::check;
+
+	// One FakeTransport per address, so each member's peripheral can be found again.
+	class Fakes {
+		private:
+			std::mutex mutex;
+			std::map<std::string, std::shared_ptr<FakeTransport>> transports;
+
+		public:
+			std::shared_ptr<Transport> make(const std::string &address) {
+				std::unique_lock lock(mutex);
+				auto &transport = transports[address];
+				transport = std::make_shared<FakeTransport>();
+				return transport;
+			}
+
+			std::shared_ptr<FakePeripheral> peripheral(const std::string &address) {
+				std::unique_lock lock(mutex);
+				return transports.at(address)->getPeripheral();
+			}
+	};
+
+	std::vector<std::string> addresses(size_t first, size_t count) {
+		std::vector<std::string> out;
+		for (size_t i = first; i < first + count; ++i) {
+			char address[18];
+			snprintf(address, sizeof(address), "00:00:00:00:%02lx:%02lx", (i >> 8) & 0xff, i & 0xff);
+			out.emplace_back(address);
+		}
+		return out;
+	}
+
+	std::optional<Chemion::PresentReport> waitForReport(Chemion::GlassesGroup &group, uint64_t id) {
+		const auto deadline = Clock::now() + std::chrono::seconds(10);
+		while (Clock::now() < deadline) {
+			const auto report = group.getLastReport();
+			if (report && id <= report->frame)
+				return report;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return std::nullopt;
+	}
+}
+
+int main(int argc, char **argv) {
+	size_t count = 32;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n': count = std::stoul(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n glasses]\n", argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	EventLoop event_loop;
+	event_loop.start();
+
+	Fakes fakes;
+
+	{
+		Chemion::GlassesGroup group(0, [&fakes](const std::string &address) { return fakes.make(address); });
+
+		const auto first = addresses(0, count / 2);
+		check(group.connect(first) == first.size(), "the first half connects");
+
+		// Queue frames from another thread while the second half joins, as a show running during discovery would.
+		std::atomic_bool joining {true};
+		std::thread sender([&] {
+			for (size_t frame = 0; joining; ++frame) {
+				group.showString(std::to_string(frame % 100));
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		});
+
+		const auto second = addresses(count / 2, count - count / 2);
+		check(group.connect(second) == second.size(), "the second half connects while frames are queued");
+		joining = false;
+		sender.join();
+		check(group.size() == count, "every member joined");
+
+		uint64_t id = 0;
+		for (size_t frame = 0; frame < 20; ++frame) {
+			id = group.present(std::make_shared<const std::vector<uint8_t>>(Chemion::encodeString(std::to_string(frame))),
+				Clock::now() + std::chrono::milliseconds(50));
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+
+		const auto report = waitForReport(group, id);
+		check(report && report->offsets.size() == count, "every present is reported");
+
+		size_t silent = 0, corrupt = 0;
+		for (size_t i = 0; i < group.size(); ++i) {
+			const auto stats = fakes.peripheral(group.addressOf(i))->getStats();
+			silent += stats.frames == 0;
+			corrupt += stats.corrupt;
+		}
+		check(silent == 0, "every peripheral received frames");
+		check(corrupt == 0, "no peripheral saw a corrupt frame");
+
+		// A generous target, so only the member that drops out can fail it.
+		group.setTargetSkew(std::chrono::seconds(1));
+		id = group.present(std::make_shared<const std::vector<uint8_t>>(Chemion::encodeString("in")),
+			Clock::now() + std::chrono::milliseconds(50));
+		const auto together = waitForReport(group, id);
+		check(together && together->frame == id && together->withinTarget, "a frame every member sent is within target");
+
+		fakes.peripheral(group.addressOf(0))->stop();
+		for (int i = 0; i < 1000 && group[0].isConnected(); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		id = group.present(std::make_shared<const std::vector<uint8_t>>(Chemion::encodeString("out")),
+			Clock::now() + std::chrono::milliseconds(50));
+		const auto missing = waitForReport(group, id);
+		check(missing && missing->frame == id && !missing->offsets[0], "the dropped member has no offset");
+		check(missing && !missing->withinTarget, "a frame a member missed isn't within target");
+
+		size_t sent = 0;
+		for (size_t i = 0; i < group.size(); ++i)
+			sent += group.getStats(i).sent;
+		printf("%lu members, %lu frames sent in total\n", count, sent);
+	}
+
+	return Check::finish();
+}
@@ -1,17 +1,54 @@
 // Contains code from bluepy.
 
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "Animation.h"
 #include "Bluetooth.h"
 #include "Debug.h"
 #include "Encoder.h"
+#include "EventLoop.h"
 #include "Glasses.h"
 #include "Image.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "Scanner.h"
 #include "Scroller.h"
-#include "Timer.h"
+#include "Trace.h"
+
+// Seconds since the process was started, measured from the kernel's record of it the way ps does.
+static double processAge() {
+	std::ifstream stat("/proc/self/stat");
+	std::string line;
+	if (!std::getline(stat, line) || line.rfind(')') == std::string::npos)
+		return 0;
+
+	// The command name can contain spaces, so count fields from after it. The start time is field 22.
+	std::istringstream fields(line.substr(line.rfind(')') + 2));
+	std::string field;
+	for (int i = 3; i <= 22; ++i)
+		fields >> field;
+
+	timespec now;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	return now.tv_sec + now.tv_nsec / 1e9 - std::stod(field) / sysconf(_SC_CLK_TCK);
+}
 
 int main() {
-	GMainLoop *event_loop = g_main_loop_new(nullptr, false);
+	EventLoop event_loop;
 	bool running = true;
 
+	// Scrape with curl --unix-socket $CHEMION_METRICS http://localhost/metrics
+	std::optional<Metrics::Server> metrics;
+	if (const char *path = getenv("CHEMION_METRICS")) {
+		metrics.emplace(path);
+		if (!metrics->start())
+			metrics.reset();
+	}
+
 	std::thread th([&] {
 		auto wait = [](size_t millis) { std::this_thread::sleep_for(std::chrono::milliseconds(millis)); };
 
@@ -19,12 +56,25 @@ int main() {
 
 		glasses.setup(0);
 
-		if (!glasses.connect("EB:9F:86:0E:E2:F4")) {
+		if (const char *snoop = getenv("CHEMION_BTSNOOP"))
+			glasses.setCapture(std::make_shared<Capture>(snoop));
+
+		// Without a fixed address, connect to whichever glasses are advertising nearby.
+		bool connected;
+		if (const char *address = getenv("CHEMION_ADDRESS")) {
+			connected = glasses.connect(address);
+		} else {
+			Scanner scanner(0);
+			connected = glasses.connect(scanner);
+		}
+
+		if (!connected) {
 			DBG("Couldn't connect to glasses.");
 			return;
 		}
 
-		DBG("Connection complete.");
+		DBG("Connected to %s %.3f s after start (connecting took %.3f s).", glasses.getAddress().c_str(), processAge(),
+			std::chrono::duration<double>(glasses.getConnectTime()).count());
 
 		// const char *image1 =
 		// 	" XXX X  X XXX  XXXX XXX \n"
@@ -90,6 +140,14 @@ int main() {
 		// const auto enc1 = Chemion::fromColumns(std::span(cols1));
 		// const auto enc2 = Chemion::fromColumns(std::span(cols2));
 
+		// A show compiled by animc replaces the demo below.
+		if (const char *path = getenv("CHEMION_ANIMATION")) {
+			const Chemion::Animation animation(path);
+			if (animation.isOpen() && !glasses.play(animation))
+				DBG("Playing %s stopped early.", path);
+			return;
+		}
+
 		glasses.showString("Hello,");
 		wait(2'000);
 		glasses.showString("World!");
@@ -122,9 +180,14 @@ int main() {
 	});
 
 	DBG("Starting loop");
-	g_main_loop_run(event_loop);
+	event_loop.run();
 	DBG("Exiting loop");
 
 	running = false;
 	th.join();
+	Profiler::summary();
+
+	// Open in Perfetto to see where each frame spent its time.
+	if (const char *trace = getenv("CHEMION_TRACE"); trace && !Trace::save(trace))
+		DBG("Couldn't write the trace to %s", trace);
 }
@@ -0,0 +1,367 @@
+// Replays a recorded show through the full Glasses -> Bluetooth -> GAttrib stack against a FakePeripheral, either at the
+// recorded pace or as fast as the stack allows, and reports throughput, per-frame CPU time and allocations.
+//
+// Input is either a btsnoop capture (monitor or HCI format, e.g. from CHEMION_BTSNOOP) or a text file with one frame
+// per line: "<seconds> <hex>". Lines starting with # are ignored.
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Debug.h"
+#include "Encoder.h"
+#include "EventLoop.h"
+#include "FakePeripheral.h"
+#include "Glasses.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "Transport.h"
+
+extern "C" {
+#include "src/shared/btsnoop.h"
+
+void * __libc_malloc(size_t);
+void * __libc_calloc(size_t, size_t);
+void * __libc_realloc(void *, size_t);
+void * __libc_memalign(size_t, size_t);
+void __libc_free(void *);
+}
+
+// Allocation counting by interposing malloc. Only the sending thread and the loop thread are the stack under test, so
+// only they are counted; the peripheral, logger, capture and GLib helper threads never are, even before they've done
+// anything that would identify them.
+namespace {
+	std::atomic_uint64_t allocations {0};
+	std::atomic<pthread_t> countedThreads[2] {};
+
+	inline void counted() {
+		const pthread_t self = pthread_self();
+		for (const auto &thread: countedThreads)
+			if (pthread_equal(thread.load(std::memory_order_relaxed), self)) {
+				allocations.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+	}
+}
+
+extern "C" {
+void * malloc(size_t size) {
+	counted();
+	return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) {
+	counted();
+	return __libc_calloc(count, size);
+}
+
+void * realloc(void *pointer, size_t size) {
+	counted();
+	return __libc_realloc(pointer, size);
+}
+
+void * memalign(size_t alignment, size_t size) {
+	counted();
+	return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+	counted();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+	counted();
+	void *pointer = __libc_memalign(alignment, size);
+	if (pointer == nullptr)
+		return ENOMEM;
+	*out = pointer;
+	return 0;
+}
+
+void free(void *pointer) {
+	__libc_free(pointer);
+}
+}
+
+namespace {
+	using Clock = std::chrono::steady_clock;
+
+	struct RecordedFrame {
+		std::chrono::nanoseconds at;
+		std::vector<uint8_t> bytes;
+	};
+
+	uint32_t get32be(const uint8_t *data) {
+		return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	}
+
+	uint64_t get64be(const uint8_t *data) {
+		return (static_cast<uint64_t>(get32be(data)) << 32) | get32be(data + 4);
+	}
+
+	// Pulls the values of ATT writes out of a capture and splits the resulting byte stream back into frames.
+	bool loadSnoop(const std::vector<uint8_t> &file, std::vector<RecordedFrame> &frames) {
+		if (file.size() < 16)
+			return false;
+
+		const uint32_t format = get32be(&file[12]);
+		if (format != BTSNOOP_FORMAT_MONITOR && format != BTSNOOP_FORMAT_HCI) {
+			DBG("Unsupported btsnoop format %u", format);
+			return false;
+		}
+
+		std::vector<uint8_t> stream;
+		std::optional<uint64_t> first;
+		uint64_t frame_start = 0;
+		size_t offset = 16;
+
+		while (offset + 24 <= file.size()) {
+			const uint32_t length = get32be(&file[offset + 4]);
+			const uint32_t flags = get32be(&file[offset + 8]);
+			const uint64_t timestamp = get64be(&file[offset + 16]);
+			const uint8_t *data = &file[offset + 24];
+			offset += 24 + length;
+			if (file.size() < offset)
+				break;
+
+			// Monitor format puts the opcode in the flags; HCI format uses bit 0 for direction and bit 1 for command/event.
+			const bool sent_acl = format == BTSNOOP_FORMAT_MONITOR? (flags & 0xffff) == BTSNOOP_OPCODE_ACL_TX_PKT : (flags & 3) == 0;
+			if (!sent_acl || length < 8 + 3)
+				continue;
+
+			const uint16_t cid = data[6] | (data[7] << 8);
+			const uint8_t opcode = data[8];
+			if (cid != 4 || (opcode != ATT_OP_WRITE_CMD && opcode != ATT_OP_WRITE_REQ))
+				continue;
+
+			if (!first)
+				first = timestamp;
+
+			if (stream.empty())
+				frame_start = timestamp;
+			stream.insert(stream.end(), data + 11, data + length);
+
+			// Resynchronise on the frame header if the capture starts mid-frame or a chunk was dropped.
+			while (!stream.empty() && stream[0] != Chemion::FRAME_HEADER)
+				stream.erase(stream.begin());
+
+			while (Chemion::FRAME_SIZE <= stream.size()) {
+				frames.push_back({std::chrono::microseconds(frame_start - *first),
+					std::vector<uint8_t>(stream.begin(), stream.begin() + Chemion::FRAME_SIZE)});
+				stream.erase(stream.begin(), stream.begin() + Chemion::FRAME_SIZE);
+				frame_start = timestamp;
+			}
+		}
+
+		return true;
+	}
+
+	bool loadText(std::istream &stream, std::vector<RecordedFrame> &frames) {
+		std::string line;
+		size_t number = 0;
+
+		while (std::getline(stream, line)) {
+			++number;
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			std::istringstream fields(line);
+			double seconds;
+			std::string hex;
+			if (!(fields >> seconds >> hex) || hex.size() % 2 != 0) {
+				DBG("Bad line %lu", number);
+				return false;
+			}
+
+			RecordedFrame frame {std::chrono::nanoseconds(static_cast<int64_t>(seconds * 1e9)), {}};
+			for (size_t i = 0; i < hex.size(); i += 2)
+				frame.bytes.push_back(std::stoul(hex.substr(i, 2), nullptr, 16));
+			frames.push_back(std::move(frame));
+		}
+
+		return true;
+	}
+
+	bool load(const char *path, std::vector<RecordedFrame> &frames) {
+		std::ifstream stream(path, std::ios::binary);
+		if (!stream) {
+			DBG("Couldn't open %s", path);
+			return false;
+		}
+
+		char magic[8] {};
+		stream.read(magic, sizeof(magic));
+		stream.clear();
+		stream.seekg(0);
+
+		if (std::memcmp(magic, "btsnoop", 8) == 0) {
+			std::vector<uint8_t> file((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+			return loadSnoop(file, frames);
+		}
+
+		return loadText(stream, frames);
+	}
+
+	std::chrono::nanoseconds cpuTime(clockid_t clock) {
+		timespec spec;
+		clock_gettime(clock, &spec);
+		return std::chrono::seconds(spec.tv_sec) + std::chrono::nanoseconds(spec.tv_nsec);
+	}
+
+	template <typename T>
+	T percentile(std::vector<T> values, double fraction) {
+		if (values.empty())
+			return {};
+		std::sort(values.begin(), values.end());
+		return values[std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()))];
+	}
+
+	void usage(const char *name) {
+		fprintf(stderr, "Usage: %s [-f] [-r] [-n loops] [-t trace.json] <capture.btsnoop | frames.txt>\n", name);
+		fprintf(stderr, "  -f  as fast as possible instead of at the recorded pace\n");
+		fprintf(stderr, "  -r  use acknowledged Write Requests\n");
+		fprintf(stderr, "  -n  replay the recording this many times\n");
+		fprintf(stderr, "  -t  write each frame's stages as a Chrome trace, for Perfetto\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	bool fast = false;
+	bool requests = false;
+	size_t loops = 1;
+	const char *trace = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "frn:t:h")) != -1) {
+		switch (opt) {
+			case 'f': fast = true; break;
+			case 'r': requests = true; break;
+			case 'n': loops = std::max(1ul, std::stoul(optarg)); break;
+			case 't': trace = optarg; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<RecordedFrame> frames;
+	if (!load(argv[optind], frames) || frames.empty()) {
+		DBG("No frames to replay.");
+		return 1;
+	}
+
+	EventLoop event_loop;
+	event_loop.start();
+	countedThreads[0] = pthread_self();
+	countedThreads[1] = event_loop.getThread().native_handle();
+	clockid_t loop_clock;
+	pthread_getcpuclockid(event_loop.getThread().native_handle(), &loop_clock);
+
+	int status = 0;
+
+	{
+		auto transport = std::make_shared<FakeTransport>();
+		Chemion::Glasses glasses;
+		glasses.setTransport(transport);
+		if (requests)
+			glasses.setWriteMode(Bluetooth::WriteMode::Request);
+
+		if (!glasses.connect("00:00:00:00:00:00")) {
+			DBG("Couldn't connect to the fake peripheral.");
+			return 1;
+		}
+
+		auto peripheral = transport->getPeripheral();
+		std::atomic_size_t received {0};
+		peripheral->onFrame([&received](const std::vector<uint8_t> &, FakePeripheral::Clock::time_point) {
+			++received;
+		});
+
+		const size_t total = frames.size() * loops;
+		std::vector<std::chrono::nanoseconds> cpu;
+		std::vector<uint64_t> allocs;
+		cpu.reserve(total);
+		allocs.reserve(total);
+		size_t failed = 0;
+
+		const auto start = Clock::now();
+		auto previous_cpu = cpuTime(CLOCK_THREAD_CPUTIME_ID) + cpuTime(loop_clock);
+		auto previous_allocs = allocations.load();
+
+		// A frame's cost is everything the sending and loop threads do between its submission and the next one's.
+		auto sample = [&] {
+			const auto now_cpu = cpuTime(CLOCK_THREAD_CPUTIME_ID) + cpuTime(loop_clock);
+			const auto now_allocs = allocations.load();
+			cpu.push_back(now_cpu - previous_cpu);
+			allocs.push_back(now_allocs - previous_allocs);
+			previous_cpu = now_cpu;
+			previous_allocs = now_allocs;
+		};
+
+		for (size_t loop = 0; loop < loops; ++loop) {
+			const auto loop_start = Clock::now();
+			for (size_t i = 0; i < frames.size(); ++i) {
+				if (!fast)
+					std::this_thread::sleep_until(loop_start + frames[i].at);
+				if (i != 0 || loop != 0)
+					sample();
+				if (!glasses.sendFrame(frames[i].bytes))
+					++failed;
+			}
+		}
+
+		glasses.waitForDrain(std::chrono::seconds(10));
+		while (received < total - failed && Clock::now() - start < std::chrono::seconds(60))
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		sample();
+
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		const auto stats = peripheral->getStats();
+		uint64_t total_allocs = 0;
+		for (const auto count: allocs)
+			total_allocs += count;
+
+		auto us = [](std::chrono::nanoseconds time) { return time.count() / 1'000.; };
+
+		printf("frames:       %lu sent, %lu received, %lu failed, %lu corrupt\n", total, received.load(), failed, stats.corrupt);
+		printf("throughput:   %.1f frames/s over %.3f s (%s)\n", total / seconds, seconds, fast? "unpaced" : "recorded pace");
+		printf("cpu/frame:    p50 %.1f us, p99 %.1f us, max %.1f us\n", us(percentile(cpu, .5)), us(percentile(cpu, .99)),
+			us(*std::max_element(cpu.begin(), cpu.end())));
+		printf("allocs/frame: %.2f mean, p50 %lu, p99 %lu\n", static_cast<double>(total_allocs) / total,
+			percentile(allocs, .5), percentile(allocs, .99));
+
+		const auto att = glasses.getAttAllocStats();
+		printf("bt_att:       %lu pooled ops reused, %lu heap ops, %lu queue overflows\n", att.pool_hits, att.op_allocs,
+			att.queue_allocs);
+
+		const auto latency = glasses.getSendLatency();
+		if (latency.count != 0)
+			printf("send latency: %.1f us mean, %.1f us max over %lu commands\n", us(latency.total / latency.count),
+				us(latency.max), latency.count);
+
+		Profiler::summary(stdout);
+
+		if (trace && !Trace::save(trace))
+			DBG("Couldn't write the trace to %s", trace);
+
+		if (failed != 0 || received != total || stats.corrupt != 0)
+			status = 2;
+	}
+
+	return status;
+}
@@ -0,0 +1,137 @@
+// A virtual pair of glasses: listens on a Unix socket and speaks ATT to whoever connects (through SocketTransport),
+// with link timing modelled on a BLE connection. Logs every frame it receives along with its timing and validity.
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <list>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Debug.h"
+#include "Encoder.h"
+#include "VirtualPeripheral.h"
+
+namespace {
+	volatile std::sig_atomic_t running = 1;
+
+	void stop(int) {
+		running = 0;
+	}
+
+	void usage(const char *name) {
+		fprintf(stderr, "Usage: %s [-s path] [-i interval_ms] [-p packets_per_event] [-m mtu] [-l loss_rate] [-v]\n", name);
+	}
+
+	void attach(VirtualPeripheral &peripheral, size_t id, bool verbose) {
+		auto last = std::make_shared<std::optional<FakePeripheral::Clock::time_point>>();
+		auto count = std::make_shared<size_t>(0);
+		const auto start = FakePeripheral::Clock::now();
+
+		peripheral.onFrame([=](const std::vector<uint8_t> &frame, FakePeripheral::Clock::time_point when) {
+			using std::chrono::duration;
+			const double at = duration<double, std::milli>(when - start).count();
+			const double interval = *last? duration<double, std::milli>(when - **last).count() : 0.;
+			*last = when;
+
+			const auto pixels = Chemion::decode(frame);
+			// This is the tool's output rather than diagnostics, so it goes to stdout whatever LOG_LEVEL is and however
+			// fast frames arrive.
+			printf("[%lu] frame %lu at %.3f ms (+%.3f ms)%s\n", id, (*count)++, at, interval, pixels? "" : " INVALID");
+
+			if (verbose && pixels)
+				for (size_t row = 0; row < 7; ++row)
+					printf("[%lu]   |%.24s|\n", id, pixels->data() + row * 24);
+		});
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string path = "/tmp/vglasses.sock";
+	LinkModel model;
+	bool verbose = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:i:p:m:l:vh")) != -1) {
+		switch (opt) {
+			case 's': path = optarg; break;
+			case 'i': model.connectionInterval = std::chrono::microseconds(static_cast<long>(std::stod(optarg) * 1000)); break;
+			case 'p': model.packetsPerEvent = std::stoul(optarg); break;
+			case 'm': model.mtu = std::stoul(optarg); break;
+			case 'l': model.lossRate = std::stod(optarg); break;
+			case 'v': verbose = true; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h'? 0 : 1;
+		}
+	}
+
+	if (model.packetsPerEvent == 0 || model.mtu < 23 || model.lossRate < 0. || 1. <= model.lossRate) {
+		fprintf(stderr, "Need at least one packet per event, an MTU of at least 23 and a loss rate in [0, 1).\n");
+		return 1;
+	}
+
+	sockaddr_un address {};
+	address.sun_family = AF_UNIX;
+	if (sizeof(address.sun_path) <= path.size()) {
+		fprintf(stderr, "Socket path too long.\n");
+		return 1;
+	}
+	std::strcpy(address.sun_path, path.c_str());
+
+	const int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	unlink(path.c_str());
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listener, 8) < 0) {
+		perror("vglasses");
+		return 1;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	// Frames should show up as they arrive even when piped.
+	setvbuf(stdout, nullptr, _IOLBF, 0);
+
+	printf("Listening on %s: %.2f ms interval, %lu packets/event, MTU %u, %.1f%% loss\n", path.c_str(),
+		model.connectionInterval.count() / 1000., model.packetsPerEvent, model.mtu, model.lossRate * 100.);
+
+	std::list<std::unique_ptr<VirtualPeripheral>> peripherals;
+	size_t next_id = 0;
+
+	while (running) {
+		pollfd pfd {listener, POLLIN, 0};
+		if (poll(&pfd, 1, 250) <= 0)
+			continue;
+
+		const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			DBG("accept failed: %s", strerror(errno));
+			continue;
+		}
+
+		// Clear out peripherals whose clients have gone away.
+		peripherals.remove_if([](const auto &peripheral) {
+			if (peripheral->isRunning())
+				return false;
+			const auto stats = peripheral->getStats();
+			printf("Client left after %lu frames (%lu corrupt), %lu retransmissions\n", stats.frames, stats.corrupt,
+				peripheral->getRetransmissions());
+			return true;
+		});
+
+		const size_t id = next_id++;
+		printf("[%lu] Client connected\n", id);
+		auto &peripheral = peripherals.emplace_back(std::make_unique<VirtualPeripheral>(fd, model));
+		attach(*peripheral, id, verbose);
+		peripheral->start();
+	}
+
+	peripherals.clear();
+	close(listener);
+	unlink(path.c_str());
+	return 0;
+}